@@ -0,0 +1,482 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <stdint.h>
+#include <inttypes.h>  // PRIu32
+#include <math.h>      // INFINITY
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2 and AVX2 intrinsics
+#endif
+
+#include "common.h"
+#include "aggregation.h"
+
+/*
+ * Scalar kernels, used when no SIMD instruction set is available and for the
+ * remaining points of the vectorized kernels.
+ */
+
+static uint32_t aggregate_sum_scalar(const uint32_t *timestamps,
+                                     const double *values,
+                                     uint32_t nb_points, uint32_t start,
+                                     uint32_t step, double *value) {
+
+    uint32_t i = 0, nb_known = 0;
+    double sum = 0.0;
+
+    for (i = 0; i < nb_points; i++, start += step) {
+        if (timestamps[i] == start) {
+            sum += values[i];
+            nb_known++;
+        }
+    }
+
+    *value = sum;
+    return nb_known;
+}
+
+static uint32_t aggregate_min_scalar(const uint32_t *timestamps,
+                                     const double *values,
+                                     uint32_t nb_points, uint32_t start,
+                                     uint32_t step, double *value) {
+
+    uint32_t i = 0, nb_known = 0;
+    double min = INFINITY;
+
+    for (i = 0; i < nb_points; i++, start += step) {
+        if (timestamps[i] == start) {
+            if (values[i] < min) min = values[i];
+            nb_known++;
+        }
+    }
+
+    *value = min;
+    return nb_known;
+}
+
+static uint32_t aggregate_max_scalar(const uint32_t *timestamps,
+                                     const double *values,
+                                     uint32_t nb_points, uint32_t start,
+                                     uint32_t step, double *value) {
+
+    uint32_t i = 0, nb_known = 0;
+    double max = -INFINITY;
+
+    for (i = 0; i < nb_points; i++, start += step) {
+        if (timestamps[i] == start) {
+            if (values[i] > max) max = values[i];
+            nb_known++;
+        }
+    }
+
+    *value = max;
+    return nb_known;
+}
+
+/*
+ * The last known value is found by scanning backward, which stops at the first
+ * known point. The known points before it are then counted for xff by a
+ * forward loop, the points after it being all unknown.
+ */
+static uint32_t aggregate_last(const uint32_t *timestamps,
+                               const double *values,
+                               uint32_t nb_points, uint32_t start,
+                               uint32_t step, double *value) {
+
+    uint32_t i = 0, j = 0, nb_known = 0;
+    uint32_t last = start + (nb_points - 1) * step;
+
+    *value = 0.0;
+
+    for (i = nb_points; i > 0; i--, last -= step)
+        if (timestamps[i-1] == last)
+            break;
+
+    if (i == 0)
+        return 0;
+
+    *value = values[i-1];
+
+    for (j = 0; j < i; j++, start += step)
+        nb_known += timestamps[j] == start;
+
+    return nb_known;
+}
+
+#ifdef __SSE2__
+
+/*
+ * SSE2 kernels: 2 points per iteration. The timestamps of the 2 points are
+ * compared with the expected ones and the resulting 32 bits masks are widened
+ * to 64 bits to select the known values. min and max return their second
+ * operand when one is NaN, the new values are given first so that NaN values
+ * are skipped as by the scalar comparisons.
+ */
+
+static inline __m128d sse2_known_mask(const uint32_t *timestamps,
+                                      __m128i expected) {
+
+    __m128i ts = _mm_loadl_epi64((const __m128i *)timestamps);
+    __m128i eq = _mm_cmpeq_epi32(ts, expected);
+
+    return _mm_castsi128_pd(_mm_unpacklo_epi32(eq, eq));
+}
+
+static uint32_t aggregate_sum_sse2(const uint32_t *timestamps,
+                                   const double *values,
+                                   uint32_t nb_points, uint32_t start,
+                                   uint32_t step, double *value) {
+
+    uint32_t i = 0, nb_known = 0;
+    double sums[2], rest = 0.0;
+    int64_t counts[2];
+    __m128i expected = _mm_set_epi32(0, 0, start + step, start);
+    __m128i incr = _mm_set_epi32(0, 0, 2 * step, 2 * step);
+    __m128i count = _mm_setzero_si128();
+    __m128d sum = _mm_setzero_pd();
+    __m128d mask;
+
+    for (i = 0; i + 2 <= nb_points; i += 2) {
+        mask = sse2_known_mask(timestamps + i, expected);
+        sum = _mm_add_pd(sum, _mm_and_pd(mask, _mm_loadu_pd(values + i)));
+        count = _mm_sub_epi64(count, _mm_castpd_si128(mask));
+        expected = _mm_add_epi32(expected, incr);
+    }
+
+    _mm_storeu_pd(sums, sum);
+    _mm_storeu_si128((__m128i *)counts, count);
+    nb_known = counts[0] + counts[1];
+
+    nb_known += aggregate_sum_scalar(timestamps + i, values + i, nb_points - i,
+                                     start + i * step, step, &rest);
+    *value = sums[0] + sums[1] + rest;
+
+    return nb_known;
+}
+
+static uint32_t aggregate_min_sse2(const uint32_t *timestamps,
+                                   const double *values,
+                                   uint32_t nb_points, uint32_t start,
+                                   uint32_t step, double *value) {
+
+    uint32_t i = 0, nb_known = 0;
+    double mins[2], rest = INFINITY;
+    int64_t counts[2];
+    __m128i expected = _mm_set_epi32(0, 0, start + step, start);
+    __m128i incr = _mm_set_epi32(0, 0, 2 * step, 2 * step);
+    __m128i count = _mm_setzero_si128();
+    __m128d inf = _mm_set1_pd(INFINITY);
+    __m128d min = inf;
+    __m128d mask;
+
+    for (i = 0; i + 2 <= nb_points; i += 2) {
+        mask = sse2_known_mask(timestamps + i, expected);
+        min = _mm_min_pd(_mm_or_pd(_mm_and_pd(mask, _mm_loadu_pd(values + i)),
+                                   _mm_andnot_pd(mask, inf)), min);
+        count = _mm_sub_epi64(count, _mm_castpd_si128(mask));
+        expected = _mm_add_epi32(expected, incr);
+    }
+
+    _mm_storeu_pd(mins, min);
+    _mm_storeu_si128((__m128i *)counts, count);
+    nb_known = counts[0] + counts[1];
+
+    nb_known += aggregate_min_scalar(timestamps + i, values + i, nb_points - i,
+                                     start + i * step, step, &rest);
+    *value = mins[0] < mins[1] ? mins[0] : mins[1];
+    if (rest < *value) *value = rest;
+
+    return nb_known;
+}
+
+static uint32_t aggregate_max_sse2(const uint32_t *timestamps,
+                                   const double *values,
+                                   uint32_t nb_points, uint32_t start,
+                                   uint32_t step, double *value) {
+
+    uint32_t i = 0, nb_known = 0;
+    double maxs[2], rest = -INFINITY;
+    int64_t counts[2];
+    __m128i expected = _mm_set_epi32(0, 0, start + step, start);
+    __m128i incr = _mm_set_epi32(0, 0, 2 * step, 2 * step);
+    __m128i count = _mm_setzero_si128();
+    __m128d ninf = _mm_set1_pd(-INFINITY);
+    __m128d max = ninf;
+    __m128d mask;
+
+    for (i = 0; i + 2 <= nb_points; i += 2) {
+        mask = sse2_known_mask(timestamps + i, expected);
+        max = _mm_max_pd(_mm_or_pd(_mm_and_pd(mask, _mm_loadu_pd(values + i)),
+                                   _mm_andnot_pd(mask, ninf)), max);
+        count = _mm_sub_epi64(count, _mm_castpd_si128(mask));
+        expected = _mm_add_epi32(expected, incr);
+    }
+
+    _mm_storeu_pd(maxs, max);
+    _mm_storeu_si128((__m128i *)counts, count);
+    nb_known = counts[0] + counts[1];
+
+    nb_known += aggregate_max_scalar(timestamps + i, values + i, nb_points - i,
+                                     start + i * step, step, &rest);
+    *value = maxs[0] > maxs[1] ? maxs[0] : maxs[1];
+    if (rest > *value) *value = rest;
+
+    return nb_known;
+}
+
+#endif /* __SSE2__ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_KERNELS
+
+/*
+ * AVX2 kernels: 4 points per iteration, compiled for AVX2 whatever the target
+ * of the rest of the program and only selected at runtime if the CPU supports
+ * it. The 32 bits masks of timestamps comparison are sign-extended to 64 bits.
+ * Values are given first to min and max to skip NaN, as in SSE2 kernels.
+ */
+
+__attribute__((target("avx2")))
+static inline __m256d avx2_known_mask(const uint32_t *timestamps,
+                                      __m128i expected) {
+
+    __m128i ts = _mm_loadu_si128((const __m128i *)timestamps);
+
+    return _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_cmpeq_epi32(ts, expected)));
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t avx2_count(__m256i count) {
+
+    int64_t counts[4];
+
+    _mm256_storeu_si256((__m256i *)counts, count);
+    return counts[0] + counts[1] + counts[2] + counts[3];
+}
+
+__attribute__((target("avx2")))
+static uint32_t aggregate_sum_avx2(const uint32_t *timestamps,
+                                   const double *values,
+                                   uint32_t nb_points, uint32_t start,
+                                   uint32_t step, double *value) {
+
+    uint32_t i = 0, nb_known = 0;
+    double sums[4], rest = 0.0;
+    __m128i expected = _mm_set_epi32(start + 3 * step, start + 2 * step,
+                                     start + step, start);
+    __m128i incr = _mm_set1_epi32(4 * step);
+    __m256i count = _mm256_setzero_si256();
+    __m256d sum = _mm256_setzero_pd();
+    __m256d mask;
+
+    for (i = 0; i + 4 <= nb_points; i += 4) {
+        mask = avx2_known_mask(timestamps + i, expected);
+        sum = _mm256_add_pd(sum, _mm256_and_pd(mask, _mm256_loadu_pd(values + i)));
+        count = _mm256_sub_epi64(count, _mm256_castpd_si256(mask));
+        expected = _mm_add_epi32(expected, incr);
+    }
+
+    _mm256_storeu_pd(sums, sum);
+    nb_known = avx2_count(count);
+
+    nb_known += aggregate_sum_scalar(timestamps + i, values + i, nb_points - i,
+                                     start + i * step, step, &rest);
+    *value = (sums[0] + sums[1]) + (sums[2] + sums[3]) + rest;
+
+    return nb_known;
+}
+
+__attribute__((target("avx2")))
+static uint32_t aggregate_min_avx2(const uint32_t *timestamps,
+                                   const double *values,
+                                   uint32_t nb_points, uint32_t start,
+                                   uint32_t step, double *value) {
+
+    uint32_t i = 0, j = 0, nb_known = 0;
+    double mins[4], rest = INFINITY;
+    __m128i expected = _mm_set_epi32(start + 3 * step, start + 2 * step,
+                                     start + step, start);
+    __m128i incr = _mm_set1_epi32(4 * step);
+    __m256i count = _mm256_setzero_si256();
+    __m256d inf = _mm256_set1_pd(INFINITY);
+    __m256d min = inf;
+    __m256d mask;
+
+    for (i = 0; i + 4 <= nb_points; i += 4) {
+        mask = avx2_known_mask(timestamps + i, expected);
+        min = _mm256_min_pd(_mm256_blendv_pd(inf, _mm256_loadu_pd(values + i), mask), min);
+        count = _mm256_sub_epi64(count, _mm256_castpd_si256(mask));
+        expected = _mm_add_epi32(expected, incr);
+    }
+
+    _mm256_storeu_pd(mins, min);
+    nb_known = avx2_count(count);
+
+    nb_known += aggregate_min_scalar(timestamps + i, values + i, nb_points - i,
+                                     start + i * step, step, &rest);
+    for (j = 0; j < 4; j++)
+        if (mins[j] < rest) rest = mins[j];
+    *value = rest;
+
+    return nb_known;
+}
+
+__attribute__((target("avx2")))
+static uint32_t aggregate_max_avx2(const uint32_t *timestamps,
+                                   const double *values,
+                                   uint32_t nb_points, uint32_t start,
+                                   uint32_t step, double *value) {
+
+    uint32_t i = 0, j = 0, nb_known = 0;
+    double maxs[4], rest = -INFINITY;
+    __m128i expected = _mm_set_epi32(start + 3 * step, start + 2 * step,
+                                     start + step, start);
+    __m128i incr = _mm_set1_epi32(4 * step);
+    __m256i count = _mm256_setzero_si256();
+    __m256d ninf = _mm256_set1_pd(-INFINITY);
+    __m256d max = ninf;
+    __m256d mask;
+
+    for (i = 0; i + 4 <= nb_points; i += 4) {
+        mask = avx2_known_mask(timestamps + i, expected);
+        max = _mm256_max_pd(_mm256_blendv_pd(ninf, _mm256_loadu_pd(values + i), mask), max);
+        count = _mm256_sub_epi64(count, _mm256_castpd_si256(mask));
+        expected = _mm_add_epi32(expected, incr);
+    }
+
+    _mm256_storeu_pd(maxs, max);
+    nb_known = avx2_count(count);
+
+    nb_known += aggregate_max_scalar(timestamps + i, values + i, nb_points - i,
+                                     start + i * step, step, &rest);
+    for (j = 0; j < 4; j++)
+        if (maxs[j] > rest) rest = maxs[j];
+    *value = rest;
+
+    return nb_known;
+}
+
+#endif /* HAVE_AVX2_KERNELS */
+
+/*
+ * Kernels selected by aggregation_init(), scalar until then.
+ */
+static aggregation_kernel_t kernel_sum = aggregate_sum_scalar;
+static aggregation_kernel_t kernel_min = aggregate_min_scalar;
+static aggregation_kernel_t kernel_max = aggregate_max_scalar;
+
+/*
+ * Returns the sets of kernels the CPU carbond is running on supports, from
+ * the scalar ones to the fastest, and sets their number in nb_sets.
+ */
+const aggregation_kernels_t * aggregation_kernels(uint32_t *nb_sets) {
+
+    static aggregation_kernels_t sets[3];
+    uint32_t nb = 0;
+
+    sets[nb++] = (aggregation_kernels_t) { "scalar", aggregate_sum_scalar,
+                                           aggregate_min_scalar,
+                                           aggregate_max_scalar };
+
+#ifdef __SSE2__
+    sets[nb++] = (aggregation_kernels_t) { "sse2", aggregate_sum_sse2,
+                                           aggregate_min_sse2,
+                                           aggregate_max_sse2 };
+#endif
+
+#ifdef HAVE_AVX2_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        sets[nb++] = (aggregation_kernels_t) { "avx2", aggregate_sum_avx2,
+                                               aggregate_min_avx2,
+                                               aggregate_max_avx2 };
+#endif
+
+    *nb_sets = nb;
+    return sets;
+
+}
+
+/*
+ * Select the best kernels for the CPU carbond is running on. Must be called
+ * once at startup before any thread is launched.
+ */
+void aggregation_init() {
+
+    uint32_t nb_sets = 0;
+    const aggregation_kernels_t *sets = aggregation_kernels(&nb_sets);
+
+    kernel_sum = sets[nb_sets - 1].sum;
+    kernel_min = sets[nb_sets - 1].min;
+    kernel_max = sets[nb_sets - 1].max;
+
+    debug("aggregation kernels: %s", sets[nb_sets - 1].isa);
+
+}
+
+/*
+ * Aggregate the known points of the span according to aggregation_type, see
+ * aggregation_kernel_t. The aggregated value is stored in value, or 0.0 if
+ * no point is known. Returns the number of known points.
+ */
+uint32_t aggregate_points(uint32_t aggregation_type,
+                          const uint32_t *timestamps, const double *values,
+                          uint32_t nb_points, uint32_t start, uint32_t step,
+                          double *value) {
+
+    uint32_t nb_known = 0;
+
+    *value = 0.0;
+
+    if (nb_points == 0)
+        return 0;
+
+    switch(aggregation_type) {
+
+        case AGG_TYPE_AVERAGE:
+            nb_known = kernel_sum(timestamps, values, nb_points, start, step, value);
+            if (nb_known)
+                *value /= nb_known;
+            break;
+        case AGG_TYPE_SUM:
+            nb_known = kernel_sum(timestamps, values, nb_points, start, step, value);
+            break;
+        case AGG_TYPE_LAST:
+            nb_known = aggregate_last(timestamps, values, nb_points, start, step, value);
+            break;
+        case AGG_TYPE_MAX:
+            nb_known = kernel_max(timestamps, values, nb_points, start, step, value);
+            break;
+        case AGG_TYPE_MIN:
+            nb_known = kernel_min(timestamps, values, nb_points, start, step, value);
+            break;
+        default:
+            debug("unhandled aggregation type %" PRIu32 "", aggregation_type);
+            return 0;
+
+    }
+
+    if (nb_known == 0)
+        *value = 0.0;
+
+    return nb_known;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef CARBON_AGGREGATION_H
+#define CARBON_AGGREGATION_H
+
+#include <stdint.h>
+
+/*
+ * Aggregation kernel over a span of points of an archive. A point is known if
+ * its timestamp is the one expected at its position in the span, ie. start +
+ * index * step, unknown points are skipped. The kernel stores the aggregated
+ * value of known points in value and returns their number.
+ */
+typedef uint32_t (*aggregation_kernel_t)(const uint32_t *, const double *,
+                                         uint32_t, uint32_t, uint32_t,
+                                         double *);
+
+/* kernels of an instruction set */
+struct aggregation_kernels_s {
+    const char *isa;
+    aggregation_kernel_t sum;
+    aggregation_kernel_t min;
+    aggregation_kernel_t max;
+};
+
+typedef struct aggregation_kernels_s aggregation_kernels_t;
+
+const aggregation_kernels_t * aggregation_kernels(uint32_t *);
+void aggregation_init();
+uint32_t aggregate_points(uint32_t, const uint32_t *, const double *,
+                          uint32_t, uint32_t, uint32_t, double *);
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * aggregation-bench checks that the vectorized aggregation kernels supported
+ * by the CPU give the same results as the scalar ones, on spans of all sizes
+ * with unknown points, NaN and infinite values, then times each kernel. It is
+ * built with carbond but not installed. Exits with failure on a mismatch.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "common.h"
+#include "aggregation.h"
+#include "log.h"
+
+#define BENCH_MAX_POINTS 67 /* spans checked from 0 to this size */
+#define BENCH_SPAN 720 /* points of spans timed */
+#define BENCH_ROUNDS 100000
+
+/*
+ * Global variable used by log functions
+ */
+carbon_conf_t *conf = NULL;
+
+/*
+ * Fill the span of nb_points points from start with values of the given
+ * kind, some points being unknown.
+ */
+static void bench_fill(uint32_t *timestamps, double *values,
+                       uint32_t nb_points, uint32_t start, uint32_t step,
+                       int kind) {
+
+    uint32_t i = 0;
+
+    for (i = 0; i < nb_points; i++) {
+        timestamps[i] = rand() % 4 ? start + i * step : 0;
+        values[i] = (double) (rand() % 2001 - 1000) / 7;
+        if (kind == 1 && rand() % 5 == 0)
+            values[i] = NAN;
+        else if (kind == 2 && rand() % 5 == 0)
+            values[i] = rand() % 2 ? INFINITY : -INFINITY;
+        else if (kind == 3)
+            values[i] = NAN;
+    }
+
+}
+
+/*
+ * Returns true if the value of a kernel is the one of the scalar kernel. Sums
+ * are not computed in the same order.
+ */
+static bool bench_same(double value, double expected, bool exact) {
+
+    if (isnan(expected))
+        return isnan(value);
+
+    if (exact || isinf(expected))
+        return value == expected;
+
+    return fabs(value - expected) <= 1e-9 * fmax(1.0, fabs(expected));
+
+}
+
+static uint32_t bench_check(const aggregation_kernels_t *scalar,
+                            const aggregation_kernels_t *set) {
+
+    uint32_t timestamps[BENCH_MAX_POINTS], start = 1000, step = 10,
+             nb_points = 0, n = 0, ref_n = 0, nb_errors = 0;
+    double values[BENCH_MAX_POINTS], value = 0.0, ref_value = 0.0;
+    const char *names[] = { "sum", "min", "max" };
+    aggregation_kernel_t kernels[3], ref_kernels[3];
+    int kind = 0, round = 0, k = 0;
+
+    ref_kernels[0] = scalar->sum; kernels[0] = set->sum;
+    ref_kernels[1] = scalar->min; kernels[1] = set->min;
+    ref_kernels[2] = scalar->max; kernels[2] = set->max;
+
+    for (kind = 0; kind < 4; kind++)
+        for (nb_points = 0; nb_points <= BENCH_MAX_POINTS; nb_points++)
+            for (round = 0; round < 20; round++) {
+                bench_fill(timestamps, values, nb_points, start, step, kind);
+                for (k = 0; k < 3; k++) {
+                    ref_n = ref_kernels[k](timestamps, values, nb_points,
+                                           start, step, &ref_value);
+                    n = kernels[k](timestamps, values, nb_points, start,
+                                   step, &value);
+                    if (n != ref_n || !bench_same(value, ref_value, k != 0)) {
+                        error("%s %s: %u points, kind %d: %u known %g, "
+                              "scalar %u known %g", set->isa, names[k],
+                              nb_points, kind, n, value, ref_n, ref_value);
+                        nb_errors++;
+                    }
+                }
+            }
+
+    return nb_errors;
+
+}
+
+/*
+ * Returns the time in ns per point of kernel over spans of BENCH_SPAN points.
+ */
+static double bench_time(aggregation_kernel_t kernel, const uint32_t *timestamps,
+                         const double *values, uint32_t start, uint32_t step) {
+
+    struct timespec begin, end;
+    volatile double sink = 0.0;
+    double value = 0.0;
+    uint32_t round = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        kernel(timestamps, values, BENCH_SPAN, start, step, &value);
+        sink += value;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec))
+           / ((double) BENCH_ROUNDS * BENCH_SPAN);
+
+}
+
+int main(int argc, char **argv) {
+
+    const aggregation_kernels_t *sets = NULL;
+    uint32_t timestamps[BENCH_SPAN], nb_sets = 0, nb_errors = 0, i = 0;
+    double values[BENCH_SPAN];
+    struct timespec begin, end;
+    double value = 0.0;
+    uint32_t round = 0;
+
+    conf = calloc(1, sizeof(carbon_conf_t));
+    conf->log_level = LOG_LEVEL_INFO;
+
+    srand(1);
+    sets = aggregation_kernels(&nb_sets);
+
+    for (i = 1; i < nb_sets; i++)
+        nb_errors += bench_check(&sets[0], &sets[i]);
+
+    bench_fill(timestamps, values, BENCH_SPAN, 1000, 10, 0);
+
+    for (i = 0; i < nb_sets; i++)
+        printf("%-6s sum %.3f min %.3f max %.3f ns/point\n", sets[i].isa,
+               bench_time(sets[i].sum, timestamps, values, 1000, 10),
+               bench_time(sets[i].min, timestamps, values, 1000, 10),
+               bench_time(sets[i].max, timestamps, values, 1000, 10));
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (round = 0; round < BENCH_ROUNDS; round++)
+        aggregate_points(AGG_TYPE_LAST, timestamps, values, BENCH_SPAN, 1000,
+                         10, &value);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("last   %.3f ns/span\n",
+           ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec))
+           / BENCH_ROUNDS);
+
+    if (nb_errors) {
+        error("%u mismatches with scalar kernels", nb_errors);
+        return EXIT_FAILURE;
+    }
+
+    info("%u kernel sets checked against scalar kernels", nb_sets - 1);
+
+    return EXIT_SUCCESS;
+
+}
@@ -0,0 +1,423 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Cache query service: answers clients, typically graphite-web, asking for the
+ * points of metrics still in cache and not yet written in whisper files.
+ *
+ * The protocol is line-based. A client sends one of these requests:
+ *
+ *   cache-query <metric>
+ *   cache-query-bulk <metric1> <metric2> ...
+ *
+ * For each requested metric, the response starts with a line:
+ *
+ *   <metric> <number of points>
+ *
+ * followed by one line per point in cache:
+ *
+ *   <timestamp> <value>
+ *
+ * Unknown metrics have no points. Points are copied from the database under
+ * the metric points lock, which is only held for the time of the copy.
+ *
+ * This is a plain text protocol specific to carbond, it is not compatible
+ * with the pickle based CarbonLink protocol of carbon-cache: graphite-web
+ * needs a small adapter to use it.
+ *
+ * A single thread serves up to CACHE_QUERY_MAX_CLIENTS connections at once,
+ * polling them along with the listening socket. Connections idle for more
+ * than CACHE_QUERY_IDLE_TIMEOUT seconds are closed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h> /* strerror() */
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "cache_query.h"
+#include "threads.h"
+#include "common.h"
+#include "database.h"
+#include "log.h"
+
+#define CACHE_QUERY_MAX_REQUEST 65536
+#define CACHE_QUERY_LINE_SIZE 64
+/* maximum number of clients served at the same time */
+#define CACHE_QUERY_MAX_CLIENTS 32
+/* seconds after which a connection without any request is closed */
+#define CACHE_QUERY_IDLE_TIMEOUT 30
+
+/*
+ * Sends the whole buffer on connection. Returns 0 on success, 1 on error.
+ */
+static int cache_query_send(int conn, const char *buf, size_t len) {
+
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = send(conn, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error("error on send(): %s", strerror(errno));
+            return 1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+
+}
+
+/*
+ * Sends the points in cache of the metric on connection. Returns 0 on success,
+ * 1 on error.
+ */
+static int cache_query_metric(int conn, const char *metric_name) {
+
+    uint32_t *timestamps = NULL;
+    double *values = NULL;
+    uint32_t nb_points = 0, i = 0;
+    size_t size = 0, len = 0;
+    char *response = NULL;
+    int rc = 0;
+
+    nb_points = copy_metric_points(db, metric_name, &timestamps, &values);
+
+    size = strlen(metric_name) + (nb_points + 1) * CACHE_QUERY_LINE_SIZE;
+    response = malloc(size);
+
+    len = snprintf(response, size, "%s %u\n", metric_name, nb_points);
+    for (i = 0; i < nb_points; i++)
+        len += snprintf(response + len, size - len, "%u %.17g\n",
+                        timestamps[i], values[i]);
+
+    rc = cache_query_send(conn, response, len);
+
+    free(response);
+    free(timestamps);
+    free(values);
+
+    return rc;
+
+}
+
+/*
+ * Parses the request line and sends the response on connection. Returns 0 on
+ * success, 1 on error.
+ */
+static int cache_query_process_request(int conn, char *request) {
+
+    char *saveptr = NULL;
+    char *command = strtok_r(request, " \t\r\n", &saveptr);
+    char *metric_name = NULL;
+    static const char *bad_request = "error bad request\n";
+
+    if (command == NULL)
+        return 0; /* empty line */
+
+    if (strcmp(command, "cache-query") == 0) {
+        metric_name = strtok_r(NULL, " \t\r\n", &saveptr);
+        if (metric_name == NULL)
+            return cache_query_send(conn, bad_request, strlen(bad_request));
+        return cache_query_metric(conn, metric_name);
+    }
+
+    if (strcmp(command, "cache-query-bulk") == 0) {
+        while ((metric_name = strtok_r(NULL, " \t\r\n", &saveptr)))
+            if (cache_query_metric(conn, metric_name))
+                return 1;
+        return 0;
+    }
+
+    debug("cache query: unknown command %s", command);
+    return cache_query_send(conn, bad_request, strlen(bad_request));
+
+}
+
+/*
+ * Connection of a cache query client, with its pending partial request.
+ */
+struct cache_query_client_s {
+    int conn;
+    size_t len;
+    time_t last_activity;
+    char request[CACHE_QUERY_MAX_REQUEST];
+};
+
+typedef struct cache_query_client_s cache_query_client_t;
+
+/*
+ * Reads available data on the connection of the client and processes every
+ * complete request line. Returns 0 if the connection must be kept open, 1 if
+ * it must be closed.
+ */
+static int cache_query_serve(cache_query_client_t *client) {
+
+    ssize_t n = 0;
+    char *eol = NULL;
+
+    n = recv(client->conn, client->request + client->len,
+             CACHE_QUERY_MAX_REQUEST - client->len - 1, MSG_DONTWAIT);
+
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        error("error on recv(): %s", strerror(errno));
+        return 1;
+    }
+    if (n == 0) /* connection closed by client */
+        return 1;
+
+    client->last_activity = time(NULL);
+    client->len += n;
+    client->request[client->len] = '\0';
+
+    while ((eol = strchr(client->request, '\n'))) {
+        *eol = '\0';
+        if (cache_query_process_request(client->conn, client->request))
+            return 1;
+        client->len -= eol + 1 - client->request;
+        memmove(client->request, eol + 1, client->len + 1);
+    }
+
+    if (client->len == CACHE_QUERY_MAX_REQUEST - 1) {
+        error("cache query request too long, closing connection");
+        return 1;
+    }
+
+    return 0;
+
+}
+
+/*
+ * Accepts a new connection on the listening socket and adds it to clients.
+ * The connection is refused when all client slots are taken.
+ */
+static void cache_query_accept(int sockfd,
+                               cache_query_client_t **clients,
+                               uint32_t *nb_clients) {
+
+    int conn;
+    struct timeval tv;
+
+    conn = accept(sockfd, NULL, NULL);
+    if (conn < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+            error("error calling accept(): %s\n", strerror(errno));
+        return;
+    }
+
+    if (*nb_clients == CACHE_QUERY_MAX_CLIENTS) {
+        error("too many cache query clients, refusing connection");
+        close(conn);
+        return;
+    }
+
+    /* responses are sent in blocking mode, do not hang on a stuck client */
+    tv.tv_sec = CACHE_QUERY_IDLE_TIMEOUT;
+    tv.tv_usec = 0;
+    if(setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, (struct timeval *)&tv, sizeof(struct timeval)) < 0)
+        error("error on setsockopt() SO_SNDTIMEO: %s", strerror(errno));
+
+    clients[*nb_clients] = malloc(sizeof(cache_query_client_t));
+    clients[*nb_clients]->conn = conn;
+    clients[*nb_clients]->len = 0;
+    clients[*nb_clients]->last_activity = time(NULL);
+    (*nb_clients)++;
+
+}
+
+/*
+ * Closes the connection of the client at index i in clients and fills its
+ * slot with the last client.
+ */
+static void cache_query_close(cache_query_client_t **clients,
+                              uint32_t *nb_clients,
+                              uint32_t i) {
+
+    close(clients[i]->conn);
+    free(clients[i]);
+    clients[i] = clients[--(*nb_clients)];
+
+}
+
+void * cache_query_worker(void * arg) {
+
+    cache_query_args_t *worker_args = (cache_query_args_t *) arg;
+    carbon_thread_t *me = worker_args->thread;
+    int sockfd = worker_args->sockfd;
+    cache_query_client_t *clients[CACHE_QUERY_MAX_CLIENTS];
+    struct pollfd fds[CACHE_QUERY_MAX_CLIENTS + 1];
+    uint32_t nb_clients = 0, nb_fds = 0, i = 0;
+    int rc = 0;
+    time_t now;
+
+    block_signals();
+
+    thread_run_lock(me);
+
+    while(conf->run) {
+
+        if(thread_must_pause(me)) {
+            thread_pause_and_wait_run_signal(me);
+        }
+
+        fds[0].fd = sockfd;
+        fds[0].events = POLLIN;
+        for (i = 0; i < nb_clients; i++) {
+            fds[i + 1].fd = clients[i]->conn;
+            fds[i + 1].events = POLLIN;
+        }
+        nb_fds = nb_clients + 1;
+
+        /* 0.5 sec timeout so that conf->run and pause requests are checked */
+        rc = poll(fds, nb_fds, 500);
+        if (rc < 0) {
+            if (errno != EINTR)
+                error("error calling poll(): %s", strerror(errno));
+            continue;
+        }
+
+        /*
+         * Clients are served in reverse order so that closing one, which moves
+         * the last client to its slot, does not skip any pending client.
+         */
+        now = time(NULL);
+        for (i = nb_fds - 1; i > 0; i--) {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (cache_query_serve(clients[i - 1]))
+                    cache_query_close(clients, &nb_clients, i - 1);
+            } else if (now - clients[i - 1]->last_activity
+                       >= CACHE_QUERY_IDLE_TIMEOUT) {
+                debug("closing idle cache query connection");
+                cache_query_close(clients, &nb_clients, i - 1);
+            }
+        }
+
+        if (fds[0].revents & POLLIN)
+            cache_query_accept(sockfd, clients, &nb_clients);
+    }
+
+    while (nb_clients > 0)
+        cache_query_close(clients, &nb_clients, nb_clients - 1);
+
+    close(sockfd);
+    free(worker_args);
+
+    return NULL;
+
+}
+
+/*
+ * Create, bind and returns the listening socket of the cache query service.
+ * Returns -1 on error.
+ */
+static int cache_query_init_socket() {
+
+    int sockfd;
+    int optval = 1;
+    struct timeval tv;
+    struct sockaddr_in serveraddr;
+
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        error("error on opening socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int)) < 0) {
+        error("error on setsockopt() SO_REUSEADDR: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    /* 0.5 sec timeout */
+    tv.tv_sec = 0;
+    tv.tv_usec = 500000;
+
+    if(setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *)&tv, sizeof(struct timeval)) < 0) {
+        error("error on setsockopt() SO_RCVTIMEO: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short)conf->cache_query_port);
+
+    if (bind(sockfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0) {
+        error("error on binding cache query port %d: %s",
+              conf->cache_query_port, strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    if (listen(sockfd, 10) < 0) {
+        error("error on listen: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+
+}
+
+carbon_thread_t * launch_cache_query_thread() {
+
+    int sockfd;
+    carbon_thread_t *thread = NULL;
+    cache_query_args_t *args = NULL;
+
+    debug("creating the cache query socket");
+
+    sockfd = cache_query_init_socket();
+    if (sockfd < 0) {
+        error("cache query service disabled");
+        return NULL;
+    }
+
+    thread = calloc(1, sizeof(carbon_thread_t));
+    args = calloc(1, sizeof(cache_query_args_t));
+    args->id_thread = 0;
+    args->thread = thread;
+    args->sockfd = sockfd;
+
+    thread_init(thread, "cache query");
+
+    if (pthread_create(&(thread->pthread), NULL, cache_query_worker, (void*)args) != 0) {
+        error("error on pthread_create: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    return thread;
+
+}
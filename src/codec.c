@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Block conversion between spans of packed big-endian whisper points, as
+ * stored in archives, and separate arrays of host-endian timestamps and
+ * values, as used by aggregation kernels and fetch.
+ */
+
+#include <stdint.h>
+#include <string.h>    // memcpy()
+#include <endian.h>    // be32toh(), htobe64(), etc
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSSE3 intrinsics
+#endif
+
+#include "common.h"
+#include "codec.h"
+#include "whisper.h"   // WHISPER_POINT_SIZE
+
+static void decode_archive_points_scalar(const void *buf, uint32_t nb_points,
+                                         uint32_t *timestamps, double *values) {
+
+    const unsigned char *src = buf;
+    uint32_t i = 0, timestamp = 0;
+    uint64_t value = 0;
+
+    for (i = 0; i < nb_points; i++, src += WHISPER_POINT_SIZE) {
+        memcpy(&timestamp, src, sizeof(uint32_t));
+        memcpy(&value, src + sizeof(uint32_t), sizeof(uint64_t));
+        timestamps[i] = be32toh(timestamp);
+        value = be64toh(value);
+        memcpy(values + i, &value, sizeof(double));
+    }
+}
+
+static void encode_archive_points_scalar(const uint32_t *timestamps,
+                                         const double *values,
+                                         uint32_t nb_points, void *buf) {
+
+    unsigned char *dst = buf;
+    uint32_t i = 0, timestamp = 0;
+    uint64_t value = 0;
+
+    for (i = 0; i < nb_points; i++, dst += WHISPER_POINT_SIZE) {
+        timestamp = htobe32(timestamps[i]);
+        memcpy(&value, values + i, sizeof(double));
+        value = htobe64(value);
+        memcpy(dst, &timestamp, sizeof(uint32_t));
+        memcpy(dst + sizeof(uint32_t), &value, sizeof(uint64_t));
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SSSE3_CODEC
+
+/*
+ * SSSE3 conversion: one 16 bytes load per point and a single byte shuffle
+ * swaps both the timestamp and the value. The last point is converted by the
+ * scalar code so that loads and stores never go past the end of the buffers.
+ */
+
+__attribute__((target("ssse3")))
+static void decode_archive_points_ssse3(const void *buf, uint32_t nb_points,
+                                        uint32_t *timestamps, double *values) {
+
+    const unsigned char *src = buf;
+    uint32_t i = 0;
+    /* [ts: 3 2 1 0][zero][value: 11 10 9 8 7 6 5 4] */
+    const __m128i shuffle = _mm_setr_epi8(3, 2, 1, 0, -1, -1, -1, -1,
+                                          11, 10, 9, 8, 7, 6, 5, 4);
+    __m128i point;
+
+    for (i = 0; i + 1 < nb_points; i++, src += WHISPER_POINT_SIZE) {
+        point = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), shuffle);
+        timestamps[i] = (uint32_t)_mm_cvtsi128_si32(point);
+        _mm_storeh_pd(values + i, _mm_castsi128_pd(point));
+    }
+
+    decode_archive_points_scalar(src, nb_points - i, timestamps + i, values + i);
+}
+
+__attribute__((target("ssse3")))
+static void encode_archive_points_ssse3(const uint32_t *timestamps,
+                                        const double *values,
+                                        uint32_t nb_points, void *buf) {
+
+    unsigned char *dst = buf;
+    uint32_t i = 0;
+    /* from [ts: 0 1 2 3][pad][value: 8 .. 15] */
+    const __m128i shuffle = _mm_setr_epi8(3, 2, 1, 0, 15, 14, 13, 12,
+                                          11, 10, 9, 8, -1, -1, -1, -1);
+    __m128i point;
+
+    /*
+     * Each 16 bytes store overflows on the 4 first bytes of the next point,
+     * which are written right after.
+     */
+    for (i = 0; i + 1 < nb_points; i++, dst += WHISPER_POINT_SIZE) {
+        point = _mm_castpd_si128(_mm_loadh_pd(
+                    _mm_castsi128_pd(_mm_cvtsi32_si128((int)timestamps[i])),
+                    values + i));
+        _mm_storeu_si128((__m128i *)dst, _mm_shuffle_epi8(point, shuffle));
+    }
+
+    encode_archive_points_scalar(timestamps + i, values + i, nb_points - i, dst);
+}
+
+#endif /* HAVE_SSSE3_CODEC */
+
+/*
+ * Conversion functions selected by codec_init(), scalar until then.
+ */
+static void (*decode_points)(const void *, uint32_t, uint32_t *, double *) =
+    decode_archive_points_scalar;
+static void (*encode_points)(const uint32_t *, const double *, uint32_t, void *) =
+    encode_archive_points_scalar;
+
+/*
+ * Select the best conversion functions for the CPU carbond is running on.
+ * Must be called once at startup before any thread is launched.
+ */
+void codec_init() {
+
+    const char *isa = "scalar";
+
+#ifdef HAVE_SSSE3_CODEC
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        decode_points = decode_archive_points_ssse3;
+        encode_points = encode_archive_points_ssse3;
+        isa = "ssse3";
+    }
+#endif
+
+    debug("archive points codec: %s", isa);
+
+}
+
+/*
+ * Decode nb_points packed whisper points of buf into timestamps and values.
+ */
+void decode_archive_points(const void *buf, uint32_t nb_points,
+                           uint32_t *timestamps, double *values) {
+
+    decode_points(buf, nb_points, timestamps, values);
+
+}
+
+/*
+ * Encode nb_points timestamps and values into packed whisper points in buf,
+ * which must be nb_points * WHISPER_POINT_SIZE bytes long.
+ */
+void encode_archive_points(const uint32_t *timestamps, const double *values,
+                           uint32_t nb_points, void *buf) {
+
+    encode_points(timestamps, values, nb_points, buf);
+
+}
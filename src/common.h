@@ -83,6 +83,17 @@ typedef struct pattern_aggregation_s pattern_aggregation_t;
 struct metrics_database {
     struct metric *first;
     struct metric *last;
+    /* hash table of metrics by name */
+    struct metric **buckets;
+    uint32_t nb_buckets;
+    uint32_t nb_metrics;
+    uint64_t nb_points; /* total number of points in cache */
+    /*
+     * Protects the list of metrics, not their points. Metrics are only freed
+     * by the writer when evicted, other threads must hold it to keep pointers
+     * to metrics.
+     */
+    pthread_rwlock_t lock;
 };
 
 typedef struct metrics_database metrics_database_t;
@@ -90,22 +101,78 @@ typedef struct metrics_database metrics_database_t;
 struct metric_point {
     uint32_t timestamp;
     double value;
+    uint32_t wal_segment; /* write-ahead log segment, 0 if not logged */
     struct metric_point *next;
 };
 
 typedef struct metric_point metric_point_t;
 
+struct whisper_cache_s; /* defined in whisper.h */
+
+/* points of a write-ahead log segment kept in log for a metric */
+struct metric_wal_hold {
+    uint32_t segment;
+    uint32_t nb_points;
+};
+
 struct metric {
     char * name;
     uint32_t nb_points;
     struct metric_point *points;
     struct metric_point *last;
     struct metric *next;
+    struct metric *hash_next; /* next metric in the same hash bucket */
+    uint32_t last_activity; /* time of the last point received */
+    /* highest precision archive of the metric, 0 if unknown */
+    uint32_t retention_step;
+    uint32_t retention_period;
+    uint32_t storage_root; /* index of the storage root of its whisper file */
+    /* held by the writer while writing the metric on disk */
     pthread_mutex_t lock;
+    /* held briefly to add, take or read points */
+    pthread_mutex_t points_lock;
+    /* in-memory state of the whisper file, only accessed by the writer */
+    struct whisper_cache_s *wsp_cache;
+    /* state of the gorilla file, only accessed by the compactor */
+    struct gorilla_cache_s *gor_cache;
+    /* threads keeping a pointer to the metric without database lock */
+    uint32_t pins;
+    /* written points kept in log until their slots are propagated */
+    struct metric_wal_hold *wal_held;
+    uint32_t nb_wal_held;
+    uint32_t size_wal_held;
 };
 
 typedef struct metric metric_t;
 
+/* order of metrics written by the writer */
+
+enum write_order_e {
+    WRITE_ORDER_LARGEST,  /* metric with the most points first */
+    WRITE_ORDER_LOCALITY  /* windows of metrics sorted by location on disk */
+};
+
+typedef enum write_order_e write_order_t;
+
+/* when written whisper files are synced to disk */
+
+enum durability_e {
+    DURABILITY_NONE,     /* left to the kernel */
+    DURABILITY_PERIODIC, /* syncfs() of storage filesystem */
+    DURABILITY_BATCHED   /* fdatasync() of the files written since last sync */
+};
+
+typedef enum durability_e durability_t;
+
+/* format of the files of metrics */
+
+enum storage_engine_e {
+    STORAGE_ENGINE_WHISPER, /* fixed size archives of whisper files */
+    STORAGE_ENGINE_GORILLA  /* appended blocks of compressed points */
+};
+
+typedef enum storage_engine_e storage_engine_t;
+
 /* carbon runtime parameters */
 
 struct carbon_conf_s {
@@ -114,8 +181,51 @@ struct carbon_conf_s {
     char *conf_dir;
     char *conf_file;
     char *storage_dir;
+    /* roots where whisper files are spread, storage_dir alone if none */
+    char **storage_dirs;
+    uint32_t nb_storage_dirs;
+    uint32_t storage_fanout; /* directories of leaves in new roots, 0 for none */
+    storage_engine_t storage_engine;
+    uint32_t compaction_interval; /* in seconds, gorilla engine only */
     int line_receiver_port;
     int udp_receiver_port;
+    int cache_query_port; /* 0 to disable cache query thread */
+    int query_server_port; /* 0 to disable HTTP query server */
+    int query_server_threads;
+    /* register metrics found in storage directory at startup */
+    bool startup_scan;
+    int startup_scan_threads;
+    /* log received points before adding them in cache */
+    bool wal_enabled;
+    uint32_t wal_segment_size; /* in MB */
+    /* save cache in a snapshot on shutdown, loaded on startup */
+    bool cache_snapshot;
+    /* write cache in parallel on shutdown, within timeout */
+    bool shutdown_drain;
+    int shutdown_drain_threads;
+    uint32_t shutdown_drain_timeout;
+    /* aggregate lower archives from memory instead of re-reading disk */
+    bool rollup_accumulators;
+    /* propagate to lower archives in background instead of inline */
+    bool propagation_deferred;
+    uint32_t propagation_max_lag; /* in seconds */
+    /* spill cache to disk above threshold of points */
+    bool cache_spill;
+    uint64_t cache_spill_threshold;
+    uint32_t cache_spill_shards;
+    /* react to memory pressure reported by the kernel */
+    bool memory_pressure;
+    char *memory_pressure_file;
+    double memory_pressure_threshold; /* in percent of stalled time */
+    uint64_t max_cache_points; /* 0 for no limit */
+    /* evict metrics without points received since, 0 to disable */
+    uint32_t metric_idle_timeout; /* in seconds */
+    write_order_t write_order;
+    uint32_t write_window; /* metrics sorted at once in locality order */
+    uint32_t open_files_cache; /* whisper files kept open, 0 to disable */
+    uint32_t open_dirs_cache; /* directories kept open, 0 to disable */
+    durability_t durability;
+    uint32_t durability_interval; /* in seconds */
     bool run; /* should the app keeps running or stop? */
     /* flag to print file, function and line number in debug() */
     bool tracing;
@@ -127,6 +237,32 @@ typedef struct carbon_conf_s carbon_conf_t;
 struct monitoring_metrics_s {
     uint32_t points;
     pthread_mutex_t mutex_points;
+    uint32_t propagation_backlog; /* slots waiting for propagation */
+    pthread_mutex_t mutex_propagation;
+    int64_t spilled_points; /* points currently in spill files */
+    pthread_mutex_t mutex_spill;
+    double memory_pressure; /* percent of stalled time over 10s */
+    bool under_pressure;
+    uint64_t cache_limit; /* points above which received points are dropped */
+    uint32_t dropped_points;
+    pthread_mutex_t mutex_pressure;
+    uint32_t evicted_metrics;
+    pthread_mutex_t mutex_eviction;
+    /* points dropped out of retention of the highest precision archive */
+    uint32_t rejected_old;
+    uint32_t rejected_future;
+    pthread_mutex_t mutex_rejected;
+    uint32_t syncs;
+    uint32_t synced_files;
+    double sync_time; /* in ms */
+    pthread_mutex_t mutex_sync;
+    uint32_t compacted_files;
+    double compaction_time; /* in ms */
+    pthread_mutex_t mutex_compaction;
+    /* messages not logged in write-ahead log, batches of points not written */
+    uint32_t wal_errors;
+    uint32_t write_errors;
+    pthread_mutex_t mutex_errors;
 };
 
 typedef struct monitoring_metrics_s monitoring_metrics_t;
@@ -140,4 +276,21 @@ extern monitoring_metrics_t *monitoring;
 
 extern metrics_database_t *db;
 
+/* FNV-1a offset basis, initial hash of fnv1a() */
+#define FNV1A_INIT 2166136261u
+
+/*
+ * Continues the 32 bits FNV-1a hash on the bytes of str and returns it.
+ */
+static inline uint32_t fnv1a(uint32_t hash, const char *str) {
+
+    for (; *str; str++) {
+        hash ^= (unsigned char) *str;
+        hash *= 16777619u;
+    }
+
+    return hash;
+
+}
+
 #endif
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h> // sleep()
+#include <stdlib.h>
+#include <string.h> // strerror()
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "compactor.h"
+#include "whisper.h"
+#include "gorilla.h"
+
+/* metrics of the database considered by a compaction pass */
+static metric_t **compactor_metrics = NULL;
+static uint32_t compactor_size = 0;
+
+/*
+ * Compact the files of the metrics in database appended since time. The
+ * compaction keeps the modification time of the files, so that files which
+ * received no point since are skipped. The metrics are pinned under the
+ * database lock, so that writers do not evict them, and compacted once it is
+ * released. Returns the number of compacted files.
+ */
+static uint32_t compact_metrics(time_t since) {
+
+    metric_t *cur_m = NULL;
+    struct timespec start, end;
+    struct stat st;
+    char *filename = NULL;
+    uint32_t nb_metrics = 0, nb_files = 0, i = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_rwlock_rdlock(&(db->lock));
+
+    for (cur_m = db->first; cur_m; cur_m = cur_m->next) {
+        if (nb_metrics == compactor_size) {
+            compactor_size = compactor_size ? compactor_size * 2 : 1024;
+            compactor_metrics = realloc(compactor_metrics,
+                                        compactor_size * sizeof(metric_t *));
+        }
+        __sync_add_and_fetch(&(cur_m->pins), 1);
+        compactor_metrics[nb_metrics++] = cur_m;
+    }
+
+    pthread_rwlock_unlock(&(db->lock));
+
+    for (i = 0; i < nb_metrics; i++) {
+
+        cur_m = compactor_metrics[i];
+
+        if (conf->run) {
+            filename = whisper_metric_filename(cur_m->name, GORILLA_EXTENSION);
+            if (stat(filename, &st) == 0 && st.st_mtime >= since) {
+                pthread_mutex_lock(&(cur_m->lock));
+                if (gorilla_compact(cur_m) == 0)
+                    nb_files++;
+                pthread_mutex_unlock(&(cur_m->lock));
+            }
+            free(filename);
+        }
+
+        __sync_sub_and_fetch(&(cur_m->pins), 1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_mutex_lock(&(monitoring->mutex_compaction));
+    monitoring->compacted_files += nb_files;
+    monitoring->compaction_time += (end.tv_sec - start.tv_sec) * 1000.0
+                                   + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+    pthread_mutex_unlock(&(monitoring->mutex_compaction));
+
+    return nb_files;
+
+}
+
+void * compactor_thread(void * thread_args) {
+
+    struct compactor_thread_args * c_thd_args =
+        (struct compactor_thread_args *) thread_args;
+    carbon_thread_t *me = c_thd_args->thread;
+    time_t last_pass = 0, start = 0;
+    uint32_t nb_files = 0;
+
+    /*
+     * Blocks signals (SIGINT, SIGTERM, etc) in this thread so that they are all
+     * handled in main thread.
+     */
+    block_signals();
+
+    debug("thread %u is running", c_thd_args->id_thread);
+
+    thread_run_lock(me);
+
+    for(;conf->run;) {
+
+        if(thread_must_pause(me)) {
+            thread_pause_and_wait_run_signal(me);
+        }
+
+        start = time(NULL);
+        if (start - last_pass >= conf->compaction_interval) {
+            /* files appended during previous pass are compacted again */
+            nb_files = compact_metrics(last_pass);
+            debug("compacted %u files", nb_files);
+            last_pass = start;
+        }
+
+        sleep(1);
+    }
+
+    return NULL;
+}
+
+carbon_thread_t *launch_compactor_thread() {
+
+    carbon_thread_t *thread;
+    struct compactor_thread_args * c_thd_args = NULL;
+
+    thread = calloc(1, sizeof(carbon_thread_t));
+    thread_init(thread, "compactor");
+
+    c_thd_args = (struct compactor_thread_args *)
+                 malloc(sizeof(struct compactor_thread_args));
+    c_thd_args->id_thread = 0;
+    c_thd_args->thread = thread;
+
+    if (pthread_create(&(thread->pthread), NULL, compactor_thread, (void*)c_thd_args) != 0) {
+        error("error on pthread_create: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    return thread;
+
+}
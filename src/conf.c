@@ -23,9 +23,11 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h> // strcasecmp()
 #include <errno.h>
 
 #include "conf.h"
+#include "whisper.h" // WHISPER_FANOUT_MAX
 
 /*
  * Remove spaces/tabs/\r/\n from the string given in parameter
@@ -99,6 +101,28 @@ uint32_t str_to_seconds(char * str_duration) {
 
 }
 
+/*
+ * convert strings like "true" or "no" into boolean stored in res. Returns 0 on
+ * success, 1 if the string is not a valid boolean.
+ */
+int str_to_bool(const char *str, bool *res) {
+
+    if (strcasecmp(str, "true") == 0 || strcasecmp(str, "yes") == 0
+        || strcasecmp(str, "on") == 0 || strcmp(str, "1") == 0) {
+        *res = true;
+        return 0;
+    }
+
+    if (strcasecmp(str, "false") == 0 || strcasecmp(str, "no") == 0
+        || strcasecmp(str, "off") == 0 || strcmp(str, "0") == 0) {
+        *res = false;
+        return 0;
+    }
+
+    return 1;
+
+}
+
 static retention_t * parse_retention_item_str(char *str_retention_item, char **saveptr) {
 
     char *time_per_point_str = NULL,
@@ -362,6 +386,55 @@ int conf_parse_storage_schema_file(carbon_conf_t *new_conf) {
 
 }
 
+/*
+ * Frees the list of storage roots of conf.
+ */
+void conf_free_storage_dirs(carbon_conf_t *c) {
+
+    uint32_t i = 0;
+
+    for (i = 0; i < c->nb_storage_dirs; i++)
+        free(c->storage_dirs[i]);
+    free(c->storage_dirs);
+    c->storage_dirs = NULL;
+    c->nb_storage_dirs = 0;
+
+}
+
+/*
+ * Parses the comma separated list of storage roots in cnf_val. Returns 0 on
+ * success, 1 on error.
+ */
+static int conf_parse_storage_dirs(carbon_conf_t *new_conf, char *cnf_val) {
+
+    char *dir = NULL, *saveptr = NULL;
+    uint32_t nb_dirs = 1;
+    size_t i = 0;
+
+    conf_free_storage_dirs(new_conf);
+
+    for (i = 0; cnf_val[i]; i++)
+        if (cnf_val[i] == ',')
+            nb_dirs++;
+
+    new_conf->storage_dirs = calloc(nb_dirs, sizeof(char *));
+
+    for (dir = strtok_r(cnf_val, ",", &saveptr); dir;
+         dir = strtok_r(NULL, ",", &saveptr)) {
+        if (strlen(dir) >= PATH_MAX) {
+            error("invalid STORAGE_DIRS, path too long: %s\n", dir);
+            return 1;
+        }
+        new_conf->storage_dirs[new_conf->nb_storage_dirs] = malloc(sizeof(char)*PATH_MAX);
+        memset(new_conf->storage_dirs[new_conf->nb_storage_dirs], 0, sizeof(char)*PATH_MAX);
+        strncpy(new_conf->storage_dirs[new_conf->nb_storage_dirs], dir, PATH_MAX - 1);
+        new_conf->nb_storage_dirs++;
+    }
+
+    return 0;
+
+}
+
 /*
  * Parses carbon.conf file and conf members accordingly.
  * Returns 0 on success, 1 on error.
@@ -403,6 +476,12 @@ int conf_parse_carbon_file(carbon_conf_t *new_conf) {
                 strncpy(new_conf->conf_dir, cnf_val, strlen(cnf_val));
             }
 
+            /* before STORAGE_DIR which is a prefix of this key */
+            else if (strncmp(cnf_key, "STORAGE_DIRS", 12) == 0) {
+                if (conf_parse_storage_dirs(new_conf, cnf_val))
+                    return 1;
+            }
+
             else if (strncmp(cnf_key, "STORAGE_DIR", 11) == 0) {
                 free(new_conf->storage_dir);
                 new_conf->storage_dir = NULL;
@@ -412,6 +491,34 @@ int conf_parse_carbon_file(carbon_conf_t *new_conf) {
                 debug("storage dir parsed from conf file: %s", new_conf->storage_dir);
             }
 
+            else if (strncmp(cnf_key, "STORAGE_FANOUT", 14) == 0) {
+                new_conf->storage_fanout = strtoul(cnf_val, NULL, 10);
+                if (new_conf->storage_fanout > WHISPER_FANOUT_MAX) {
+                    error("invalid STORAGE_FANOUT, %d max: %s\n",
+                          WHISPER_FANOUT_MAX, cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "STORAGE_ENGINE", 14) == 0) {
+                if (strcasecmp(cnf_val, "whisper") == 0)
+                    new_conf->storage_engine = STORAGE_ENGINE_WHISPER;
+                else if (strcasecmp(cnf_val, "gorilla") == 0)
+                    new_conf->storage_engine = STORAGE_ENGINE_GORILLA;
+                else {
+                    error("invalid value for STORAGE_ENGINE: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "COMPACTION_INTERVAL", 19) == 0) {
+                new_conf->compaction_interval = str_to_seconds(cnf_val);
+                if (new_conf->compaction_interval < 1) {
+                    error("invalid COMPACTION_INTERVAL: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
             else if (strncmp(cnf_key, "LINE_RECEIVER_PORT", 18) == 0) {
                 errno = 0;
                 new_conf->line_receiver_port = strtol(cnf_val, NULL, 10);
@@ -436,6 +543,218 @@ int conf_parse_carbon_file(carbon_conf_t *new_conf) {
                     }
             }
 
+            else if (strncmp(cnf_key, "CACHE_QUERY_PORT", 16) == 0) {
+                errno = 0;
+                new_conf->cache_query_port = strtol(cnf_val, NULL, 10);
+                if (errno)
+                    switch(errno) {
+                        case EINVAL:
+                        case ERANGE:
+                            error("problem while setting CACHE_QUERY_PORT: %s\n", strerror(errno));
+                            return 1;
+                    }
+            }
+
+            else if (strncmp(cnf_key, "QUERY_SERVER_PORT", 17) == 0) {
+                errno = 0;
+                new_conf->query_server_port = strtol(cnf_val, NULL, 10);
+                if (errno)
+                    switch(errno) {
+                        case EINVAL:
+                        case ERANGE:
+                            error("problem while setting QUERY_SERVER_PORT: %s\n", strerror(errno));
+                            return 1;
+                    }
+            }
+
+            else if (strncmp(cnf_key, "QUERY_SERVER_THREADS", 20) == 0) {
+                new_conf->query_server_threads = strtol(cnf_val, NULL, 10);
+                if (new_conf->query_server_threads < 1) {
+                    error("invalid number of QUERY_SERVER_THREADS: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            /* before STARTUP_SCAN which is a prefix of this key */
+            else if (strncmp(cnf_key, "STARTUP_SCAN_THREADS", 20) == 0) {
+                new_conf->startup_scan_threads = strtol(cnf_val, NULL, 10);
+                if (new_conf->startup_scan_threads < 1) {
+                    error("invalid number of STARTUP_SCAN_THREADS: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "STARTUP_SCAN", 12) == 0) {
+                if (str_to_bool(cnf_val, &new_conf->startup_scan)) {
+                    error("invalid boolean value for STARTUP_SCAN: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "WAL_ENABLED", 11) == 0) {
+                if (str_to_bool(cnf_val, &new_conf->wal_enabled)) {
+                    error("invalid boolean value for WAL_ENABLED: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "WAL_SEGMENT_SIZE", 16) == 0) {
+                new_conf->wal_segment_size = strtoul(cnf_val, NULL, 10);
+                if (new_conf->wal_segment_size == 0) {
+                    error("invalid WAL_SEGMENT_SIZE: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "CACHE_SNAPSHOT", 14) == 0) {
+                if (str_to_bool(cnf_val, &new_conf->cache_snapshot)) {
+                    error("invalid boolean value for CACHE_SNAPSHOT: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            /* before SHUTDOWN_DRAIN which is a prefix of these keys */
+            else if (strncmp(cnf_key, "SHUTDOWN_DRAIN_THREADS", 22) == 0) {
+                new_conf->shutdown_drain_threads = strtol(cnf_val, NULL, 10);
+                if (new_conf->shutdown_drain_threads < 1) {
+                    error("invalid number of SHUTDOWN_DRAIN_THREADS: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "SHUTDOWN_DRAIN_TIMEOUT", 22) == 0) {
+                new_conf->shutdown_drain_timeout = str_to_seconds(cnf_val);
+            }
+
+            else if (strncmp(cnf_key, "SHUTDOWN_DRAIN", 14) == 0) {
+                if (str_to_bool(cnf_val, &new_conf->shutdown_drain)) {
+                    error("invalid boolean value for SHUTDOWN_DRAIN: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "ROLLUP_ACCUMULATORS", 19) == 0) {
+                if (str_to_bool(cnf_val, &new_conf->rollup_accumulators)) {
+                    error("invalid boolean value for ROLLUP_ACCUMULATORS: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "PROPAGATION_DEFERRED", 20) == 0) {
+                if (str_to_bool(cnf_val, &new_conf->propagation_deferred)) {
+                    error("invalid boolean value for PROPAGATION_DEFERRED: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "PROPAGATION_MAX_LAG", 19) == 0) {
+                new_conf->propagation_max_lag = str_to_seconds(cnf_val);
+            }
+
+            /* before CACHE_SPILL which is a prefix of these keys */
+            else if (strncmp(cnf_key, "CACHE_SPILL_THRESHOLD", 21) == 0) {
+                new_conf->cache_spill_threshold = strtoull(cnf_val, NULL, 10);
+                if (new_conf->cache_spill_threshold < 1) {
+                    error("invalid CACHE_SPILL_THRESHOLD: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "CACHE_SPILL_SHARDS", 18) == 0) {
+                new_conf->cache_spill_shards = strtoul(cnf_val, NULL, 10);
+                if (new_conf->cache_spill_shards < 1) {
+                    error("invalid number of CACHE_SPILL_SHARDS: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "CACHE_SPILL", 11) == 0) {
+                if (str_to_bool(cnf_val, &new_conf->cache_spill)) {
+                    error("invalid boolean value for CACHE_SPILL: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            /* before MEMORY_PRESSURE which is a prefix of these keys */
+            else if (strncmp(cnf_key, "MEMORY_PRESSURE_FILE", 20) == 0) {
+                free(new_conf->memory_pressure_file);
+                new_conf->memory_pressure_file = malloc(sizeof(char)*PATH_MAX);
+                memset(new_conf->memory_pressure_file, 0, sizeof(char)*PATH_MAX);
+                strncpy(new_conf->memory_pressure_file, cnf_val, PATH_MAX - 1);
+            }
+
+            else if (strncmp(cnf_key, "MEMORY_PRESSURE_THRESHOLD", 25) == 0) {
+                new_conf->memory_pressure_threshold = strtod(cnf_val, NULL);
+                if (new_conf->memory_pressure_threshold <= 0) {
+                    error("invalid MEMORY_PRESSURE_THRESHOLD: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "MEMORY_PRESSURE", 15) == 0) {
+                if (str_to_bool(cnf_val, &new_conf->memory_pressure)) {
+                    error("invalid boolean value for MEMORY_PRESSURE: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "MAX_CACHE_POINTS", 16) == 0) {
+                new_conf->max_cache_points = strtoull(cnf_val, NULL, 10);
+            }
+
+            else if (strncmp(cnf_key, "METRIC_IDLE_TIMEOUT", 19) == 0) {
+                new_conf->metric_idle_timeout = str_to_seconds(cnf_val);
+            }
+
+            else if (strncmp(cnf_key, "WRITE_ORDER", 11) == 0) {
+                if (strcasecmp(cnf_val, "largest") == 0)
+                    new_conf->write_order = WRITE_ORDER_LARGEST;
+                else if (strcasecmp(cnf_val, "locality") == 0)
+                    new_conf->write_order = WRITE_ORDER_LOCALITY;
+                else {
+                    error("invalid value for WRITE_ORDER: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "WRITE_WINDOW", 12) == 0) {
+                new_conf->write_window = strtoul(cnf_val, NULL, 10);
+                if (new_conf->write_window < 1) {
+                    error("invalid WRITE_WINDOW: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "OPEN_FILES_CACHE", 16) == 0) {
+                new_conf->open_files_cache = strtoul(cnf_val, NULL, 10);
+            }
+
+            else if (strncmp(cnf_key, "OPEN_DIRS_CACHE", 15) == 0) {
+                new_conf->open_dirs_cache = strtoul(cnf_val, NULL, 10);
+            }
+
+            /* before DURABILITY which is a prefix of this key */
+            else if (strncmp(cnf_key, "DURABILITY_INTERVAL", 19) == 0) {
+                new_conf->durability_interval = str_to_seconds(cnf_val);
+                if (new_conf->durability_interval < 1) {
+                    error("invalid DURABILITY_INTERVAL: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
+            else if (strncmp(cnf_key, "DURABILITY", 10) == 0) {
+                if (strcasecmp(cnf_val, "none") == 0)
+                    new_conf->durability = DURABILITY_NONE;
+                else if (strcasecmp(cnf_val, "periodic") == 0)
+                    new_conf->durability = DURABILITY_PERIODIC;
+                else if (strcasecmp(cnf_val, "batched") == 0)
+                    new_conf->durability = DURABILITY_BATCHED;
+                else {
+                    error("invalid value for DURABILITY: %s\n", cnf_val);
+                    return 1;
+                }
+            }
+
             else {
                 error("conf: unknown key in configuration file: %s\n", cnf_key);
                 return 1;
@@ -452,6 +771,98 @@ int conf_parse_carbon_file(carbon_conf_t *new_conf) {
 
 }
 
+/*
+ * Set the default configuration in new_conf, shared by carbond and its tools.
+ */
+void conf_set_defaults(carbon_conf_t *new_conf) {
+
+    const char * sysconfdir = SYSCONFDIR;
+    const char * localstatedir = LOCALSTATEDIR;
+    const char * default_conf_filename = "/carbon.conf";
+
+    new_conf->run = true;
+
+    /* log level */
+    new_conf->tracing = false;
+    new_conf->log_level = LOG_LEVEL_INFO;
+
+    /* config directory path */
+    new_conf->conf_dir = malloc(sizeof(char)*PATH_MAX);
+    memset(new_conf->conf_dir, 0, sizeof(char)*PATH_MAX);
+    strncpy(new_conf->conf_dir, sysconfdir, PATH_MAX - 1);
+
+    /* config file path */
+    new_conf->conf_file = malloc(sizeof(char)*PATH_MAX);
+    memset(new_conf->conf_file, 0, sizeof(char)*PATH_MAX);
+    snprintf(new_conf->conf_file, PATH_MAX, "%s%s", sysconfdir,
+             default_conf_filename);
+
+    /* storage directory path */
+    new_conf->storage_dir = malloc(sizeof(char)*PATH_MAX);
+    memset(new_conf->storage_dir, 0, sizeof(char)*PATH_MAX);
+    strncpy(new_conf->storage_dir, localstatedir, PATH_MAX - 1);
+
+    /* whisper files in storage directory only */
+    new_conf->storage_dirs = NULL;
+    new_conf->nb_storage_dirs = 0;
+    new_conf->storage_fanout = 0;
+    new_conf->storage_engine = STORAGE_ENGINE_WHISPER;
+    new_conf->compaction_interval = 60;
+
+    /* default listened TCP/UDP ports */
+    new_conf->line_receiver_port = 2003;
+    new_conf->udp_receiver_port = 2003;
+
+    /* cache query service disabled by default */
+    new_conf->cache_query_port = 0;
+
+    /* HTTP query server disabled by default */
+    new_conf->query_server_port = 0;
+    new_conf->query_server_threads = 4;
+
+    new_conf->startup_scan = false;
+    new_conf->startup_scan_threads = 4;
+
+    new_conf->wal_enabled = false;
+    new_conf->wal_segment_size = 64;
+
+    new_conf->cache_snapshot = false;
+
+    new_conf->shutdown_drain = false;
+    new_conf->shutdown_drain_threads = 4;
+    new_conf->shutdown_drain_timeout = 60;
+
+    new_conf->rollup_accumulators = false;
+    new_conf->propagation_deferred = false;
+    new_conf->propagation_max_lag = 60;
+
+    new_conf->cache_spill = false;
+    new_conf->cache_spill_threshold = 10000000;
+    new_conf->cache_spill_shards = 4;
+
+    /* system-wide pressure, memory.pressure of a cgroup can be used too */
+    new_conf->memory_pressure = false;
+    new_conf->memory_pressure_file = malloc(sizeof(char)*PATH_MAX);
+    memset(new_conf->memory_pressure_file, 0, sizeof(char)*PATH_MAX);
+    strncpy(new_conf->memory_pressure_file, "/proc/pressure/memory", PATH_MAX - 1);
+    new_conf->memory_pressure_threshold = 10.0;
+    new_conf->max_cache_points = 0;
+
+    new_conf->metric_idle_timeout = 0;
+
+    new_conf->write_order = WRITE_ORDER_LARGEST;
+    new_conf->write_window = 1000;
+
+    new_conf->open_files_cache = 0;
+    new_conf->open_dirs_cache = 0;
+    new_conf->durability = DURABILITY_NONE;
+    new_conf->durability_interval = 5;
+
+    new_conf->schema = NULL;
+    new_conf->aggregation = NULL;
+
+}
+
 int conf_parse(carbon_conf_t *new_conf) {
 
     int status = 0;
@@ -33,6 +33,7 @@
 void trim_string(char *);
 int string_starts_with(char *, char *);
 uint32_t str_to_seconds(char *);
+int str_to_bool(const char *, bool *);
 
 /* storage schema */
 
@@ -45,7 +46,9 @@ int conf_parse_storage_aggregation_file(carbon_conf_t *);
 /* main configuration file */
 
 char * get_conf_value(const char *);
+void conf_set_defaults(carbon_conf_t *);
 int conf_parse_carbon_file(carbon_conf_t *);
+void conf_free_storage_dirs(carbon_conf_t *);
 int conf_parse(carbon_conf_t *);
 
 #endif
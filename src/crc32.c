@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * CRC32 (IEEE 802.3 polynomial) used to check records of files written by
+ * carbond, such as the write-ahead log and the cache snapshot.
+ */
+
+#include "crc32.h"
+
+static uint32_t crc_table[256];
+
+void crc32_init() {
+
+    uint32_t i = 0, j = 0, crc = 0;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        crc_table[i] = crc;
+    }
+
+}
+
+uint32_t crc32_buf(const char *buf, size_t len) {
+
+    uint32_t crc = 0xFFFFFFFFu;
+
+    while (len--)
+        crc = crc_table[(crc ^ (unsigned char) *buf++) & 0xFF] ^ (crc >> 8);
+
+    return crc ^ 0xFFFFFFFFu;
+
+}
@@ -23,8 +23,86 @@
 #include <stdlib.h>  // malloc()
 #include <stdio.h>   // printf()
 #include <pthread.h> // pthread_mutex_init()
+#include <time.h>    // time()
 
 #include "database.h"
+#include "log.h"
+#include "index.h"
+#include "whisper.h"
+
+#define DATABASE_INITIAL_BUCKETS 1024
+
+/*
+ * FNV-1a hash of metric name.
+ */
+static uint32_t database_hash(const char *m_name) {
+
+    return fnv1a(FNV1A_INIT, m_name);
+
+}
+
+/*
+ * Lookup metric name in hash table. Must be called with database locked.
+ */
+static metric_t * database_lookup(metrics_database_t * db, const char * m_name) {
+
+    metric_t *cur_m = db->buckets[database_hash(m_name) & (db->nb_buckets - 1)];
+
+    for (; cur_m; cur_m = cur_m->hash_next)
+        if (strcmp(cur_m->name, m_name) == 0)
+            break;
+
+    return cur_m;
+
+}
+
+/*
+ * Doubles the number of buckets of the hash table and rehash all metrics.
+ * Must be called with database locked for writing.
+ */
+static void database_grow(metrics_database_t * db) {
+
+    metric_t *cur_m = NULL;
+    uint32_t bucket = 0;
+
+    free(db->buckets);
+    db->nb_buckets *= 2;
+    db->buckets = calloc(db->nb_buckets, sizeof(metric_t *));
+
+    for (cur_m = db->first; cur_m; cur_m = cur_m->next) {
+        bucket = database_hash(cur_m->name) & (db->nb_buckets - 1);
+        cur_m->hash_next = db->buckets[bucket];
+        db->buckets[bucket] = cur_m;
+    }
+
+}
+
+/*
+ * Appends metric to the list and the hash table of database. Must be called
+ * with database locked for writing.
+ */
+static void database_insert(metrics_database_t * db, metric_t * new_metric) {
+
+    uint32_t bucket = 0;
+
+    if (db->last == NULL) { /* no metric in database yet */
+        db->first = new_metric;
+    } else {
+        db->last->next = new_metric;
+    }
+    db->last = new_metric;
+
+    db->nb_metrics++;
+    if (db->nb_metrics > db->nb_buckets) {
+        database_grow(db); /* new metric is hashed with the others */
+        return;
+    }
+
+    bucket = database_hash(new_metric->name) & (db->nb_buckets - 1);
+    new_metric->hash_next = db->buckets[bucket];
+    db->buckets[bucket] = new_metric;
+
+}
 
 /*
  * Checks if metric name already exists in database. If yes, returns a pointer
@@ -33,22 +111,53 @@
 
 metric_t * get_metric(metrics_database_t * db, const char * m_name) {
 
-    metric_t *cur_m = db->first;
+    metric_t *cur_m = NULL;
+
+    pthread_rwlock_rdlock(&(db->lock));
+    cur_m = database_lookup(db, m_name);
+    pthread_rwlock_unlock(&(db->lock));
+
+    return cur_m;
+}
+
+/*
+ * Returns the metric with name m_name in database, creating it if it does not
+ * exist yet. The database is locked for writing only in the latter case and
+ * the metric is searched again under this lock so that concurrent receivers
+ * never add the same metric twice.
+ */
+metric_t * get_or_create_metric(metrics_database_t * db, const char * m_name) {
+
+    metric_t *metric = get_metric(db, m_name);
+    bool created = false;
+
+    if (metric)
+        return metric;
+
+    pthread_rwlock_wrlock(&(db->lock));
+
+    metric = database_lookup(db, m_name);
 
-    while(cur_m) {
-        if (strlen(m_name) == strlen(cur_m->name))
-            if (strncmp(cur_m->name, m_name, strlen(m_name)+1) == 0)
-                return cur_m;
-        cur_m = cur_m->next;
+    if (metric == NULL) {
+        metric = create_new_metric(m_name);
+        database_insert(db, metric);
+        created = true;
     }
 
-    return NULL;
+    pthread_rwlock_unlock(&(db->lock));
+
+    if (created)
+        index_add(m_name);
+
+    return metric;
 }
 
 void add_database_metric_point(metrics_database_t * db,
                                metric_t * m,
                                metric_point_t * new_point) {
 
+    pthread_mutex_lock(&(m->points_lock));
+
     if (m->last == NULL) { /* no points for this metric yet */
         m->points = new_point;
     } else {
@@ -56,16 +165,224 @@ void add_database_metric_point(metrics_database_t * db,
     }
     m->last = new_point;
     m->nb_points += 1;
+    m->last_activity = (uint32_t) time(NULL);
+
+    pthread_mutex_unlock(&(m->points_lock));
+
+    __sync_add_and_fetch(&(db->nb_points), 1);
+}
+
+/*
+ * Frees the metric and its whisper cache.
+ */
+static void free_metric(metric_t * m) {
+
+    /* its file may be closed by other threads until freed */
+    whisper_cache_free(m->wsp_cache);
+    free(m->gor_cache);
+    free(m->wal_held);
+    pthread_mutex_destroy(&(m->lock));
+    pthread_mutex_destroy(&(m->points_lock));
+    free(m->name);
+    free(m);
+
+}
+
+/*
+ * Adds the point to the metric with name m_name in database, creating the
+ * metric if it does not exist yet. The database stays locked while the point
+ * is added so that the metric cannot be evicted in the meantime. Returns false
+ * if the point is out of the retention of the metric and must be dropped by
+ * the caller.
+ */
+bool add_metric_point(metrics_database_t * db, const char * m_name,
+                      metric_point_t * new_point) {
+
+    metric_t *metric = NULL, *new_metric = NULL;
+    bool created = false, added = false;
+    uint32_t now = (uint32_t) time(NULL);
+
+    pthread_rwlock_rdlock(&(db->lock));
+    metric = database_lookup(db, m_name);
+    if (metric) {
+        added = whisper_in_retention(metric, new_point->timestamp, now);
+        if (added)
+            add_database_metric_point(db, metric, new_point);
+    }
+    pthread_rwlock_unlock(&(db->lock));
+
+    if (metric)
+        return added;
+
+    /* storage schema patterns are matched before locking the database */
+    new_metric = create_new_metric(m_name);
+
+    pthread_rwlock_wrlock(&(db->lock));
+
+    metric = database_lookup(db, m_name);
+    if (metric == NULL) {
+        metric = new_metric;
+        database_insert(db, metric);
+        created = true;
+    }
+    added = whisper_in_retention(metric, new_point->timestamp, now);
+    if (added)
+        add_database_metric_point(db, metric, new_point);
+
+    pthread_rwlock_unlock(&(db->lock));
+
+    if (created)
+        index_add(m_name);
+    else /* created by another thread in the meantime */
+        free_metric(new_metric);
+
+    return added;
 }
 
 void add_database_metric(metrics_database_t *db, metric_t *new_metric) {
 
-    if (db->last == NULL) { /* no metric in database yet */
-        db->first = new_metric;
-    } else {
-        db->last->next = new_metric;
+    pthread_rwlock_wrlock(&(db->lock));
+    database_insert(db, new_metric);
+    pthread_rwlock_unlock(&(db->lock));
+}
+
+/*
+ * Detach all the points of the metric and returns them. The metric is left
+ * empty.
+ */
+metric_point_t * take_metric_points(metric_t * m) {
+
+    metric_point_t *points = NULL;
+    uint32_t nb_points = 0;
+
+    pthread_mutex_lock(&(m->points_lock));
+
+    points = m->points;
+    nb_points = m->nb_points;
+    m->points = NULL;
+    m->last = NULL;
+    m->nb_points = 0;
+
+    pthread_mutex_unlock(&(m->points_lock));
+
+    __sync_sub_and_fetch(&(db->nb_points), nb_points);
+
+    return points;
+}
+
+/*
+ * Inserts the list of nb_points points from first to last before the points
+ * of the metric in cache. Used to give back older points to the cache.
+ */
+void prepend_metric_points(metric_t * m, metric_point_t * first,
+                           metric_point_t * last, uint32_t nb_points) {
+
+    if (first == NULL)
+        return;
+
+    pthread_mutex_lock(&(m->points_lock));
+
+    last->next = m->points;
+    m->points = first;
+    if (m->last == NULL)
+        m->last = last;
+    m->nb_points += nb_points;
+
+    pthread_mutex_unlock(&(m->points_lock));
+
+    __sync_add_and_fetch(&(db->nb_points), nb_points);
+}
+
+/*
+ * Copy timestamps and values of the points currently in cache of the metric
+ * with name m_name into newly allocated arrays. Returns the number of points
+ * copied, 0 with arrays set to NULL if the metric is not in database.
+ */
+uint32_t copy_metric_points(metrics_database_t * db, const char * m_name,
+                            uint32_t ** timestamps, double ** values) {
+
+    metric_point_t *cur_p = NULL;
+    metric_t *m = NULL;
+    uint32_t nb_points = 0;
+
+    *timestamps = NULL;
+    *values = NULL;
+
+    pthread_rwlock_rdlock(&(db->lock));
+
+    m = database_lookup(db, m_name);
+    if (m == NULL) {
+        pthread_rwlock_unlock(&(db->lock));
+        return 0;
     }
-    db->last = new_metric;
+
+    pthread_mutex_lock(&(m->points_lock));
+
+    *timestamps = malloc(sizeof(uint32_t) * (m->nb_points + 1));
+    *values = malloc(sizeof(double) * (m->nb_points + 1));
+
+    for (cur_p = m->points; cur_p; cur_p = cur_p->next, nb_points++) {
+        (*timestamps)[nb_points] = cur_p->timestamp;
+        (*values)[nb_points] = cur_p->value;
+    }
+
+    pthread_mutex_unlock(&(m->points_lock));
+    pthread_rwlock_unlock(&(db->lock));
+
+    return nb_points;
+}
+
+/*
+ * Removes from database the metrics of storage root without points in cache,
+ * nor slots waiting for propagation, which received no point for idle seconds.
+ * Must be called by the writer of this root, which is the only thread keeping
+ * pointers to its metrics without holding database lock, apart from the
+ * metrics pinned by other threads. Returns the number of metrics evicted.
+ */
+uint32_t evict_idle_metrics(metrics_database_t * db, uint32_t idle,
+                            uint32_t root) {
+
+    metric_t *cur_m = NULL, *prev_m = NULL, *next_m = NULL, **bucket = NULL;
+    uint32_t now = (uint32_t) time(NULL), nb_evicted = 0;
+
+    pthread_rwlock_wrlock(&(db->lock));
+
+    for (cur_m = db->first; cur_m; cur_m = next_m) {
+
+        next_m = cur_m->next;
+
+        if (cur_m->storage_root != root || cur_m->nb_points || cur_m->pins
+            || cur_m->nb_wal_held
+            || now - cur_m->last_activity < idle
+            || (cur_m->wsp_cache && cur_m->wsp_cache->nb_pending)
+            || pthread_mutex_trylock(&(cur_m->lock))) {
+            prev_m = cur_m;
+            continue;
+        }
+        pthread_mutex_unlock(&(cur_m->lock));
+
+        /* unlink from list */
+        if (prev_m)
+            prev_m->next = next_m;
+        else
+            db->first = next_m;
+        if (db->last == cur_m)
+            db->last = prev_m;
+
+        /* unlink from hash table */
+        bucket = &db->buckets[database_hash(cur_m->name) & (db->nb_buckets - 1)];
+        while (*bucket != cur_m)
+            bucket = &(*bucket)->hash_next;
+        *bucket = cur_m->hash_next;
+
+        db->nb_metrics--;
+        free_metric(cur_m);
+        nb_evicted++;
+    }
+
+    pthread_rwlock_unlock(&(db->lock));
+
+    return nb_evicted;
 }
 
 metric_point_t * create_new_metric_point(const uint32_t timestamp, const double value) {
@@ -87,9 +404,15 @@ metric_t * create_new_metric(const char *name) {
     res->next = NULL;
     res->last = NULL;
     res->nb_points = 0;
+    res->last_activity = (uint32_t) time(NULL);
+    res->storage_root = whisper_metric_root(name);
+    whisper_resolve_retention(res);
     if (pthread_mutex_init(&(res->lock), NULL) != 0) {
         printf("\n mutex init failed\n");
     }
+    if (pthread_mutex_init(&(res->points_lock), NULL) != 0) {
+        printf("\n mutex init failed\n");
+    }
     return res;
 
 }
@@ -98,5 +421,12 @@ void database_init() {
 
     db->first = NULL;
     db->last = NULL;
+    db->nb_metrics = 0;
+    db->nb_points = 0;
+    db->nb_buckets = DATABASE_INITIAL_BUCKETS;
+    db->buckets = calloc(db->nb_buckets, sizeof(metric_t *));
+    if (pthread_rwlock_init(&(db->lock), NULL) != 0) {
+        error("database lock init failed");
+    }
 
 }
@@ -27,8 +27,14 @@
 
 
 metric_t * get_metric(metrics_database_t *, const char *);
+metric_t * get_or_create_metric(metrics_database_t *, const char *);
 void add_database_metric_point(metrics_database_t *, metric_t *, metric_point_t *);
+bool add_metric_point(metrics_database_t *, const char *, metric_point_t *);
 void add_database_metric(metrics_database_t *, metric_t *);
+metric_point_t * take_metric_points(metric_t *);
+void prepend_metric_points(metric_t *, metric_point_t *, metric_point_t *, uint32_t);
+uint32_t copy_metric_points(metrics_database_t *, const char *, uint32_t **, double **);
+uint32_t evict_idle_metrics(metrics_database_t *, uint32_t, uint32_t);
 metric_point_t * create_new_metric_point(const uint32_t, const double);
 metric_t * create_new_metric(const char *);
 void database_init();
@@ -0,0 +1,1252 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Gorilla storage engine. The points of a metric are appended to its file in
+ * blocks compressed as in Facebook's Gorilla time series database: timestamps
+ * are encoded as deltas of deltas and values are XORed with the previous one,
+ * so that regular series of slowly changing values take a few bits per point.
+ *
+ * Each block holds the points of one level of the storage schema retentions
+ * within one time chunk of the level. The writer only appends blocks of the
+ * highest precision level, the compactor thread periodically appends the
+ * blocks of the lower precision levels rolled up from the new points and,
+ * less often, rewrites the files with their blocks merged and the points out
+ * of retention dropped.
+ *
+ * File layout, in host byte order:
+ *
+ *   file header:  magic | version
+ *   block header: magic | level | nb_points | step | first | last | size | crc
+ *   block data:   size bytes of bit stream, crc is the CRC32 of these bytes
+ *
+ * When several blocks hold a point at the same timestamp, the value of the
+ * last one in the file wins. Truncated or corrupted blocks, left by a crash
+ * during an append, are skipped up to the next valid block.
+ */
+
+#include <stdlib.h>   // malloc()
+#include <stdio.h>    // snprintf()
+#include <string.h>   // memcpy()
+#include <errno.h>    // errno
+#include <fcntl.h>    // open()
+#include <unistd.h>   // write()
+#include <math.h>     // NAN
+#include <time.h>     // time()
+#include <pthread.h>
+#include <inttypes.h> // PRIu32
+#include <sys/stat.h> // fstat()
+
+#include "gorilla.h"
+#include "aggregation.h"
+#include "crc32.h"
+#include "log.h"
+
+#define GORILLA_MAGIC 0x524f4743       /* "CGOR" */
+#define GORILLA_BLOCK_MAGIC 0x4b4c4247 /* "GBLK" */
+#define GORILLA_VERSION 1
+#define GORILLA_CHUNK_POINTS 720       /* slots of a level in a time chunk */
+#define GORILLA_BLOCK_MAX_POINTS UINT16_MAX
+
+struct gorilla_file_header_s {
+    uint32_t magic;
+    uint32_t version;
+};
+
+typedef struct gorilla_file_header_s gorilla_file_header_t;
+
+struct gorilla_block_header_s {
+    uint32_t magic;
+    uint16_t level;
+    uint16_t nb_points;
+    uint32_t step; /* unit of the deltas of timestamps */
+    uint32_t first;
+    uint32_t last;
+    uint32_t size;
+    uint32_t crc;
+};
+
+typedef struct gorilla_block_header_s gorilla_block_header_t;
+
+struct gorilla_point_s {
+    uint32_t timestamp;
+    uint32_t seq; /* order of the point in file or in written batch */
+    double value;
+};
+
+typedef struct gorilla_point_s gorilla_point_t;
+
+/* growing buffer of bytes, written bit per bit by gorilla_put_bits() */
+struct gorilla_buf_s {
+    unsigned char *data;
+    size_t size;   /* allocated bytes */
+    size_t len;    /* used bytes */
+    size_t bitpos; /* position of next bit, in bits */
+};
+
+typedef struct gorilla_buf_s gorilla_buf_t;
+
+/* state of the file of a metric after its last compaction */
+struct gorilla_cache_s {
+    ino_t inode;
+    off_t compacted_size; /* size of the file after last compaction */
+    off_t full_size;      /* size of the file after last rewrite */
+    time_t full_time;     /* time of last rewrite */
+};
+
+/*
+ * Files appended since last sync in batched durability mode. Files are not
+ * kept open, they are opened again by name to be synced.
+ */
+static struct {
+    pthread_mutex_t lock;
+    char **filenames;
+    uint32_t nb_filenames;
+    uint32_t size;
+} gorilla_dirty = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+static void gorilla_reserve(gorilla_buf_t *buf, size_t len) {
+
+    if (buf->len + len <= buf->size)
+        return;
+
+    while (buf->len + len > buf->size)
+        buf->size = buf->size ? buf->size * 2 : 4096;
+
+    buf->data = realloc(buf->data, buf->size);
+
+}
+
+static void gorilla_append(gorilla_buf_t *buf, const void *data, size_t len) {
+
+    gorilla_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->bitpos = buf->len * 8;
+
+}
+
+/*
+ * Append the nb lowest bits of value to the bit stream, most significant
+ * first.
+ */
+static void gorilla_put_bits(gorilla_buf_t *buf, uint64_t value, int nb) {
+
+    int bit = 0;
+
+    gorilla_reserve(buf, 9);
+
+    for (bit = nb - 1; bit >= 0; bit--) {
+        if (buf->bitpos % 8 == 0)
+            buf->data[buf->len++] = 0;
+        if ((value >> bit) & 1)
+            buf->data[buf->len - 1] |= 0x80 >> (buf->bitpos % 8);
+        buf->bitpos++;
+    }
+
+}
+
+/* bit stream of a block being decoded */
+struct gorilla_reader_s {
+    const unsigned char *data;
+    size_t nb_bits;
+    size_t bitpos;
+    bool overflow;
+};
+
+typedef struct gorilla_reader_s gorilla_reader_t;
+
+static uint64_t gorilla_get_bits(gorilla_reader_t *rd, int nb) {
+
+    uint64_t value = 0;
+    int bit = 0;
+
+    if (rd->bitpos + nb > rd->nb_bits) {
+        rd->overflow = true;
+        return 0;
+    }
+
+    for (bit = 0; bit < nb; bit++, rd->bitpos++)
+        value = (value << 1)
+                | ((rd->data[rd->bitpos / 8] >> (7 - rd->bitpos % 8)) & 1);
+
+    return value;
+
+}
+
+static uint64_t gorilla_double_bits(double value) {
+
+    uint64_t bits = 0;
+
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+
+}
+
+static double gorilla_bits_double(uint64_t bits) {
+
+    double value = 0;
+
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+
+}
+
+/*
+ * Encode a delta of deltas of timestamps, in steps, zigzag encoded so that
+ * small negative deltas also take a few bits:
+ *
+ *   0             same delta as previous point
+ *   10   + 7 bits
+ *   110  + 9 bits
+ *   1110 + 12 bits
+ *   1111 + 32 bits
+ */
+static void gorilla_put_dod(gorilla_buf_t *buf, int64_t dod) {
+
+    uint64_t zigzag = ((uint64_t) dod << 1) ^ (uint64_t) (dod >> 63);
+
+    if (zigzag == 0)
+        gorilla_put_bits(buf, 0, 1);
+    else if (zigzag < (1 << 7)) {
+        gorilla_put_bits(buf, 0x2, 2);
+        gorilla_put_bits(buf, zigzag, 7);
+    } else if (zigzag < (1 << 9)) {
+        gorilla_put_bits(buf, 0x6, 3);
+        gorilla_put_bits(buf, zigzag, 9);
+    } else if (zigzag < (1 << 12)) {
+        gorilla_put_bits(buf, 0xe, 4);
+        gorilla_put_bits(buf, zigzag, 12);
+    } else {
+        gorilla_put_bits(buf, 0xf, 4);
+        gorilla_put_bits(buf, zigzag, 32);
+    }
+
+}
+
+static int64_t gorilla_get_dod(gorilla_reader_t *rd) {
+
+    uint64_t zigzag = 0;
+    int prefix = 0;
+
+    /* count leading ones, up to 4 */
+    while (prefix < 4 && gorilla_get_bits(rd, 1))
+        prefix++;
+
+    switch (prefix) {
+        case 0:
+            return 0;
+        case 1:
+            zigzag = gorilla_get_bits(rd, 7);
+            break;
+        case 2:
+            zigzag = gorilla_get_bits(rd, 9);
+            break;
+        case 3:
+            zigzag = gorilla_get_bits(rd, 12);
+            break;
+        default:
+            zigzag = gorilla_get_bits(rd, 32);
+            break;
+    }
+
+    return (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+
+}
+
+/*
+ * Append a block with the nb_points sorted points of level to buf. All
+ * timestamps must be multiples of step.
+ */
+static void gorilla_encode_block(gorilla_buf_t *buf, uint16_t level,
+                                 uint32_t step, const gorilla_point_t *points,
+                                 uint32_t nb_points) {
+
+    gorilla_block_header_t header;
+    size_t header_pos = buf->len;
+    uint64_t prev_value = 0, xor = 0;
+    int64_t prev_delta = 0, delta = 0;
+    int leading = -1, trailing = 0, lz = 0, tz = 0, nb_bits = 0;
+    uint32_t i = 0;
+
+    memset(&header, 0, sizeof(header));
+    gorilla_append(buf, &header, sizeof(header));
+
+    gorilla_put_bits(buf, points[0].timestamp, 32);
+    prev_value = gorilla_double_bits(points[0].value);
+    gorilla_put_bits(buf, prev_value, 64);
+
+    for (i = 1; i < nb_points; i++) {
+
+        delta = (points[i].timestamp - points[i-1].timestamp) / step;
+        gorilla_put_dod(buf, delta - prev_delta);
+        prev_delta = delta;
+
+        xor = gorilla_double_bits(points[i].value) ^ prev_value;
+        prev_value ^= xor;
+
+        if (xor == 0) {
+            gorilla_put_bits(buf, 0, 1);
+            continue;
+        }
+
+        lz = __builtin_clzll(xor);
+        tz = __builtin_ctzll(xor);
+        if (lz > 31)
+            lz = 31;
+
+        if (leading >= 0 && lz >= leading && tz >= trailing) {
+            /* meaningful bits fit in the window of the previous value */
+            gorilla_put_bits(buf, 0x2, 2);
+            gorilla_put_bits(buf, xor >> trailing, 64 - leading - trailing);
+        } else {
+            nb_bits = 64 - lz - tz;
+            gorilla_put_bits(buf, 0x3, 2);
+            gorilla_put_bits(buf, lz, 5);
+            gorilla_put_bits(buf, nb_bits - 1, 6);
+            gorilla_put_bits(buf, xor >> tz, nb_bits);
+            leading = lz;
+            trailing = tz;
+        }
+    }
+
+    header.magic = GORILLA_BLOCK_MAGIC;
+    header.level = level;
+    header.nb_points = nb_points;
+    header.step = step;
+    header.first = points[0].timestamp;
+    header.last = points[nb_points-1].timestamp;
+    header.size = buf->len - header_pos - sizeof(header);
+    header.crc = crc32_buf((const char *) buf->data + header_pos + sizeof(header),
+                           header.size);
+    memcpy(buf->data + header_pos, &header, sizeof(header));
+    buf->bitpos = buf->len * 8;
+
+}
+
+/*
+ * Decode the points of the block data into points, numbered from seq. Returns
+ * 1 if the bit stream is shorter than announced by its header.
+ */
+static int gorilla_decode_block(const gorilla_block_header_t *header,
+                                const unsigned char *data,
+                                gorilla_point_t *points, uint32_t seq) {
+
+    gorilla_reader_t rd = { data, (size_t) header->size * 8, 0, false };
+    uint64_t value = 0, nb_bits = 0;
+    int64_t delta = 0;
+    uint32_t timestamp = 0, i = 0;
+    int leading = 0, trailing = 0;
+
+    timestamp = gorilla_get_bits(&rd, 32);
+    value = gorilla_get_bits(&rd, 64);
+    points[0].timestamp = timestamp;
+    points[0].seq = seq;
+    points[0].value = gorilla_bits_double(value);
+
+    for (i = 1; i < header->nb_points && !rd.overflow; i++) {
+
+        delta += gorilla_get_dod(&rd);
+        timestamp += delta * header->step;
+
+        if (gorilla_get_bits(&rd, 1)) {
+            if (gorilla_get_bits(&rd, 1)) {
+                leading = gorilla_get_bits(&rd, 5);
+                nb_bits = gorilla_get_bits(&rd, 6) + 1;
+                trailing = 64 - leading - nb_bits;
+            }
+            value ^= gorilla_get_bits(&rd, 64 - leading - trailing) << trailing;
+        }
+
+        points[i].timestamp = timestamp;
+        points[i].seq = seq + i;
+        points[i].value = gorilla_bits_double(value);
+    }
+
+    return rd.overflow ? 1 : 0;
+
+}
+
+static int gorilla_cmp_points(const void *a, const void *b) {
+
+    const gorilla_point_t *pa = a, *pb = b;
+
+    if (pa->timestamp != pb->timestamp)
+        return pa->timestamp < pb->timestamp ? -1 : 1;
+    if (pa->seq != pb->seq)
+        return pa->seq < pb->seq ? -1 : 1;
+    return 0;
+
+}
+
+/*
+ * Sort the points by timestamp and only keep the last one by sequence of
+ * those with the same timestamp. Returns the new number of points.
+ */
+static uint32_t gorilla_merge_points(gorilla_point_t *points,
+                                     uint32_t nb_points) {
+
+    uint32_t i = 0, nb_merged = 0;
+
+    if (nb_points == 0)
+        return 0;
+
+    qsort(points, nb_points, sizeof(gorilla_point_t), gorilla_cmp_points);
+
+    for (i = 1; i < nb_points; i++) {
+        if (points[i].timestamp != points[nb_merged].timestamp)
+            nb_merged++;
+        points[nb_merged] = points[i];
+    }
+
+    return nb_merged + 1;
+
+}
+
+/*
+ * Append to buf the blocks of the nb_points sorted points of level, split at
+ * the boundaries of the time chunks of the level.
+ */
+static void gorilla_encode_level(gorilla_buf_t *buf, uint16_t level,
+                                 uint32_t step, const gorilla_point_t *points,
+                                 uint32_t nb_points) {
+
+    uint64_t chunk = (uint64_t) step * GORILLA_CHUNK_POINTS;
+    uint32_t first = 0, i = 0;
+
+    for (first = 0; first < nb_points; first = i) {
+        for (i = first + 1; i < nb_points; i++)
+            if (points[i].timestamp / chunk != points[first].timestamp / chunk
+                || i - first == GORILLA_BLOCK_MAX_POINTS)
+                break;
+        gorilla_encode_block(buf, level, step, points + first, i - first);
+    }
+
+}
+
+/*
+ * Search the next valid block in file after offset, when the block at offset
+ * is truncated or corrupted. Returns its offset or -1 if there is none.
+ */
+static off_t gorilla_next_block(int fd, off_t offset) {
+
+    gorilla_block_header_t header;
+    struct stat st;
+    unsigned char *data = NULL;
+    uint32_t magic = GORILLA_BLOCK_MAGIC;
+    off_t next = -1;
+    size_t size = 0, pos = 0;
+
+    if (fstat(fd, &st) || st.st_size <= offset + 1)
+        return -1;
+
+    size = st.st_size - offset - 1;
+    data = malloc(size);
+    if (pread(fd, data, size, offset + 1) != (ssize_t) size) {
+        free(data);
+        return -1;
+    }
+
+    for (pos = 0; pos + sizeof(header) <= size; pos++) {
+        if (memcmp(data + pos, &magic, sizeof(magic)))
+            continue;
+        memcpy(&header, data + pos, sizeof(header));
+        if (header.nb_points == 0 || header.step == 0
+            || header.size > size - pos - sizeof(header)
+            || crc32_buf((const char *) data + pos + sizeof(header),
+                         header.size) != header.crc)
+            continue;
+        next = offset + 1 + pos;
+        break;
+    }
+
+    free(data);
+
+    return next;
+
+}
+
+/*
+ * Read the points of the blocks of level in file overlapping from and until,
+ * starting with the block at start or with the first block of the file if
+ * start is 0, numbered in file order. The points are returned unsorted, with
+ * the number of points in nb_points.
+ */
+static gorilla_point_t * gorilla_read_level(int fd, const char *filename,
+                                            off_t start, uint16_t level,
+                                            uint32_t from, uint32_t until,
+                                            uint32_t *nb_points) {
+
+    gorilla_file_header_t file_header;
+    gorilla_block_header_t header;
+    gorilla_point_t *points = NULL;
+    unsigned char *data = NULL;
+    uint32_t size_points = 0, seq = 0;
+    off_t offset = start ? start : (off_t) sizeof(file_header), block = 0;
+    ssize_t len = 0;
+
+    *nb_points = 0;
+
+    len = pread(fd, &file_header, sizeof(file_header), 0);
+    if (len == 0)
+        return NULL;
+    if (len != sizeof(file_header) || file_header.magic != GORILLA_MAGIC
+        || file_header.version != GORILLA_VERSION) {
+        error("gorilla: invalid header of file %s", filename);
+        return NULL;
+    }
+
+    while ((len = pread(fd, &header, sizeof(header), offset)) > 0) {
+
+        block = offset;
+
+        if (len != sizeof(header) || header.magic != GORILLA_BLOCK_MAGIC
+            || header.nb_points == 0 || header.step == 0)
+            goto corrupted;
+        offset += sizeof(header);
+
+        if (header.level != level || header.last < from || header.first > until) {
+            offset += header.size;
+            seq += header.nb_points;
+            continue;
+        }
+
+        data = realloc(data, header.size);
+        if (pread(fd, data, header.size, offset) != (ssize_t) header.size
+            || crc32_buf((const char *) data, header.size) != header.crc)
+            goto corrupted;
+        offset += header.size;
+
+        if (*nb_points + header.nb_points > size_points) {
+            size_points = (*nb_points + header.nb_points) * 2;
+            points = realloc(points, size_points * sizeof(gorilla_point_t));
+        }
+
+        if (gorilla_decode_block(&header, data, points + *nb_points, seq) == 0) {
+            *nb_points += header.nb_points;
+            seq += header.nb_points;
+            continue;
+        }
+
+        corrupted:
+            offset = gorilla_next_block(fd, block);
+            error("gorilla: corrupted block in file %s at offset %lld, %s",
+                  filename, (long long) block,
+                  offset < 0 ? "ignoring the rest of the file"
+                             : "skipped up to next block");
+            if (offset < 0)
+                break;
+    }
+
+    if (len < 0)
+        error("gorilla: error while reading file %s: %s", filename,
+              strerror(errno));
+
+    free(data);
+
+    return points;
+
+}
+
+/*
+ * Write all the buffer in file descriptor. Returns 1 on error.
+ */
+static int gorilla_write_buf(int fd, const gorilla_buf_t *buf) {
+
+    size_t written = 0;
+    ssize_t len = 0;
+
+    while (written < buf->len) {
+        len = write(fd, buf->data + written, buf->len - written);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        written += len;
+    }
+
+    return 0;
+
+}
+
+/*
+ * Adds filename, allocated by the caller, to the files to sync.
+ */
+static void gorilla_mark_dirty(char *filename) {
+
+    pthread_mutex_lock(&gorilla_dirty.lock);
+
+    if (gorilla_dirty.nb_filenames == gorilla_dirty.size) {
+        gorilla_dirty.size = gorilla_dirty.size ? gorilla_dirty.size * 2 : 256;
+        gorilla_dirty.filenames = realloc(gorilla_dirty.filenames,
+                                          gorilla_dirty.size * sizeof(char *));
+    }
+    gorilla_dirty.filenames[gorilla_dirty.nb_filenames++] = filename;
+
+    pthread_mutex_unlock(&gorilla_dirty.lock);
+
+}
+
+/*
+ * Append the nb_points points of metric to its file in blocks of the highest
+ * precision level of its retentions, in one write. The file and its
+ * directories are created if needed. Points out of retention are dropped, the
+ * last one wins among points in the same slot. The metric must be locked by
+ * the caller.
+ */
+int gorilla_write_points(metric_t *metric, const uint32_t *timestamps,
+                         const double *values, uint32_t nb_points) {
+
+    retention_t *retention = whisper_find_retention(metric);
+    gorilla_file_header_t file_header = { GORILLA_MAGIC, GORILLA_VERSION };
+    gorilla_point_t *points = NULL;
+    gorilla_buf_t buf;
+    struct stat st;
+    char *filename = NULL;
+    uint32_t now = (uint32_t) time(NULL), step = 0, nb_kept = 0, i = 0;
+    int fd = -1, ret = EXIT_SUCCESS;
+
+    if (retention == NULL) {
+        error("gorilla: no storage schema for metric %s", metric->name);
+        return EXIT_FAILURE;
+    }
+    step = retention->time_per_point;
+
+    points = malloc((nb_points + 1) * sizeof(gorilla_point_t));
+    for (i = 0; i < nb_points; i++) {
+        if (!whisper_in_retention(metric, timestamps[i], now)) {
+            debug("gorilla: point %" PRIu32 " of %s out of retention, dropped",
+                  timestamps[i], metric->name);
+            continue;
+        }
+        points[nb_kept].timestamp = timestamps[i] - timestamps[i] % step;
+        points[nb_kept].seq = i;
+        points[nb_kept].value = values[i];
+        nb_kept++;
+    }
+
+    nb_kept = gorilla_merge_points(points, nb_kept);
+    if (nb_kept == 0) {
+        free(points);
+        return EXIT_SUCCESS;
+    }
+
+    filename = whisper_metric_filename(metric->name, GORILLA_EXTENSION);
+
+    fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0 && errno == ENOENT) {
+        whisper_create_dirs(metric);
+        fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    }
+    if (fd < 0) {
+        error("gorilla: error while opening file %s: %s", filename,
+              strerror(errno));
+        ret = EXIT_FAILURE;
+        goto end;
+    }
+
+    memset(&buf, 0, sizeof(buf));
+
+    if (fstat(fd, &st) == 0 && st.st_size == 0)
+        gorilla_append(&buf, &file_header, sizeof(file_header));
+
+    gorilla_encode_level(&buf, 0, step, points, nb_kept);
+
+    if (gorilla_write_buf(fd, &buf)) {
+        error("gorilla: error while writing file %s: %s", filename,
+              strerror(errno));
+        ret = EXIT_FAILURE;
+    }
+
+    debug("gorilla: appended %" PRIu32 " points in %zu bytes to %s", nb_kept,
+          buf.len, filename);
+
+    close(fd);
+    free(buf.data);
+
+    /* synced with the other files appended by gorilla_sync_files() */
+    if (ret == EXIT_SUCCESS && conf->durability == DURABILITY_BATCHED) {
+        gorilla_mark_dirty(filename);
+        filename = NULL;
+    }
+
+    end:
+        free(points);
+        free(filename);
+
+        return ret;
+
+}
+
+/*
+ * Read the values of the metric between from and until (excluded) in the
+ * level with the highest precision whose retention covers from, with the
+ * same intervals as whisper_fetch(). The points of the lower precision levels
+ * are only updated by compaction, they lag behind the highest precision level
+ * by up to the compaction interval. Returns NULL if the metric has no file or
+ * if the range is out of its retention.
+ */
+whisper_series_t * gorilla_fetch(const char *metric_name,
+                                 uint32_t from, uint32_t until) {
+
+    metric_t metric;
+    retention_t *retention = NULL, *cur_ret = NULL;
+    whisper_series_t *series = NULL;
+    gorilla_point_t *points = NULL;
+    char *filename = NULL;
+    uint32_t now = (uint32_t) time(NULL), max_retention = 0, oldest = 0,
+             from_interval = 0, until_interval = 0, step = 0, nb_points = 0,
+             nb_read = 0, i = 0;
+    uint16_t level = 0;
+    int fd = -1;
+
+    memset(&metric, 0, sizeof(metric_t));
+    metric.name = (char *) metric_name;
+
+    retention = whisper_find_retention(&metric);
+    if (retention == NULL)
+        return NULL;
+
+    for (cur_ret = retention; cur_ret; cur_ret = cur_ret->next)
+        if (cur_ret->time_to_store > max_retention)
+            max_retention = cur_ret->time_to_store;
+
+    oldest = now > max_retention ? now - max_retention : 0;
+
+    if (until > now)
+        until = now;
+    if (from < oldest)
+        from = oldest;
+    if (from >= until) {
+        debug("gorilla: fetch range out of retention of %s", metric_name);
+        return NULL;
+    }
+
+    /* select the first level whose retention covers from */
+    for (cur_ret = retention; cur_ret->next; cur_ret = cur_ret->next, level++)
+        if (cur_ret->time_to_store >= now - from)
+            break;
+    step = cur_ret->time_per_point;
+
+    from_interval = from - (from % step) + step;
+    until_interval = until - (until % step) + step;
+    if (from_interval == until_interval)
+        until_interval += step;
+
+    nb_points = (until_interval - from_interval) / step;
+    if (nb_points > cur_ret->time_to_store / step) {
+        nb_points = cur_ret->time_to_store / step;
+        from_interval = until_interval - nb_points * step;
+    }
+
+    filename = whisper_metric_filename(metric_name, GORILLA_EXTENSION);
+    debug("gorilla: fetching %s from %" PRIu32 " until %" PRIu32 "",
+          filename, from, until);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            error("gorilla: error while opening file %s: %s", filename,
+                  strerror(errno));
+        free(filename);
+        return NULL;
+    }
+
+    points = gorilla_read_level(fd, filename, 0, level, from_interval,
+                                until_interval - 1, &nb_read);
+    nb_read = gorilla_merge_points(points, nb_read);
+    close(fd);
+    free(filename);
+
+    series = calloc(1, sizeof(whisper_series_t));
+    series->from = from_interval;
+    series->until = until_interval;
+    series->step = step;
+    series->nb_values = nb_points;
+    series->values = malloc(nb_points * sizeof(double));
+
+    for (i = 0; i < nb_points; i++)
+        series->values[i] = NAN;
+
+    for (i = 0; i < nb_read; i++) {
+        if (points[i].timestamp < from_interval
+            || points[i].timestamp >= until_interval
+            || (points[i].timestamp - from_interval) % step)
+            continue;
+        series->values[(points[i].timestamp - from_interval) / step] =
+            points[i].value;
+    }
+
+    free(points);
+
+    return series;
+
+}
+
+/*
+ * Aggregate the points of level with step, whose retention starts at oldest,
+ * into the slots of the lower level with lower_step. As in whisper files, the
+ * slot of the lower level at timestamp aggregates the points after the
+ * previous slot up to timestamp. Only the slots entirely covered by the
+ * retention of the level are computed, the others are left to the points
+ * already in the lower level. The aggregated points are appended to lower
+ * points with sequence numbers after the existing ones. Returns the new number
+ * of lower points.
+ */
+static uint32_t gorilla_rollup(const pattern_aggregation_t *agg,
+                               const gorilla_point_t *points,
+                               uint32_t nb_points, uint32_t step,
+                               uint32_t oldest, gorilla_point_t **lower,
+                               uint32_t nb_lower, uint32_t lower_step) {
+
+    uint32_t slots = lower_step / step, size_lower = nb_lower, seq = 0,
+             slot = 0, start = 0, nb_known = 0, i = 0, j = 0;
+    uint32_t *span_ts = NULL;
+    double *span_values = NULL, value = 0.0;
+
+    span_ts = malloc(slots * sizeof(uint32_t));
+    span_values = malloc(slots * sizeof(double));
+
+    for (j = 0; j < nb_lower; j++)
+        if ((*lower)[j].seq >= seq)
+            seq = (*lower)[j].seq + 1;
+
+    for (i = 0; i < nb_points; i = j) {
+
+        /* first multiple of lower step not before the point */
+        slot = points[i].timestamp % lower_step
+               ? points[i].timestamp - points[i].timestamp % lower_step
+                 + lower_step
+               : points[i].timestamp;
+        start = slot - lower_step + step;
+
+        memset(span_ts, 0, slots * sizeof(uint32_t));
+        for (j = i; j < nb_points && points[j].timestamp <= slot; j++) {
+            span_ts[(points[j].timestamp - start) / step] = points[j].timestamp;
+            span_values[(points[j].timestamp - start) / step] = points[j].value;
+        }
+
+        if (start < oldest)
+            continue;
+
+        nb_known = aggregate_points(agg->method, span_ts, span_values, slots,
+                                    start, step, &value);
+        if ((float) nb_known / slots < agg->xff)
+            continue;
+
+        if (nb_lower == size_lower) {
+            size_lower = size_lower ? size_lower * 2 : 64;
+            *lower = realloc(*lower, size_lower * sizeof(gorilla_point_t));
+        }
+        (*lower)[nb_lower].timestamp = slot;
+        (*lower)[nb_lower].seq = seq++;
+        (*lower)[nb_lower].value = value;
+        nb_lower++;
+    }
+
+    free(span_ts);
+    free(span_values);
+
+    return nb_lower;
+
+}
+
+/* first multiple of step not before timestamp */
+static uint32_t gorilla_slot(uint32_t timestamp, uint32_t step) {
+
+    return timestamp % step ? timestamp - timestamp % step + step : timestamp;
+
+}
+
+/*
+ * Rewrite the file of metric, opened on fd with status st, with one sorted
+ * series of points per level, the points of each level rolled up into the
+ * level below and the points out of retention dropped. Returns 1 on error.
+ */
+static int gorilla_compact_full(metric_t *metric, int fd, const char *filename,
+                                const struct stat *st,
+                                const pattern_aggregation_t *agg,
+                                const uint32_t *steps, const uint32_t *oldest,
+                                uint32_t nb_levels) {
+
+    gorilla_file_header_t file_header = { GORILLA_MAGIC, GORILLA_VERSION };
+    gorilla_point_t **levels = NULL;
+    uint32_t *nb_level_points = NULL;
+    uint32_t level = 0, i = 0, nb_kept = 0;
+    gorilla_buf_t buf;
+    struct stat tmp_st;
+    struct timespec times[2];
+    char tmp_filename[PATH_MAX+4];
+    int tmp_fd = -1, ret = EXIT_FAILURE;
+
+    levels = calloc(nb_levels, sizeof(gorilla_point_t *));
+    nb_level_points = calloc(nb_levels, sizeof(uint32_t));
+
+    for (level = 0; level < nb_levels; level++) {
+        levels[level] = gorilla_read_level(fd, filename, 0, level, 0,
+                                           UINT32_MAX, &nb_level_points[level]);
+        /* points of a level written with another schema */
+        for (i = 0; i < nb_level_points[level]; i++)
+            levels[level][i].timestamp -= levels[level][i].timestamp % steps[level];
+        nb_level_points[level] = gorilla_merge_points(levels[level],
+                                                      nb_level_points[level]);
+    }
+
+    for (level = 0; agg && level + 1 < nb_levels; level++) {
+        if (steps[level+1] % steps[level]) {
+            error("gorilla: step of retention %" PRIu32 " of %s is not a "
+                  "multiple of the previous one, not rolled up", level + 1,
+                  metric->name);
+            break;
+        }
+        nb_level_points[level+1] =
+            gorilla_rollup(agg, levels[level], nb_level_points[level],
+                           steps[level], oldest[level], &levels[level+1],
+                           nb_level_points[level+1], steps[level+1]);
+        nb_level_points[level+1] = gorilla_merge_points(levels[level+1],
+                                                        nb_level_points[level+1]);
+    }
+
+    memset(&buf, 0, sizeof(buf));
+    gorilla_append(&buf, &file_header, sizeof(file_header));
+
+    for (level = 0; level < nb_levels; level++) {
+        for (i = 0, nb_kept = 0; i < nb_level_points[level]; i++)
+            if (levels[level][i].timestamp >= oldest[level])
+                levels[level][nb_kept++] = levels[level][i];
+        if (nb_kept)
+            gorilla_encode_level(&buf, level, steps[level], levels[level],
+                                 nb_kept);
+    }
+
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+
+    tmp_fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tmp_fd < 0) {
+        error("gorilla: error while creating file %s: %s", tmp_filename,
+              strerror(errno));
+        goto end;
+    }
+
+    if (gorilla_write_buf(tmp_fd, &buf)) {
+        error("gorilla: error while writing file %s: %s", tmp_filename,
+              strerror(errno));
+        close(tmp_fd);
+        unlink(tmp_filename);
+        goto end;
+    }
+
+    if (conf->durability != DURABILITY_NONE && fdatasync(tmp_fd))
+        error("gorilla: error while syncing file %s: %s", tmp_filename,
+              strerror(errno));
+
+    times[0] = st->st_atim;
+    times[1] = st->st_mtim;
+    futimens(tmp_fd, times);
+    if (fstat(tmp_fd, &tmp_st))
+        tmp_st.st_ino = 0;
+    close(tmp_fd);
+
+    if (rename(tmp_filename, filename)) {
+        error("gorilla: error while renaming file %s: %s", tmp_filename,
+              strerror(errno));
+        unlink(tmp_filename);
+        goto end;
+    }
+
+    if (metric->gor_cache == NULL)
+        metric->gor_cache = malloc(sizeof(struct gorilla_cache_s));
+    metric->gor_cache->inode = tmp_st.st_ino;
+    metric->gor_cache->compacted_size = buf.len;
+    metric->gor_cache->full_size = buf.len;
+    metric->gor_cache->full_time = time(NULL);
+
+    debug("gorilla: compacted %s from %lld to %zu bytes", filename,
+          (long long) st->st_size, buf.len);
+    ret = EXIT_SUCCESS;
+
+    end:
+        for (level = 0; level < nb_levels; level++)
+            free(levels[level]);
+        free(levels);
+        free(nb_level_points);
+        free(buf.data);
+
+        return ret;
+
+}
+
+/*
+ * Append to the file of metric, opened on fd with status st, the slots of the
+ * lower levels covering the points appended since its last compaction. The
+ * source points of these slots are read again in the whole file, the new
+ * slots win over the existing ones as they come last. Returns 1 on error.
+ */
+static int gorilla_compact_tail(metric_t *metric, int fd, const char *filename,
+                                const struct stat *st,
+                                const pattern_aggregation_t *agg,
+                                const uint32_t *steps, const uint32_t *oldest,
+                                uint32_t nb_levels) {
+
+    gorilla_point_t *points = NULL, *slots = NULL;
+    uint32_t nb_points = 0, nb_slots = 0, first = UINT32_MAX, last = 0,
+             from = 0, until = 0, seq = 0, level = 0, i = 0, nb_kept = 0;
+    gorilla_buf_t buf;
+    struct timespec times[2];
+    int ret = EXIT_SUCCESS;
+
+    points = gorilla_read_level(fd, filename, metric->gor_cache->compacted_size,
+                                0, 0, UINT32_MAX, &nb_points);
+    for (i = 0; i < nb_points; i++) {
+        points[i].timestamp -= points[i].timestamp % steps[0];
+        if (points[i].timestamp < first)
+            first = points[i].timestamp;
+        if (points[i].timestamp > last)
+            last = points[i].timestamp;
+    }
+    free(points);
+    points = NULL;
+
+    memset(&buf, 0, sizeof(buf));
+
+    for (level = 0; agg && nb_points && level + 1 < nb_levels; level++) {
+
+        if (steps[level+1] % steps[level])
+            break;
+
+        /* points of the lower slots covering the new points of level */
+        from = gorilla_slot(first, steps[level+1]) - steps[level+1]
+               + steps[level];
+        until = gorilla_slot(last, steps[level+1]);
+
+        points = gorilla_read_level(fd, filename, 0, level, from, until,
+                                    &nb_points);
+        for (i = 0, nb_kept = 0, seq = 0; i < nb_points; i++) {
+            points[i].timestamp -= points[i].timestamp % steps[level];
+            if (points[i].timestamp < from || points[i].timestamp > until)
+                continue;
+            if (points[i].seq >= seq)
+                seq = points[i].seq + 1;
+            points[nb_kept++] = points[i];
+        }
+
+        /* slots of level computed by this compaction are not in file yet */
+        points = realloc(points, (nb_kept + nb_slots + 1)
+                                 * sizeof(gorilla_point_t));
+        for (i = 0; i < nb_slots; i++) {
+            points[nb_kept] = slots[i];
+            points[nb_kept++].seq = seq++;
+        }
+        nb_points = gorilla_merge_points(points, nb_kept);
+
+        nb_slots = gorilla_rollup(agg, points, nb_points, steps[level],
+                                  oldest[level], &slots, 0, steps[level+1]);
+        free(points);
+        points = NULL;
+
+        for (i = 0, nb_kept = 0; i < nb_slots; i++)
+            if (slots[i].timestamp >= oldest[level+1])
+                slots[nb_kept++] = slots[i];
+        nb_slots = nb_kept;
+        if (nb_slots == 0)
+            break;
+
+        gorilla_encode_level(&buf, level + 1, steps[level+1], slots, nb_slots);
+
+        first = gorilla_slot(first, steps[level+1]);
+        last = gorilla_slot(last, steps[level+1]);
+    }
+
+    free(slots);
+
+    if (buf.len) {
+        if (gorilla_write_buf(fd, &buf)) {
+            error("gorilla: error while writing file %s: %s", filename,
+                  strerror(errno));
+            /* a partial block would hide the next ones */
+            if (ftruncate(fd, st->st_size))
+                error("gorilla: error while truncating file %s: %s", filename,
+                      strerror(errno));
+            ret = EXIT_FAILURE;
+            goto end;
+        }
+
+        if (conf->durability != DURABILITY_NONE && fdatasync(fd))
+            error("gorilla: error while syncing file %s: %s", filename,
+                  strerror(errno));
+
+        times[0] = st->st_atim;
+        times[1] = st->st_mtim;
+        futimens(fd, times);
+    }
+
+    debug("gorilla: compacted %lld new bytes of %s in %zu bytes",
+          (long long) (st->st_size - metric->gor_cache->compacted_size),
+          filename, buf.len);
+
+    metric->gor_cache->compacted_size = st->st_size + buf.len;
+
+    end:
+        free(buf.data);
+
+        return ret;
+
+}
+
+/*
+ * Compact the file of metric. The slots of the lower levels covering the
+ * points appended since last compaction are appended to the file. The file is
+ * entirely rewritten on its first compaction, when it has grown twice as big
+ * as after the last rewrite or when the first level has filled a time chunk
+ * since, to merge its blocks and drop the points out of retention. The
+ * modification time of the file is kept so that the compactor only considers
+ * it again after new points are appended. The metric must be locked by the
+ * caller. Returns 1 on error.
+ */
+int gorilla_compact(metric_t *metric) {
+
+    retention_t *retention = whisper_find_retention(metric), *cur_ret = NULL;
+    pattern_aggregation_t *agg = whisper_find_aggregation(metric);
+    struct gorilla_cache_s *cache = metric->gor_cache;
+    uint32_t *steps = NULL, *oldest = NULL;
+    uint32_t now = (uint32_t) time(NULL), nb_levels = 0, level = 0;
+    struct stat st;
+    char *filename = NULL;
+    int fd = -1, ret = EXIT_FAILURE;
+
+    if (retention == NULL)
+        return EXIT_FAILURE;
+
+    filename = whisper_metric_filename(metric->name, GORILLA_EXTENSION);
+
+    fd = open(filename, O_RDWR | O_APPEND);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            error("gorilla: error while opening file %s: %s", filename,
+                  strerror(errno));
+        } else
+            ret = EXIT_SUCCESS;
+        free(filename);
+        return ret;
+    }
+
+    if (fstat(fd, &st)) {
+        error("gorilla: error while getting status of file %s: %s", filename,
+              strerror(errno));
+        close(fd);
+        free(filename);
+        return EXIT_FAILURE;
+    }
+
+    for (cur_ret = retention; cur_ret; cur_ret = cur_ret->next)
+        nb_levels++;
+
+    steps = calloc(nb_levels, sizeof(uint32_t));
+    oldest = calloc(nb_levels, sizeof(uint32_t));
+
+    for (cur_ret = retention, level = 0; cur_ret; cur_ret = cur_ret->next, level++) {
+        steps[level] = cur_ret->time_per_point;
+        oldest[level] = now > cur_ret->time_to_store
+                        ? now - cur_ret->time_to_store + 1 : 0;
+    }
+
+    if (cache == NULL || cache->inode != st.st_ino
+        || st.st_size < cache->compacted_size
+        || st.st_size > 2 * cache->full_size
+        || now - cache->full_time
+           >= (time_t) steps[0] * GORILLA_CHUNK_POINTS)
+        ret = gorilla_compact_full(metric, fd, filename, &st, agg, steps,
+                                   oldest, nb_levels);
+    else if (st.st_size > cache->compacted_size)
+        ret = gorilla_compact_tail(metric, fd, filename, &st, agg, steps,
+                                   oldest, nb_levels);
+    else
+        ret = EXIT_SUCCESS;
+
+    close(fd);
+    free(steps);
+    free(oldest);
+    free(filename);
+
+    return ret;
+
+}
+
+static int gorilla_cmp_filenames(const void *a, const void *b) {
+
+    return strcmp(*(char * const *) a, *(char * const *) b);
+
+}
+
+/*
+ * Syncs the data of the files appended since last call in batched durability
+ * mode, once each. Returns the number of synced files.
+ */
+uint32_t gorilla_sync_files() {
+
+    char **filenames = NULL;
+    uint32_t nb_filenames = 0, nb_synced = 0, i = 0;
+    int fd = -1;
+
+    /* taken first not to miss a file appended during sync */
+    pthread_mutex_lock(&gorilla_dirty.lock);
+    filenames = gorilla_dirty.filenames;
+    nb_filenames = gorilla_dirty.nb_filenames;
+    gorilla_dirty.filenames = NULL;
+    gorilla_dirty.nb_filenames = gorilla_dirty.size = 0;
+    pthread_mutex_unlock(&gorilla_dirty.lock);
+
+    if (nb_filenames == 0)
+        return 0;
+
+    qsort(filenames, nb_filenames, sizeof(char *), gorilla_cmp_filenames);
+
+    for (i = 0; i < nb_filenames; i++) {
+        if (i > 0 && strcmp(filenames[i], filenames[i-1]) == 0)
+            continue;
+        fd = open(filenames[i], O_RDONLY);
+        if (fd < 0 || fdatasync(fd))
+            error("gorilla: error while syncing file %s: %s", filenames[i],
+                  strerror(errno));
+        else
+            nb_synced++;
+        if (fd >= 0)
+            close(fd);
+    }
+
+    for (i = 0; i < nb_filenames; i++)
+        free(filenames[i]);
+    free(filenames);
+
+    return nb_synced;
+
+}
+
+/*
+ * Files are opened for each write, none is kept open. The files appended
+ * since last sync are synced.
+ */
+void gorilla_close_files() {
+
+    gorilla_sync_files();
+
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef CARBON_GORILLA_H
+#define CARBON_GORILLA_H
+
+#include <stdint.h>
+
+#include "common.h"
+#include "whisper.h" // whisper_series_t type
+
+#define GORILLA_EXTENSION ".gor"
+
+int gorilla_write_points(metric_t *, const uint32_t *, const double *, uint32_t);
+whisper_series_t * gorilla_fetch(const char *, uint32_t, uint32_t);
+int gorilla_compact(metric_t *);
+uint32_t gorilla_sync_files();
+void gorilla_close_files();
+
+#endif
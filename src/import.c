@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * carbond-import writes historical points directly in the whisper files of
+ * their metrics, without going through the cache of carbond. Points are read
+ * in plaintext protocol from files or standard input and imported metric by
+ * metric, each run of consecutive lines of the same metric at once, see
+ * whisper_import_points(). carbond must be stopped meanwhile: the storage
+ * roots are locked, see whisper_lock_roots().
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h> /* PRIu32 */
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <limits.h> /* PATH_MAX */
+#include <time.h>
+
+#include "common.h"
+#include "conf.h"
+#include "whisper.h"
+#include "aggregation.h"
+#include "codec.h"
+#include "log.h"
+
+/*
+ * Global variables used by whisper functions
+ */
+carbon_conf_t *conf = NULL;
+monitoring_metrics_t *monitoring = NULL;
+
+struct import_point_s {
+    uint32_t timestamp;
+    uint32_t order; /* position in input, the last point of a slot wins */
+    double value;
+};
+
+typedef struct import_point_s import_point_t;
+
+/* points of the metric being read */
+struct import_state_s {
+    char metric_name[METRIC_NAME_MAX_LEN];
+    uint32_t *timestamps;
+    double *values;
+    uint32_t nb_points;
+    uint32_t size_points;
+    bool overwrite;
+    uint32_t nb_batches; /* runs of points of the same metric imported */
+    uint64_t nb_imported;
+    uint64_t nb_dropped;
+    uint32_t nb_errors;
+};
+
+typedef struct import_state_s import_state_t;
+
+static void print_usage() {
+
+    printf("usage: carbond-import [-h] [-d] [-c CONF] [-o] [FILE]...\n"
+           "-h, --help          Print this help\n"
+           "-d, --debug         Debug mode\n"
+           "-c, --conf CONF     Specify an alternative configuration file\n"
+           "                      (default: %%sysconfdir/carbon/carbon.conf)\n"
+           "-o, --overwrite     Replace the points already in files\n"
+           "                      (default: only fill unknown slots)\n"
+           "Points are read in plaintext protocol from FILEs, or standard\n"
+           "input if none, grouped by metric and sorted by timestamp.\n\n");
+
+}
+
+static int compare_import_points(const void *a, const void *b) {
+
+    const import_point_t *pa = (const import_point_t *) a,
+                         *pb = (const import_point_t *) b;
+
+    if (pa->timestamp != pb->timestamp)
+        return (pa->timestamp > pb->timestamp) - (pa->timestamp < pb->timestamp);
+
+    return (pa->order > pb->order) - (pa->order < pb->order);
+
+}
+
+/*
+ * Sorts the points of state by timestamp, keeping the input order of the
+ * points with the same timestamp.
+ */
+static void import_sort_points(import_state_t *state) {
+
+    import_point_t *points = malloc(state->nb_points * sizeof(import_point_t));
+    uint32_t i = 0;
+
+    for (i = 0; i < state->nb_points; i++) {
+        points[i].timestamp = state->timestamps[i];
+        points[i].order = i;
+        points[i].value = state->values[i];
+    }
+
+    qsort(points, state->nb_points, sizeof(import_point_t),
+          compare_import_points);
+
+    for (i = 0; i < state->nb_points; i++) {
+        state->timestamps[i] = points[i].timestamp;
+        state->values[i] = points[i].value;
+    }
+
+    free(points);
+
+}
+
+/*
+ * Imports the points read for the current metric of state, if any.
+ */
+static void import_flush(import_state_t *state) {
+
+    metric_t metric;
+    uint32_t i = 0;
+    int nb_imported = 0;
+
+    if (state->nb_points == 0)
+        return;
+
+    for (i = 1; i < state->nb_points; i++)
+        if (state->timestamps[i] < state->timestamps[i - 1]) {
+            debug("points of %s not sorted", state->metric_name);
+            import_sort_points(state);
+            break;
+        }
+
+    memset(&metric, 0, sizeof(metric_t));
+    metric.name = state->metric_name;
+    metric.storage_root = whisper_metric_root(state->metric_name);
+    pthread_mutex_init(&(metric.lock), NULL);
+
+    nb_imported = whisper_import_points(&metric, state->timestamps,
+                                        state->values, state->nb_points,
+                                        state->overwrite);
+
+    if (nb_imported < 0) {
+        error("unable to import %" PRIu32 " points of %s", state->nb_points,
+              state->metric_name);
+        state->nb_errors++;
+    } else {
+        debug("imported %d points of %s", nb_imported, state->metric_name);
+        state->nb_batches++;
+        state->nb_imported += nb_imported;
+        state->nb_dropped += state->nb_points - nb_imported;
+    }
+
+    whisper_cache_free(metric.wsp_cache);
+    pthread_mutex_destroy(&(metric.lock));
+    state->nb_points = 0;
+
+}
+
+/*
+ * Reads the points of stream in state, importing the points of a metric as
+ * soon as a line of another metric is read.
+ */
+static void import_stream(import_state_t *state, FILE *stream,
+                          const char *input) {
+
+    char line[METRIC_NAME_MAX_LEN + 64];
+    char metric_name[METRIC_NAME_MAX_LEN];
+    double value = 0.0;
+    uint32_t timestamp = 0, nb_line = 0;
+
+    while (fgets(line, sizeof(line), stream)) {
+
+        nb_line++;
+
+        if (sscanf(line, "%99s %lf %u", metric_name, &value, &timestamp) != 3) {
+            error("invalid line %" PRIu32 " in %s", nb_line, input);
+            state->nb_errors++;
+            continue;
+        }
+
+        if (strcmp(metric_name, state->metric_name)) {
+            import_flush(state);
+            strcpy(state->metric_name, metric_name);
+        }
+
+        if (state->nb_points == state->size_points) {
+            state->size_points = state->size_points
+                                 ? state->size_points * 2 : 4096;
+            state->timestamps = realloc(state->timestamps,
+                                        state->size_points * sizeof(uint32_t));
+            state->values = realloc(state->values,
+                                    state->size_points * sizeof(double));
+        }
+
+        state->timestamps[state->nb_points] = timestamp;
+        state->values[state->nb_points] = value;
+        state->nb_points++;
+    }
+
+}
+
+int main(int argc, char **argv) {
+
+    const char *opt_string = "hdc:o";
+    const struct option long_opts[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "debug", no_argument, NULL, 'd' },
+        { "conf", required_argument, NULL, 'c' },
+        { "overwrite", no_argument, NULL, 'o' },
+        { NULL, no_argument, NULL, 0 }
+    };
+    import_state_t state;
+    FILE *stream = NULL;
+    struct timespec start, end;
+    int opt = 0, i = 0;
+
+    conf = calloc(1, sizeof(carbon_conf_t));
+    monitoring = calloc(1, sizeof(monitoring_metrics_t));
+    memset(&state, 0, sizeof(import_state_t));
+
+    conf_set_defaults(conf);
+
+    while ((opt = getopt_long(argc, argv, opt_string, long_opts, NULL)) != -1) {
+
+        switch(opt) {
+
+            case 'h':
+                print_usage();
+                return EXIT_SUCCESS;
+            case 'd':
+                conf->tracing = true;
+                conf->log_level = LOG_LEVEL_DEBUG;
+                break;
+            case 'c':
+                snprintf(conf->conf_file, PATH_MAX, "%s", optarg);
+                break;
+            case 'o':
+                state.overwrite = true;
+                break;
+            default:
+                print_usage();
+                return EXIT_FAILURE;
+
+        }
+    }
+
+    if (conf_parse(conf))
+        return EXIT_FAILURE;
+
+    /* each file is written once, nothing to keep open */
+    conf->open_files_cache = 0;
+    conf->open_dirs_cache = 0;
+
+    pthread_mutex_init(&(monitoring->mutex_points), NULL);
+    aggregation_init();
+    codec_init();
+
+    /* refuse to write files that a running carbond keeps cached */
+    if (whisper_lock_roots() || whisper_layout_init())
+        return EXIT_FAILURE;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (optind == argc)
+        import_stream(&state, stdin, "standard input");
+
+    for (i = optind; i < argc; i++) {
+        stream = fopen(argv[i], "r");
+        if (stream == NULL) {
+            error("unable to open %s: %s", argv[i], strerror(errno));
+            state.nb_errors++;
+            continue;
+        }
+        import_stream(&state, stream, argv[i]);
+        fclose(stream);
+    }
+
+    import_flush(&state);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    info("%" PRIu64 " points imported in %u batches, %" PRIu64 " dropped out "
+         "of retention, %u errors in %.3fs", state.nb_imported,
+         state.nb_batches, state.nb_dropped, state.nb_errors,
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    free(state.timestamps);
+    free(state.values);
+
+    return state.nb_errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+}
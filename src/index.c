@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * In-memory index of metric names: a trie of the components of the dotted
+ * names, fed with the metrics added in cache and with the metrics found in
+ * storage directory at startup. Glob patterns are resolved component by
+ * component so that only the matching branches are visited.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <limits.h> /* PATH_MAX */
+
+#include "index.h"
+#include "metric_glob.h"
+#include "common.h"
+#include "log.h"
+#include "whisper.h"
+#include "storage.h"
+
+#define INDEX_MAX_COMPONENTS 64
+
+static index_node_t *root = NULL;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static index_node_t * index_new_node(const char *name, size_t len) {
+
+    index_node_t *node = calloc(1, sizeof(index_node_t) + len + 1);
+
+    memcpy(node->name, name, len);
+    node->name[len] = '\0';
+
+    return node;
+
+}
+
+/*
+ * Returns the position of the child named name in node children, or the
+ * position where it should be inserted if not found.
+ */
+static uint32_t index_child_position(const index_node_t *node,
+                                     const char *name, size_t len,
+                                     bool *found) {
+
+    uint32_t low = 0, high = node->nb_children, mid = 0;
+    int cmp = 0;
+
+    *found = false;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        cmp = strncmp(node->children[mid]->name, name, len);
+        if (cmp == 0 && node->children[mid]->name[len] != '\0')
+            cmp = 1; /* child name is longer */
+        if (cmp == 0) {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+
+}
+
+static index_node_t * index_get_child(index_node_t *node, const char *name,
+                                      size_t len) {
+
+    bool found = false;
+    uint32_t pos = index_child_position(node, name, len, &found);
+
+    if (found)
+        return node->children[pos];
+
+    if (node->nb_children == node->size_children) {
+        node->size_children = node->size_children ? node->size_children * 2 : 4;
+        node->children = realloc(node->children,
+                                 node->size_children * sizeof(index_node_t *));
+    }
+
+    memmove(node->children + pos + 1, node->children + pos,
+            (node->nb_children - pos) * sizeof(index_node_t *));
+    node->children[pos] = index_new_node(name, len);
+    node->nb_children++;
+
+    return node->children[pos];
+
+}
+
+void index_init() {
+
+    root = index_new_node("", 0);
+
+}
+
+/*
+ * Adds the metric name in index, if not already there.
+ */
+void index_add(const char *metric_name) {
+
+    index_node_t *node = NULL;
+    const char *start = metric_name, *end = NULL;
+
+    if (root == NULL)
+        return;
+
+    pthread_rwlock_wrlock(&index_lock);
+
+    node = root;
+    while (*start) {
+        end = strchr(start, '.');
+        if (end == NULL)
+            end = start + strlen(start);
+        if (end > start)
+            node = index_get_child(node, start, end - start);
+        start = *end ? end + 1 : end;
+    }
+
+    if (node != root)
+        node->is_leaf = true;
+
+    pthread_rwlock_unlock(&index_lock);
+
+}
+
+static void index_find_node(index_node_t *node, char **components,
+                            int depth, int nb_components,
+                            char *path, size_t path_len,
+                            index_find_cb_t callback, void *data) {
+
+    index_node_t *child = NULL;
+    const char *component = components[depth];
+    uint32_t i = 0, first = 0, last = node->nb_children;
+    size_t name_len = 0;
+    bool found = false, literal = !glob_is_pattern(component);
+
+    /* literal component: only one child can match */
+    if (literal) {
+        first = index_child_position(node, component, strlen(component),
+                                     &found);
+        if (!found)
+            return;
+        last = first + 1;
+    }
+
+    for (i = first; i < last; i++) {
+
+        child = node->children[i];
+
+        if (!literal && !glob_match(component, child->name))
+            continue;
+
+        name_len = strlen(child->name);
+        if (path_len + name_len + 2 > METRIC_NAME_MAX_LEN)
+            continue;
+
+        if (path_len)
+            path[path_len] = '.';
+        memcpy(path + path_len + (path_len ? 1 : 0), child->name,
+               name_len + 1);
+
+        if (depth == nb_components - 1) {
+            callback(path, child->is_leaf && child->nb_children == 0, data);
+            if (child->is_leaf && child->nb_children)
+                callback(path, true, data);
+        } else
+            index_find_node(child, components, depth + 1, nb_components,
+                            path, path_len + name_len + (path_len ? 1 : 0),
+                            callback, data);
+
+        path[path_len] = '\0';
+    }
+
+}
+
+/*
+ * Calls callback for each node matching the glob pattern, with the path of
+ * the node and whether it is a metric (leaf) or a branch. Nodes are visited
+ * in order of their components.
+ */
+void index_find(const char *pattern, index_find_cb_t callback, void *data) {
+
+    char *pattern_cpy = NULL;
+    char *components[INDEX_MAX_COMPONENTS];
+    char path[METRIC_NAME_MAX_LEN];
+    char *saveptr = NULL, *component = NULL;
+    int nb_components = 0;
+
+    if (root == NULL)
+        return;
+
+    pattern_cpy = strdup(pattern);
+
+    for (component = strtok_r(pattern_cpy, ".", &saveptr);
+         component && nb_components < INDEX_MAX_COMPONENTS;
+         component = strtok_r(NULL, ".", &saveptr))
+        components[nb_components++] = component;
+
+    if (nb_components && component == NULL) {
+        path[0] = '\0';
+        pthread_rwlock_rdlock(&index_lock);
+        index_find_node(root, components, 0, nb_components, path, 0,
+                        callback, data);
+        pthread_rwlock_unlock(&index_lock);
+    }
+
+    free(pattern_cpy);
+
+}
+
+/*
+ * Adds in index the metric of a file found in storage roots, counted in data.
+ */
+static void index_scan_file(const char *path, const char *metric_name,
+                            void *data) {
+
+    index_add(metric_name);
+    (*(uint32_t *) data)++;
+
+}
+
+/*
+ * Adds in index all the metrics found in storage roots. Returns the number of
+ * metrics found.
+ */
+uint32_t index_scan_storage() {
+
+    char dir[PATH_MAX];
+    char prefix[METRIC_NAME_MAX_LEN];
+    uint32_t root = 0, nb_metrics = 0;
+
+    for (root = 0; root < whisper_nb_roots(); root++) {
+
+        if (strlen(whisper_root_dir(root)) >= PATH_MAX)
+            continue;
+
+        strcpy(dir, whisper_root_dir(root));
+        prefix[0] = '\0';
+
+        whisper_scan_dir(dir, prefix, storage->extension, index_scan_file,
+                         &nb_metrics);
+    }
+
+    return nb_metrics;
+
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef CARBON_INDEX_H
+#define CARBON_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Node of the metric name index, one per component of dotted metric names.
+ * Children are sorted by name.
+ */
+struct index_node_s {
+    struct index_node_s **children;
+    uint32_t nb_children;
+    uint32_t size_children;
+    bool is_leaf; /* a metric ends on this node */
+    char name[];
+};
+
+typedef struct index_node_s index_node_t;
+
+typedef void (*index_find_cb_t)(const char *, bool, void *);
+
+void index_init();
+void index_add(const char *);
+void index_find(const char *, index_find_cb_t, void *);
+uint32_t index_scan_storage();
+
+#endif
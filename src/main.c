@@ -30,7 +30,20 @@
 #include "receiver_udp.h"
 #include "receiver_tcp.h"
 #include "writer.h"
+#include "propagator.h"
+#include "compactor.h"
+#include "storage.h"
+#include "cache_query.h"
+#include "query_server.h"
+#include "index.h"
+#include "scan.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "spill.h"
 #include "monitoring.h"
+#include "aggregation.h"
+#include "codec.h"
+#include "crc32.h"
 
 /*
  * Initialize global runtime configuration variable
@@ -60,42 +73,40 @@ void print_usage() {
 }
 
 /*
- * Set default configuration in conf global variable
+ * Copy the list of storage roots of orig_conf to dest_conf.
  */
-void default_conf() {
-
-    const char * sysconfdir = SYSCONFDIR;
-    const char * localstatedir = LOCALSTATEDIR;
-    const char * default_conf_filename = "/carbon.conf";
+static void conf_copy_storage_dirs(carbon_conf_t *orig_conf,
+                                   carbon_conf_t *dest_conf) {
+
+    uint32_t i = 0;
+
+    dest_conf->nb_storage_dirs = orig_conf->nb_storage_dirs;
+    dest_conf->storage_dirs = calloc(orig_conf->nb_storage_dirs + 1, sizeof(char *));
+    for (i = 0; i < orig_conf->nb_storage_dirs; i++) {
+        dest_conf->storage_dirs[i] = malloc(sizeof(char)*PATH_MAX);
+        memset(dest_conf->storage_dirs[i], 0, sizeof(char)*PATH_MAX);
+        strncpy(dest_conf->storage_dirs[i], orig_conf->storage_dirs[i],
+                PATH_MAX - 1);
+    }
 
-    conf->run = true;
+}
 
-    /* log level */
-    conf->tracing = false;
-    conf->log_level = LOG_LEVEL_INFO;
+/*
+ * Returns true if both confs have the same list of storage roots.
+ */
+static bool conf_same_storage_dirs(carbon_conf_t *a, carbon_conf_t *b) {
 
-    /* config directory path */
-    conf->conf_dir = malloc(sizeof(char)*PATH_MAX);
-    memset(conf->conf_dir, 0, sizeof(char)*PATH_MAX);
-    strncpy(conf->conf_dir, sysconfdir, strlen(sysconfdir));
+    uint32_t i = 0;
 
-    /* config file path */
-    conf->conf_file = malloc(sizeof(char)*PATH_MAX);
-    memset(conf->conf_file, 0, sizeof(char)*PATH_MAX);
-    strncpy(conf->conf_file, sysconfdir, strlen(sysconfdir));
-    strncat(conf->conf_file, default_conf_filename, strlen(default_conf_filename));
+    if (a->nb_storage_dirs != b->nb_storage_dirs)
+        return false;
 
-    /* storage directory path */
-    conf->storage_dir = malloc(sizeof(char)*PATH_MAX);
-    memset(conf->storage_dir, 0, sizeof(char)*PATH_MAX);
-    strncpy(conf->storage_dir, localstatedir, strlen(localstatedir));
+    for (i = 0; i < a->nb_storage_dirs; i++)
+        if (strcmp(a->storage_dirs[i], b->storage_dirs[i]))
+            return false;
 
-    /* default listened TCP/UDP ports */
-    conf->line_receiver_port = 2003;
-    conf->udp_receiver_port = 2003;
+    return true;
 
-    conf->schema = NULL;
-    conf->aggregation = NULL;
 }
 
 /*
@@ -126,6 +137,13 @@ void conf_copy(carbon_conf_t *orig_conf, carbon_conf_t *dest_conf) {
     memset(dest_conf->storage_dir, 0, sizeof(char)*PATH_MAX);
     strncpy(dest_conf->storage_dir, orig_conf->storage_dir, strlen(orig_conf->storage_dir));
 
+    dest_conf->memory_pressure_file = malloc(sizeof(char)*PATH_MAX);
+    memset(dest_conf->memory_pressure_file, 0, sizeof(char)*PATH_MAX);
+    strncpy(dest_conf->memory_pressure_file, orig_conf->memory_pressure_file,
+            PATH_MAX - 1);
+
+    conf_copy_storage_dirs(orig_conf, dest_conf);
+
 }
 
 /*
@@ -143,6 +161,8 @@ void conf_free(carbon_conf_t *c) {
     free(c->conf_dir);
     free(c->conf_file);
     free(c->storage_dir);
+    free(c->memory_pressure_file);
+    conf_free_storage_dirs(c);
 
     pret = c->schema;
 
@@ -186,14 +206,49 @@ void conf_free(carbon_conf_t *c) {
  */
 void print_conf() {
 
+    uint32_t i = 0;
+
     debug("runtime configuration:");
     debug("  conf_dir: %s", conf->conf_dir);
     debug("  conf_file: %s", conf->conf_file);
     debug("  storage_dir: %s", conf->storage_dir);
+    for (i = 0; i < conf->nb_storage_dirs; i++)
+        debug("  storage_dirs[%u]: %s", i, conf->storage_dirs[i]);
+    debug("  storage_fanout: %u", conf->storage_fanout);
+    debug("  storage_engine: %d", conf->storage_engine);
+    debug("  compaction_interval: %u", conf->compaction_interval);
     debug("  tracing: %d", conf->tracing);
     debug("  log_level: %d", conf->log_level);
     debug("  line_receiver_port: %d", conf->line_receiver_port);
     debug("  udp_receiver_port: %d", conf->udp_receiver_port);
+    debug("  cache_query_port: %d", conf->cache_query_port);
+    debug("  query_server_port: %d", conf->query_server_port);
+    debug("  query_server_threads: %d", conf->query_server_threads);
+    debug("  startup_scan: %d", conf->startup_scan);
+    debug("  startup_scan_threads: %d", conf->startup_scan_threads);
+    debug("  wal_enabled: %d", conf->wal_enabled);
+    debug("  wal_segment_size: %u MB", conf->wal_segment_size);
+    debug("  cache_snapshot: %d", conf->cache_snapshot);
+    debug("  shutdown_drain: %d", conf->shutdown_drain);
+    debug("  shutdown_drain_threads: %d", conf->shutdown_drain_threads);
+    debug("  shutdown_drain_timeout: %u", conf->shutdown_drain_timeout);
+    debug("  rollup_accumulators: %d", conf->rollup_accumulators);
+    debug("  propagation_deferred: %d", conf->propagation_deferred);
+    debug("  propagation_max_lag: %u", conf->propagation_max_lag);
+    debug("  cache_spill: %d", conf->cache_spill);
+    debug("  cache_spill_threshold: %lu", (unsigned long) conf->cache_spill_threshold);
+    debug("  cache_spill_shards: %u", conf->cache_spill_shards);
+    debug("  memory_pressure: %d", conf->memory_pressure);
+    debug("  memory_pressure_file: %s", conf->memory_pressure_file);
+    debug("  memory_pressure_threshold: %.2f", conf->memory_pressure_threshold);
+    debug("  max_cache_points: %lu", (unsigned long) conf->max_cache_points);
+    debug("  metric_idle_timeout: %u", conf->metric_idle_timeout);
+    debug("  write_order: %d", conf->write_order);
+    debug("  write_window: %u", conf->write_window);
+    debug("  open_files_cache: %u", conf->open_files_cache);
+    debug("  open_dirs_cache: %u", conf->open_dirs_cache);
+    debug("  durability: %d", conf->durability);
+    debug("  durability_interval: %u", conf->durability_interval);
 
 }
 
@@ -271,6 +326,16 @@ void conf_reload() {
     if (parse_status)
         error("parsing new configuration failed");
     else {
+        /* metrics and writers are bound to their storage root */
+        if (!conf_same_storage_dirs(conf, new_conf)) {
+            error("STORAGE_DIRS cannot change without restart, ignored");
+            conf_free_storage_dirs(new_conf);
+            conf_copy_storage_dirs(conf, new_conf);
+        }
+        if (new_conf->storage_engine != conf->storage_engine) {
+            error("STORAGE_ENGINE cannot change without restart, ignored");
+            new_conf->storage_engine = conf->storage_engine;
+        }
         threads_pause_all();
         conf_free(conf);
         conf = new_conf;
@@ -291,12 +356,12 @@ void sighup_handler(int signb) {
 }
 
 /*
- * SIGINT signal handler.
+ * SIGINT and SIGTERM signal handler.
  * Basically set conf->run boolean to false in order to stop threads loops.
  */
 void sigint_handler(int signb) {
 
-    debug("received SIGINT, stopping all threads");
+    debug("received signal %d, stopping all threads", signb);
     conf->run = false;
 
 }
@@ -305,6 +370,7 @@ int main(int argc, char *argv[]) {
 
     struct sigaction sa_int, sa_hup;
     int status = 0;
+    uint32_t nb_failed = 0;
 
     /*
      * Runtime configuration management
@@ -316,7 +382,7 @@ int main(int argc, char *argv[]) {
     monitoring = calloc(1, sizeof(monitoring_metrics_t));
 
     /* load default runtime configuration */
-    default_conf();
+    conf_set_defaults(conf);
 
     parse_args(argc, argv);
 
@@ -329,9 +395,47 @@ int main(int argc, char *argv[]) {
     print_conf();
     print_storage_schema();
 
+    /* appended gorilla files are synced by name, none is kept open */
+    if (conf->durability == DURABILITY_BATCHED && !conf->open_files_cache
+        && conf->storage_engine == STORAGE_ENGINE_WHISPER) {
+        error("DURABILITY batched requires OPEN_FILES_CACHE");
+        return EXIT_FAILURE;
+    }
+
     check_whisper_sizes();
+    aggregation_init();
+    codec_init();
+    crc32_init();
 
     database_init();
+    storage_init();
+
+    /* before anything is read or written in storage roots */
+    if (whisper_lock_roots() || whisper_layout_init())
+        return EXIT_FAILURE;
+
+    /* metric names index is only used by the query server */
+    if (conf->query_server_port)
+        index_init();
+
+    /* registered metrics are also added in the index */
+    if (conf->startup_scan)
+        scan_storage();
+    else if (conf->query_server_port) {
+        debug("%u metrics indexed from storage directory",
+              index_scan_storage());
+    }
+
+    /* points logged before last stop are back in cache */
+    if (conf->wal_enabled && wal_init())
+        return EXIT_FAILURE;
+
+    /* load snapshot even if disabled since last stop, not to lose points */
+    if (snapshot_load())
+        return EXIT_FAILURE;
+
+    if (conf->cache_spill && spill_init())
+        return EXIT_FAILURE;
 
     /*
      *  signals handling
@@ -339,6 +443,7 @@ int main(int argc, char *argv[]) {
 
     sa_int.sa_handler = &sigint_handler;
     sigaction(SIGINT, &sa_int, NULL);
+    sigaction(SIGTERM, &sa_int, NULL);
     sa_hup.sa_handler = &sighup_handler;
     sigaction(SIGHUP, &sa_hup, NULL);
 
@@ -350,11 +455,51 @@ int main(int argc, char *argv[]) {
     threads->monitoring_thread = launch_monitoring_thread();
     threads->receiver_udp_thread = launch_receiver_udp_thread();
     threads->receiver_tcp_thread = launch_receiver_tcp_thread();
-    threads->writer_thread = launch_writer_thread();
+    threads->writer_threads =
+        launch_writer_threads(&threads->nb_writer_threads);
+    threads->propagator_thread = launch_propagator_thread();
+    if (conf->storage_engine == STORAGE_ENGINE_GORILLA)
+        threads->compactor_thread = launch_compactor_thread();
+    if (conf->cache_spill)
+        threads->spill_thread = launch_spill_thread();
+    if (conf->cache_query_port)
+        threads->cache_query_thread = launch_cache_query_thread();
+    if (conf->query_server_port)
+        threads->query_server_threads =
+            launch_query_server_threads(&threads->nb_query_server_threads);
 
     threads_wait_all_stopped();
     debug("all threads terminated properly");
 
+    /*
+     * Spilled points are drained and saved in snapshot with the others. Else
+     * they are left in spill files, replayed from the log or reloaded at next
+     * start.
+     */
+    if (conf->cache_spill && (conf->shutdown_drain || conf->cache_snapshot))
+        spill_reload_all();
+
+    /* receivers are stopped, flush what can be in the given time */
+    if (conf->shutdown_drain)
+        nb_failed = writer_drain();
+
+    /* writers are stopped, no more slot can be queued for propagation */
+    nb_failed += propagator_flush();
+
+    /* dirty files are synced when closed */
+    writer_sync(true);
+    storage->close_files();
+
+    /*
+     * Points in snapshot do not need the log anymore. The log is kept anyway
+     * if some points could not be written or propagated.
+     */
+    if (conf->cache_snapshot && snapshot_save() == 0 && nb_failed == 0) {
+        if (conf->wal_enabled)
+            wal_remove_all();
+    } else if (conf->wal_enabled)
+        wal_close();
+
     free(conf);
 
     return EXIT_SUCCESS;
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Matching of metric name components against Graphite glob patterns. Patterns
+ * apply to one component of the dotted name at a time and support wildcards
+ * (*, ?), character classes ([0-9]) and alternatives ({a,b}).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "metric_glob.h"
+
+/*
+ * Returns true if str contains any glob special character.
+ */
+bool glob_is_pattern(const char *str) {
+
+    return strpbrk(str, "*?[{") != NULL;
+
+}
+
+/*
+ * Tests if component str matches glob pattern. Alternatives are expanded one
+ * at a time and the remaining pattern is left to fnmatch().
+ */
+bool glob_match(const char *pattern, const char *str) {
+
+    const char *open = strchr(pattern, '{'),
+               *close = NULL,
+               *alt = NULL,
+               *alt_end = NULL;
+    size_t prefix_len = 0, suffix_len = 0;
+    char *expanded = NULL;
+    bool match = false;
+
+    if (open)
+        close = strchr(open, '}');
+
+    if (open == NULL || close == NULL)
+        return fnmatch(pattern, str, 0) == 0;
+
+    prefix_len = open - pattern;
+    suffix_len = strlen(close + 1);
+    expanded = malloc(strlen(pattern) + 1);
+
+    for (alt = open + 1; !match && alt <= close; alt = alt_end + 1) {
+        alt_end = memchr(alt, ',', close - alt);
+        if (alt_end == NULL)
+            alt_end = close;
+        memcpy(expanded, pattern, prefix_len);
+        memcpy(expanded + prefix_len, alt, alt_end - alt);
+        memcpy(expanded + prefix_len + (alt_end - alt), close + 1,
+               suffix_len + 1);
+        match = glob_match(expanded, str);
+    }
+
+    free(expanded);
+
+    return match;
+
+}
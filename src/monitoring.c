@@ -29,6 +29,7 @@
 #include "monitoring.h"
 #include "database.h"
 #include "common.h"
+#include "pressure.h"
 
 /*
  * Add a metric point in global db. It eventually creates the metric in db if
@@ -38,36 +39,129 @@ static void update_monitoring_metric(const char *name,
                                      const uint32_t timestamp,
                                      const double value) {
 
-    metric_t *metric = NULL;
     metric_point_t *point = NULL;
 
-    metric = get_metric(db, name);
-    if(metric == NULL) { /* metric does not exist yet */
-        metric = create_new_metric(name);
-        add_database_metric(db, metric);
-    }
-
     point = create_new_metric_point(timestamp, value);
-    add_database_metric_point(db, metric, point);
+    if (!add_metric_point(db, name, point))
+        free(point);
 
 }
 
 /*
- * Updates all metrics of the monitoring metrics structure, locking them
- * one by one to avoid concurrent updates and to avoid big locks.
+ * Updates all metrics of the monitoring metrics structure. Each group of
+ * counters is copied and reset under its mutex, then the points are added
+ * after releasing it: adding a point may take the database lock, which other
+ * threads hold while updating these counters.
  */
 static void update_monitoring_metrics() {
 
     uint32_t timestamp;
+    uint32_t points = 0, backlog = 0, dropped_points = 0, rejected_old = 0,
+             rejected_future = 0, syncs = 0, synced_files = 0,
+             compacted_files = 0, evicted_metrics = 0, wal_errors = 0,
+             write_errors = 0;
+    int64_t spilled_points = 0;
+    uint64_t cache_limit = 0;
+    double memory_pressure = 0.0, sync_time = 0.0, compaction_time = 0.0;
+    bool under_pressure = false;
 
     // get current timestamp
     timestamp = (uint32_t)time(NULL);
 
     pthread_mutex_lock(&(monitoring->mutex_points));
-    update_monitoring_metric("carbond.points", timestamp, (double)monitoring->points);
+    points = monitoring->points;
     monitoring->points = 0;
     pthread_mutex_unlock(&(monitoring->mutex_points));
 
+    pthread_mutex_lock(&(monitoring->mutex_propagation));
+    backlog = monitoring->propagation_backlog;
+    pthread_mutex_unlock(&(monitoring->mutex_propagation));
+
+    pthread_mutex_lock(&(monitoring->mutex_spill));
+    spilled_points = monitoring->spilled_points;
+    pthread_mutex_unlock(&(monitoring->mutex_spill));
+
+    pressure_update();
+
+    pthread_mutex_lock(&(monitoring->mutex_pressure));
+    memory_pressure = monitoring->memory_pressure;
+    under_pressure = monitoring->under_pressure;
+    cache_limit = monitoring->cache_limit;
+    dropped_points = monitoring->dropped_points;
+    monitoring->dropped_points = 0;
+    pthread_mutex_unlock(&(monitoring->mutex_pressure));
+
+    pthread_mutex_lock(&(monitoring->mutex_rejected));
+    rejected_old = monitoring->rejected_old;
+    rejected_future = monitoring->rejected_future;
+    monitoring->rejected_old = 0;
+    monitoring->rejected_future = 0;
+    pthread_mutex_unlock(&(monitoring->mutex_rejected));
+
+    pthread_mutex_lock(&(monitoring->mutex_sync));
+    syncs = monitoring->syncs;
+    synced_files = monitoring->synced_files;
+    sync_time = monitoring->sync_time;
+    monitoring->syncs = 0;
+    monitoring->synced_files = 0;
+    monitoring->sync_time = 0.0;
+    pthread_mutex_unlock(&(monitoring->mutex_sync));
+
+    pthread_mutex_lock(&(monitoring->mutex_compaction));
+    compacted_files = monitoring->compacted_files;
+    compaction_time = monitoring->compaction_time;
+    monitoring->compacted_files = 0;
+    monitoring->compaction_time = 0.0;
+    pthread_mutex_unlock(&(monitoring->mutex_compaction));
+
+    pthread_mutex_lock(&(monitoring->mutex_eviction));
+    evicted_metrics = monitoring->evicted_metrics;
+    monitoring->evicted_metrics = 0;
+    pthread_mutex_unlock(&(monitoring->mutex_eviction));
+
+    pthread_mutex_lock(&(monitoring->mutex_errors));
+    wal_errors = monitoring->wal_errors;
+    write_errors = monitoring->write_errors;
+    monitoring->wal_errors = 0;
+    monitoring->write_errors = 0;
+    pthread_mutex_unlock(&(monitoring->mutex_errors));
+
+    update_monitoring_metric("carbond.points", timestamp, (double)points);
+    update_monitoring_metric("carbond.propagation.backlog", timestamp,
+                             (double)backlog);
+    update_monitoring_metric("carbond.cache.size", timestamp,
+                             (double)db->nb_points);
+    update_monitoring_metric("carbond.cache.spilled", timestamp,
+                             (double)spilled_points);
+    update_monitoring_metric("carbond.memory.pressure", timestamp,
+                             memory_pressure);
+    update_monitoring_metric("carbond.memory.under_pressure", timestamp,
+                             (double)under_pressure);
+    update_monitoring_metric("carbond.cache.limit", timestamp,
+                             (double)cache_limit);
+    update_monitoring_metric("carbond.cache.dropped", timestamp,
+                             (double)dropped_points);
+    update_monitoring_metric("carbond.points.rejected.old", timestamp,
+                             (double)rejected_old);
+    update_monitoring_metric("carbond.points.rejected.future", timestamp,
+                             (double)rejected_future);
+    update_monitoring_metric("carbond.sync.count", timestamp, (double)syncs);
+    update_monitoring_metric("carbond.sync.files", timestamp,
+                             (double)synced_files);
+    update_monitoring_metric("carbond.sync.time", timestamp, sync_time);
+    update_monitoring_metric("carbond.compaction.files", timestamp,
+                             (double)compacted_files);
+    update_monitoring_metric("carbond.compaction.time", timestamp,
+                             compaction_time);
+    update_monitoring_metric("carbond.metrics.live", timestamp,
+                             (double)db->nb_metrics);
+    update_monitoring_metric("carbond.metrics.evicted", timestamp,
+                             (double)evicted_metrics);
+    update_monitoring_metric("carbond.wal.errors", timestamp,
+                             (double)wal_errors);
+    update_monitoring_metric("carbond.write.errors", timestamp,
+                             (double)write_errors);
+
 }
 
 /*
@@ -94,6 +188,38 @@ void * monitoring_worker(void * arg) {
         error("monitoring mutex_points init failed");
     }
 
+    if (pthread_mutex_init(&(monitoring->mutex_propagation), NULL) != 0) {
+        error("monitoring mutex_propagation init failed");
+    }
+
+    if (pthread_mutex_init(&(monitoring->mutex_spill), NULL) != 0) {
+        error("monitoring mutex_spill init failed");
+    }
+
+    if (pthread_mutex_init(&(monitoring->mutex_pressure), NULL) != 0) {
+        error("monitoring mutex_pressure init failed");
+    }
+
+    if (pthread_mutex_init(&(monitoring->mutex_eviction), NULL) != 0) {
+        error("monitoring mutex_eviction init failed");
+    }
+
+    if (pthread_mutex_init(&(monitoring->mutex_rejected), NULL) != 0) {
+        error("monitoring mutex_rejected init failed");
+    }
+
+    if (pthread_mutex_init(&(monitoring->mutex_sync), NULL) != 0) {
+        error("monitoring mutex_sync init failed");
+    }
+
+    if (pthread_mutex_init(&(monitoring->mutex_compaction), NULL) != 0) {
+        error("monitoring mutex_compaction init failed");
+    }
+
+    if (pthread_mutex_init(&(monitoring->mutex_errors), NULL) != 0) {
+        error("monitoring mutex_errors init failed");
+    }
+
     for (;conf->run;) {
 
         if(thread_must_pause(me)) {
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Memory pressure: the monitoring thread reads the PSI (pressure stall
+ * information) file of the kernel every second, /proc/pressure/memory for the
+ * whole system or memory.pressure of the cgroup of carbond. Once the share of
+ * time some tasks stalled on memory over the last 10 seconds reaches
+ * MEMORY_PRESSURE_THRESHOLD, carbond is under pressure until it falls below
+ * half of this threshold. Under pressure:
+ *
+ *  - the writer flushes all metrics in cache in each pass,
+ *  - spilled points are not reloaded and the cache is spilled earlier,
+ *  - the cache stops growing: received points are dropped above half of
+ *    MAX_CACHE_POINTS, or above the size of cache when pressure was
+ *    detected if there is no such limit.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "pressure.h"
+#include "common.h"
+#include "log.h"
+
+/* seconds between two logs of the same failure to read PSI file */
+#define PRESSURE_ERROR_PERIOD 300
+
+static int pressure_fd = -1;
+static bool pressure_failing = false;
+static time_t pressure_last_error = 0;
+static char pressure_error[PATH_MAX + 128];
+
+/*
+ * Reads PSI file and returns the "some avg10" value in percent, or -1 on
+ * error with the reason in pressure_error. The file is opened again after an
+ * error, it may come back with its cgroup.
+ */
+static double pressure_read() {
+
+    char buf[256];
+    char *avg10 = NULL;
+    ssize_t len = 0;
+
+    if (pressure_fd < 0) {
+        pressure_fd = open(conf->memory_pressure_file, O_RDONLY);
+        if (pressure_fd < 0) {
+            snprintf(pressure_error, sizeof(pressure_error),
+                     "unable to open %s: %s", conf->memory_pressure_file,
+                     strerror(errno));
+            return -1;
+        }
+    }
+
+    len = pread(pressure_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) {
+        snprintf(pressure_error, sizeof(pressure_error),
+                 "unable to read %s: %s", conf->memory_pressure_file,
+                 len < 0 ? strerror(errno) : "empty file");
+        close(pressure_fd);
+        pressure_fd = -1;
+        return -1;
+    }
+    buf[len] = '\0';
+
+    /* some avg10=0.00 avg60=0.00 avg300=0.00 total=0 */
+    if (strncmp(buf, "some ", 5) || (avg10 = strstr(buf, "avg10=")) == NULL) {
+        snprintf(pressure_error, sizeof(pressure_error),
+                 "unexpected content in %s", conf->memory_pressure_file);
+        return -1;
+    }
+
+    return strtod(avg10 + 6, NULL);
+
+}
+
+/*
+ * Updates memory pressure state and ingest limit of cache. Called every
+ * second by the monitoring thread.
+ */
+void pressure_update() {
+
+    double pressure = 0.0;
+    bool under_pressure = monitoring->under_pressure;
+    uint64_t cache_limit = conf->max_cache_points;
+    time_t now = time(NULL);
+
+    if (conf->memory_pressure) {
+        pressure = pressure_read();
+        if (pressure < 0) {
+            /* retried every second, do not flood logs with the same error */
+            if (!pressure_failing
+                || now - pressure_last_error >= PRESSURE_ERROR_PERIOD) {
+                error("memory pressure: %s", pressure_error);
+                pressure_last_error = now;
+            }
+            pressure_failing = true;
+            pressure = 0.0;
+        } else if (pressure_failing) {
+            info("memory pressure: %s read again", conf->memory_pressure_file);
+            pressure_failing = false;
+        }
+    }
+
+    if (!under_pressure && pressure >= conf->memory_pressure_threshold) {
+        under_pressure = true;
+        info("memory pressure: %.2f%% of stalled time, flushing cache with "
+             "%lu points", pressure, (unsigned long) db->nb_points);
+    } else if (under_pressure && pressure < conf->memory_pressure_threshold / 2) {
+        under_pressure = false;
+        info("memory pressure: back to %.2f%% of stalled time", pressure);
+    }
+
+    if (under_pressure) {
+        if (conf->max_cache_points)
+            cache_limit = conf->max_cache_points / 2;
+        else if (monitoring->under_pressure)
+            cache_limit = monitoring->cache_limit; /* keep limit of entry */
+        else
+            cache_limit = db->nb_points;
+    }
+
+    pthread_mutex_lock(&(monitoring->mutex_pressure));
+    monitoring->memory_pressure = pressure;
+    monitoring->under_pressure = under_pressure;
+    monitoring->cache_limit = cache_limit;
+    pthread_mutex_unlock(&(monitoring->mutex_pressure));
+
+}
+
+/*
+ * Returns true if received points must be dropped because the cache reached
+ * its ingest limit. The dropped point is accounted in monitoring metrics.
+ */
+bool cache_is_full() {
+
+    uint64_t cache_limit = monitoring->cache_limit;
+
+    if (cache_limit == 0 || db->nb_points < cache_limit)
+        return false;
+
+    pthread_mutex_lock(&(monitoring->mutex_pressure));
+    monitoring->dropped_points++;
+    pthread_mutex_unlock(&(monitoring->mutex_pressure));
+
+    return true;
+
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h> // sleep()
+#include <stdlib.h>
+#include <string.h> // strerror()
+#include <errno.h>
+#include <time.h>
+
+#include "propagator.h"
+#include "whisper.h"
+#include "wal.h"
+
+/*
+ * Propagate the pending slots of all metrics whose oldest pending slot has
+ * been waiting for at least lag seconds. Waiting lets the slots of the same
+ * file pile up so that they are propagated at once. The points of the metrics
+ * kept in the write-ahead log until then are released. Returns the number of
+ * metrics whose propagation failed.
+ */
+static uint32_t propagate_pending_metrics(uint32_t lag) {
+
+    static metric_t **metrics = NULL;
+    static uint32_t size_metrics = 0;
+    metric_t *cur_m = NULL;
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t backlog = 0, nb_metrics = 0, nb_failed = 0, i = 0;
+    int rc = EXIT_SUCCESS;
+
+    pthread_mutex_lock(&(monitoring->mutex_propagation));
+    backlog = monitoring->propagation_backlog;
+    pthread_mutex_unlock(&(monitoring->mutex_propagation));
+
+    /* avoid scanning the whole DB when there is nothing to do */
+    if (!backlog)
+        return 0;
+
+    /*
+     * The metrics are collected under the database lock and propagated after
+     * releasing it. Metrics with pending slots are never evicted, and only
+     * this thread drains them.
+     */
+    pthread_rwlock_rdlock(&(db->lock));
+
+    for (cur_m = db->first; cur_m; cur_m = cur_m->next) {
+
+        /* unlocked check, it is safe to miss a slot until next pass */
+        if (!cur_m->wsp_cache || !cur_m->wsp_cache->nb_pending
+            || now - cur_m->wsp_cache->pending_since < lag)
+            continue;
+
+        if (nb_metrics == size_metrics) {
+            size_metrics = size_metrics ? size_metrics * 2 : 1024;
+            metrics = realloc(metrics, size_metrics * sizeof(metric_t *));
+        }
+        metrics[nb_metrics++] = cur_m;
+    }
+
+    pthread_rwlock_unlock(&(db->lock));
+
+    for (i = 0; i < nb_metrics; i++) {
+        pthread_mutex_lock(&(metrics[i]->lock));
+        rc = whisper_propagate_pending(metrics[i]);
+        wal_release_held(metrics[i], rc == EXIT_SUCCESS);
+        pthread_mutex_unlock(&(metrics[i]->lock));
+        if (rc != EXIT_SUCCESS)
+            nb_failed++;
+    }
+
+    return nb_failed;
+
+}
+
+/*
+ * Propagate all pending slots without delay. Used on shutdown once the writer
+ * is stopped. Returns the number of metrics whose propagation failed.
+ */
+uint32_t propagator_flush() {
+
+    debug("flushing all pending propagations");
+    return propagate_pending_metrics(0);
+
+}
+
+void * propagator_thread(void * thread_args) {
+
+    struct propagator_thread_args * p_thd_args =
+        (struct propagator_thread_args *) thread_args;
+    carbon_thread_t *me = p_thd_args->thread;
+
+    /*
+     * Blocks signals (SIGINT, SIGTERM, etc) in this thread so that they are all
+     * handled in main thread.
+     */
+    block_signals();
+
+    debug("thread %u is running", p_thd_args->id_thread);
+
+    thread_run_lock(me);
+
+    for(;conf->run;) {
+
+        if(thread_must_pause(me)) {
+            thread_pause_and_wait_run_signal(me);
+        }
+
+        /*
+         * When deferred propagation is disabled (possibly by a configuration
+         * reload), still drain slots queued before without any delay.
+         */
+        if (conf->propagation_deferred)
+            propagate_pending_metrics(conf->propagation_max_lag);
+        else
+            propagate_pending_metrics(0);
+
+        sleep(1);
+    }
+
+    return NULL;
+}
+
+carbon_thread_t *launch_propagator_thread() {
+
+    carbon_thread_t *thread;
+    struct propagator_thread_args * p_thd_args = NULL;
+
+    thread = calloc(1, sizeof(carbon_thread_t));
+    thread_init(thread, "propagator");
+
+    p_thd_args = (struct propagator_thread_args *)
+                 malloc(sizeof(struct propagator_thread_args));
+    p_thd_args->id_thread = 0;
+    p_thd_args->thread = thread;
+
+    if (pthread_create(&(thread->pthread), NULL, propagator_thread, (void*)p_thd_args) != 0) {
+        error("error on pthread_create: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    return thread;
+
+}
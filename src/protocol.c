@@ -25,40 +25,50 @@
 #include <string.h>
 #include "protocol.h"
 #include "database.h" // manage database recors
+#include "pressure.h"
+#include "wal.h"
 
-void protocol_process_metric_line(char *metric_line) {
+/*
+ * Adds the point of metric line in cache, with the id of the write-ahead log
+ * segment where it is logged (0 if not logged).
+ */
+void protocol_process_metric_line(char *metric_line, uint32_t wal_segment) {
 
     char *metric_name = malloc(sizeof(char) * METRIC_NAME_MAX_LEN);
     double value = 0.0;
     uint32_t timestamp = 0;
-    metric_t *related_metric = NULL;
     metric_point_t *metric_point = NULL;
 
+    /* drop the point, it does not need to be logged anymore */
+    if (cache_is_full()) {
+        wal_release(wal_segment, 1);
+        free(metric_name);
+        return;
+    }
+
     sscanf(metric_line, "%s %lf %u", metric_name, &value, &timestamp);
 
     //printf("parsed metric:%s timestamp:%u value:%f\n", metric_name, timestamp, value);
 
-    related_metric = get_metric(db, metric_name);
-
-    if(related_metric == NULL) { /* metric does not exist yet */
-        related_metric = create_new_metric(metric_name);
-        add_database_metric(db, related_metric);
-    }
-    
     metric_point = create_new_metric_point(timestamp, value);
-    add_database_metric_point(db, related_metric, metric_point);
+    metric_point->wal_segment = wal_segment;
+    if (!add_metric_point(db, metric_name, metric_point)) {
+        wal_release(wal_segment, 1);
+        free(metric_point);
+    }
 
     free(metric_name);
 }
 
-void protocol_process_metrics_multiline(char *metrics_multiline) {
+void protocol_process_metrics_multiline(char *metrics_multiline,
+                                        uint32_t wal_segment) {
 
     char *cur_line = NULL;
     char *saveptr = NULL;
 
     cur_line = strtok_r(metrics_multiline, "\n", &saveptr);
     while(cur_line) {
-        protocol_process_metric_line(cur_line);
+        protocol_process_metric_line(cur_line, wal_segment);
         cur_line = strtok_r(NULL, "\n", &saveptr);
     }
 }
@@ -22,7 +22,9 @@
 #ifndef CARBON_PROTOCOL_H
 #define CARBON_PROTOCOL_H
 
-void protocol_process_metric_line(char *);
-void protocol_process_metrics_multiline(char *);
+#include <stdint.h>
+
+void protocol_process_metric_line(char *, uint32_t);
+void protocol_process_metrics_multiline(char *, uint32_t);
 
 #endif
@@ -0,0 +1,776 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * HTTP query server: serves find and fetch requests in JSON, with the points
+ * read from whisper files merged with the points still in cache.
+ *
+ *   GET /metrics/find?query=<pattern>
+ *
+ *     [{"path": "a.b", "is_leaf": false}, ...]
+ *
+ *   Nodes are searched in the metric names index.
+ *
+ *   GET /render?target=<name or pattern>&from=<time>&until=<time>
+ *              &maxDataPoints=<n>
+ *
+ *     [{"target": "a.b.c", "datapoints": [[<value or null>, <ts>], ...]}, ...]
+ *
+ * Times are either epoch timestamps, "now" or relative to now like "-3h",
+ * with the units of graphite-web: s, min, h, d, w, mon and y.
+ * When maxDataPoints is given, the values are consolidated by average so that
+ * no more points are returned.
+ *
+ * Several threads accept connections on the same listening socket, each
+ * serving one request per connection.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h> /* strerror() */
+#include <time.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "query_server.h"
+#include "threads.h"
+#include "common.h"
+#include "database.h"
+#include "whisper.h"
+#include "storage.h"
+#include "metric_glob.h"
+#include "index.h"
+#include "conf.h"
+#include "log.h"
+
+#define QUERY_MAX_REQUEST 16384
+#define QUERY_MAX_TARGETS 64
+/* seconds given to a client to send its request */
+#define QUERY_REQUEST_TIMEOUT 10
+
+/* number of query server threads still running */
+static int nb_running_workers = 0;
+
+/*
+ * Growing buffer used to build responses.
+ */
+struct query_buffer_s {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+typedef struct query_buffer_s query_buffer_t;
+
+static void query_buffer_printf(query_buffer_t *buf, const char *fmt, ...) {
+
+    va_list ap;
+    int n = 0;
+
+    while (1) {
+        va_start(ap, fmt);
+        n = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && (size_t) n < buf->size - buf->len)
+            break;
+        buf->size = buf->size * 2 + n + 1;
+        buf->data = realloc(buf->data, buf->size);
+    }
+
+    buf->len += n;
+
+}
+
+/*
+ * Appends str as a JSON string.
+ */
+static void query_buffer_json_string(query_buffer_t *buf, const char *str) {
+
+    query_buffer_printf(buf, "\"");
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            query_buffer_printf(buf, "\\%c", *str);
+        else if ((unsigned char) *str < 0x20)
+            query_buffer_printf(buf, "\\u%04x", *str);
+        else
+            query_buffer_printf(buf, "%c", *str);
+    }
+    query_buffer_printf(buf, "\"");
+
+}
+
+/*
+ * Node found by a find request.
+ */
+struct query_node_s {
+    char *path;
+    bool is_leaf;
+};
+
+typedef struct query_node_s query_node_t;
+
+struct query_nodes_s {
+    query_node_t *nodes;
+    uint32_t nb_nodes;
+    uint32_t size;
+};
+
+typedef struct query_nodes_s query_nodes_t;
+
+static void query_nodes_add(query_nodes_t *list, const char *path,
+                            size_t path_len, bool is_leaf) {
+
+    if (list->nb_nodes == list->size) {
+        list->size = list->size ? list->size * 2 : 16;
+        list->nodes = realloc(list->nodes, list->size * sizeof(query_node_t));
+    }
+
+    list->nodes[list->nb_nodes].path = strndup(path, path_len);
+    list->nodes[list->nb_nodes].is_leaf = is_leaf;
+    list->nb_nodes++;
+
+}
+
+static void query_nodes_free(query_nodes_t *list) {
+
+    uint32_t i = 0;
+
+    for (i = 0; i < list->nb_nodes; i++)
+        free(list->nodes[i].path);
+    free(list->nodes);
+
+}
+
+static void query_find_callback(const char *path, bool is_leaf, void *data) {
+
+    query_nodes_add((query_nodes_t *) data, path, strlen(path), is_leaf);
+
+}
+
+/*
+ * Finds all the nodes matching the glob pattern in metric names index.
+ */
+static void query_find(const char *pattern, query_nodes_t *result) {
+
+    /* names are mapped to paths, never walk out of the storage directory */
+    if (strchr(pattern, '/'))
+        return;
+
+    index_find(pattern, query_find_callback, result);
+
+}
+
+/*
+ * Merges the points of the metric still in cache into the series. Cached
+ * points override the values read on disk, the last one wins in a slot. They
+ * are raw points of the highest precision archive, so a series read from a
+ * lower precision archive is left as is. If the metric has no file yet, a
+ * series is built with the resolution of its highest precision archive, over
+ * the part of from..until within its retention.
+ */
+static whisper_series_t * query_merge_cache(const char *metric_name,
+                                            whisper_series_t *series,
+                                            uint32_t from, uint32_t until) {
+
+    uint32_t *timestamps = NULL;
+    double *values = NULL;
+    uint32_t nb_points = 0, step = 0, i = 0, slot = 0;
+    uint32_t now = (uint32_t) time(NULL), max_retention = 0, oldest = 0;
+
+    nb_points = copy_metric_points(db, metric_name, &timestamps, &values);
+    if (nb_points == 0)
+        return series;
+
+    step = whisper_metric_step(metric_name, &max_retention);
+
+    /* aggregated slots are not replaced by a single raw point */
+    if (series && series->step != step)
+        goto end;
+
+    if (series == NULL) {
+        oldest = now > max_retention ? now - max_retention : 0;
+        if (until > now)
+            until = now;
+        if (from < oldest)
+            from = oldest;
+        if (step && from < until) {
+            series = calloc(1, sizeof(whisper_series_t));
+            if (series == NULL)
+                goto end;
+            series->step = step;
+            series->from = from - (from % step) + step;
+            series->until = until - (until % step) + step;
+            series->nb_values = (series->until - series->from) / step;
+            series->values = malloc((series->nb_values + 1) * sizeof(double));
+            if (series->values == NULL) {
+                error("query server: cannot allocate %u values for %s",
+                      series->nb_values, metric_name);
+                free(series);
+                series = NULL;
+                goto end;
+            }
+            for (i = 0; i < series->nb_values; i++)
+                series->values[i] = NAN;
+        }
+    }
+
+    for (i = 0; series && i < nb_points; i++) {
+        slot = timestamps[i] - (timestamps[i] % series->step);
+        if (slot < series->from || slot >= series->until)
+            continue;
+        series->values[(slot - series->from) / series->step] = values[i];
+    }
+
+end:
+    free(timestamps);
+    free(values);
+
+    return series;
+
+}
+
+/*
+ * Consolidates the values of the series by average so that there are at most
+ * max_points values.
+ */
+static void query_consolidate(whisper_series_t *series, uint32_t max_points) {
+
+    uint32_t per_point = 0, nb_values = 0, i = 0, j = 0, nb_known = 0;
+    double sum = 0;
+
+    if (max_points == 0 || series->nb_values <= max_points)
+        return;
+
+    per_point = (series->nb_values + max_points - 1) / max_points;
+    nb_values = (series->nb_values + per_point - 1) / per_point;
+
+    for (i = 0; i < nb_values; i++) {
+        sum = 0;
+        nb_known = 0;
+        for (j = i * per_point;
+             j < (i + 1) * per_point && j < series->nb_values; j++) {
+            if (isnan(series->values[j]))
+                continue;
+            sum += series->values[j];
+            nb_known++;
+        }
+        series->values[i] = nb_known ? sum / nb_known : NAN;
+    }
+
+    series->nb_values = nb_values;
+    series->step *= per_point;
+    series->until = series->from + nb_values * series->step;
+
+}
+
+static void query_render_series(query_buffer_t *buf, const char *metric_name,
+                                whisper_series_t *series, bool first) {
+
+    uint32_t i = 0;
+
+    query_buffer_printf(buf, "%s{\"target\": ", first ? "" : ", ");
+    query_buffer_json_string(buf, metric_name);
+    query_buffer_printf(buf, ", \"datapoints\": [");
+
+    for (i = 0; i < series->nb_values; i++) {
+        if (isnan(series->values[i]))
+            query_buffer_printf(buf, "%s[null, %u]", i ? ", " : "",
+                                series->from + i * series->step);
+        else
+            query_buffer_printf(buf, "%s[%.17g, %u]", i ? ", " : "",
+                                series->values[i],
+                                series->from + i * series->step);
+    }
+
+    query_buffer_printf(buf, "]}");
+
+}
+
+/*
+ * Fetches the metric from disk and cache, and appends it to the response.
+ * Returns true if the metric was added.
+ */
+static bool query_render_metric(query_buffer_t *buf, const char *metric_name,
+                                uint32_t from, uint32_t until,
+                                uint32_t max_points, bool first) {
+
+    whisper_series_t *series = NULL;
+
+    if (strchr(metric_name, '/'))
+        return false;
+
+    series = storage->fetch(metric_name, from, until);
+    series = query_merge_cache(metric_name, series, from, until);
+
+    if (series == NULL)
+        return false;
+
+    query_consolidate(series, max_points);
+    query_render_series(buf, metric_name, series, first);
+    whisper_series_free(series);
+
+    return true;
+
+}
+
+/*
+ * Units of relative times, as in graphite-web. A unit is given by any word
+ * starting with its prefix, like "min", "mins" or "minutes". Months and years
+ * have 30 and 365 days.
+ */
+static const struct {
+    const char *prefix;
+    uint32_t seconds;
+} query_time_units[] = {
+    { "s", 1 },
+    { "min", 60 },
+    { "h", 3600 },
+    { "d", 86400 },
+    { "w", 86400 * 7 },
+    { "mon", 86400 * 30 },
+    { "y", 86400 * 365 },
+};
+
+/*
+ * Parses a duration like "10min" or "1y" into seconds. Returns 0 if the
+ * duration is invalid.
+ */
+static uint64_t query_parse_duration(const char *str) {
+
+    char *unit = NULL;
+    unsigned long count = 0;
+    size_t i = 0;
+
+    count = strtoul(str, &unit, 10);
+    if (unit == str)
+        return 0;
+
+    for (i = 0; i < sizeof(query_time_units) / sizeof(query_time_units[0]); i++)
+        if (strncmp(unit, query_time_units[i].prefix,
+                    strlen(query_time_units[i].prefix)) == 0)
+            return (uint64_t) count * query_time_units[i].seconds;
+
+    return 0;
+
+}
+
+/*
+ * Parses a time parameter, either absolute or relative to now. Returns now if
+ * the time is invalid.
+ */
+static uint32_t query_parse_time(const char *str, uint32_t now) {
+
+    uint64_t seconds = 0;
+    char *endptr = NULL;
+    unsigned long timestamp = 0;
+
+    if (str[0] == '-') {
+        seconds = query_parse_duration(str + 1);
+        if (seconds == 0)
+            return now;
+        return seconds < now ? now - seconds : 0;
+    }
+
+    if (strcmp(str, "now") == 0)
+        return now;
+
+    timestamp = strtoul(str, &endptr, 10);
+    if (*str == '\0' || *endptr != '\0' || timestamp > UINT32_MAX)
+        return now;
+
+    return (uint32_t) timestamp;
+
+}
+
+/*
+ * Decodes URL encoded string in place.
+ */
+static void query_url_decode(char *str) {
+
+    char *out = str;
+    char hex[3] = { 0, 0, 0 };
+
+    for (; *str; str++, out++) {
+        if (*str == '+') {
+            *out = ' ';
+        } else if (*str == '%' && str[1] && str[2]) {
+            hex[0] = str[1];
+            hex[1] = str[2];
+            *out = (char) strtol(hex, NULL, 16);
+            str += 2;
+        } else {
+            *out = *str;
+        }
+    }
+    *out = '\0';
+
+}
+
+static int query_send(int conn, const char *buf, size_t len) {
+
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = send(conn, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            debug("query server: error on send(): %s", strerror(errno));
+            return 1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+
+}
+
+static void query_send_response(int conn, const char *status,
+                                query_buffer_t *body) {
+
+    char header[256];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.0 %s\r\n"
+                       "Content-Type: application/json\r\n"
+                       "Content-Length: %zu\r\n"
+                       "Connection: close\r\n\r\n",
+                       status, body->len);
+
+    if (query_send(conn, header, len) == 0)
+        query_send(conn, body->data, body->len);
+
+}
+
+/*
+ * Handles the request in buffer and sends the response on connection.
+ */
+static void query_process_request(int conn, char *request) {
+
+    char *saveptr = NULL, *param_saveptr = NULL;
+    char *method = strtok_r(request, " ", &saveptr);
+    char *uri = strtok_r(NULL, " ", &saveptr);
+    char *path = NULL, *params = NULL, *param = NULL, *value = NULL;
+    char *targets[QUERY_MAX_TARGETS];
+    char *pattern = NULL;
+    int nb_targets = 0, i = 0;
+    uint32_t now = (uint32_t) time(NULL);
+    uint32_t from = now - 86400, until = now, max_points = 0, j = 0;
+    bool first = true;
+    query_buffer_t body = { NULL, 0, 0 };
+    query_nodes_t nodes = { NULL, 0, 0 };
+    const char *status = "200 OK";
+
+    body.size = 4096;
+    body.data = malloc(body.size);
+
+    if (method == NULL || uri == NULL || strcmp(method, "GET") != 0) {
+        query_buffer_printf(&body, "{\"error\": \"bad request\"}");
+        query_send_response(conn, "400 Bad Request", &body);
+        free(body.data);
+        return;
+    }
+
+    path = strtok_r(uri, "?", &saveptr);
+    params = strtok_r(NULL, "", &saveptr);
+
+    for (param = params ? strtok_r(params, "&", &param_saveptr) : NULL;
+         param;
+         param = strtok_r(NULL, "&", &param_saveptr)) {
+
+        value = strchr(param, '=');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+        query_url_decode(param);
+        query_url_decode(value);
+
+        if (strcmp(param, "query") == 0)
+            pattern = value;
+        else if (strcmp(param, "target") == 0 && nb_targets < QUERY_MAX_TARGETS)
+            targets[nb_targets++] = value;
+        else if (strcmp(param, "from") == 0)
+            from = query_parse_time(value, now);
+        else if (strcmp(param, "until") == 0)
+            until = query_parse_time(value, now);
+        else if (strcmp(param, "maxDataPoints") == 0)
+            max_points = strtoul(value, NULL, 10);
+    }
+
+    debug("query server: %s request", path);
+
+    if (strcmp(path, "/metrics/find") == 0 ||
+        strcmp(path, "/metrics/find/") == 0) {
+
+        if (pattern)
+            query_find(pattern, &nodes);
+
+        query_buffer_printf(&body, "[");
+        for (j = 0; j < nodes.nb_nodes; j++) {
+            query_buffer_printf(&body, "%s{\"path\": ", j ? ", " : "");
+            query_buffer_json_string(&body, nodes.nodes[j].path);
+            query_buffer_printf(&body, ", \"is_leaf\": %s}",
+                                nodes.nodes[j].is_leaf ? "true" : "false");
+        }
+        query_buffer_printf(&body, "]");
+        query_nodes_free(&nodes);
+
+    } else if (strcmp(path, "/render") == 0 ||
+               strcmp(path, "/render/") == 0) {
+
+        query_buffer_printf(&body, "[");
+        for (i = 0; i < nb_targets; i++) {
+            if (!glob_is_pattern(targets[i])) {
+                if (query_render_metric(&body, targets[i], from, until,
+                                        max_points, first))
+                    first = false;
+                continue;
+            }
+            /* render all the leaves matching the pattern */
+            memset(&nodes, 0, sizeof(query_nodes_t));
+            query_find(targets[i], &nodes);
+            for (j = 0; j < nodes.nb_nodes; j++)
+                if (nodes.nodes[j].is_leaf &&
+                    query_render_metric(&body, nodes.nodes[j].path, from,
+                                        until, max_points, first))
+                    first = false;
+            query_nodes_free(&nodes);
+        }
+        query_buffer_printf(&body, "]");
+
+    } else {
+        query_buffer_printf(&body, "{\"error\": \"not found\"}");
+        status = "404 Not Found";
+    }
+
+    query_send_response(conn, status, &body);
+    free(body.data);
+
+}
+
+/*
+ * Reads the request header on connection and process it. The body of the
+ * request, if any, is ignored. The connection is given up if the request is
+ * not received within QUERY_REQUEST_TIMEOUT seconds or if the thread must
+ * pause.
+ */
+static void query_serve(int conn, carbon_thread_t *me) {
+
+    char *request = malloc(QUERY_MAX_REQUEST);
+    size_t len = 0;
+    ssize_t n = 0;
+    char *eol = NULL;
+    time_t deadline = time(NULL) + QUERY_REQUEST_TIMEOUT;
+
+    while (conf->run && len < QUERY_MAX_REQUEST - 1) {
+
+        n = recv(conn, request + len, QUERY_MAX_REQUEST - len - 1, 0);
+
+        if (n < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                debug("query server: error on recv(): %s", strerror(errno));
+                break;
+            }
+            if (time(NULL) >= deadline) {
+                debug("query server: request timeout, closing connection");
+                break;
+            }
+            if (thread_must_pause(me))
+                break;
+            continue;
+        }
+        if (n == 0)
+            break;
+
+        len += n;
+        request[len] = '\0';
+
+        /* only the request line is needed */
+        if ((eol = strstr(request, "\r\n")) || (eol = strchr(request, '\n'))) {
+            *eol = '\0';
+            query_process_request(conn, request);
+            break;
+        }
+    }
+
+    free(request);
+
+}
+
+void * query_server_worker(void * arg) {
+
+    query_server_args_t *worker_args = (query_server_args_t *) arg;
+    carbon_thread_t *me = worker_args->thread;
+    int sockfd = worker_args->sockfd;
+    int conn;
+    struct timeval tv, send_tv;
+
+    tv.tv_sec = 0;
+    tv.tv_usec = 500000;
+
+    /* responses are sent in blocking mode, do not hang on a stuck client */
+    send_tv.tv_sec = QUERY_REQUEST_TIMEOUT;
+    send_tv.tv_usec = 0;
+
+    block_signals();
+
+    thread_run_lock(me);
+
+    while(conf->run) {
+
+        if(thread_must_pause(me)) {
+            thread_pause_and_wait_run_signal(me);
+        }
+
+        conn = accept(sockfd, NULL, NULL);
+        if (conn < 0) {
+            switch(errno) {
+                case EINTR:
+                case EAGAIN:
+                    break;
+                default:
+                    error("error calling accept(): %s\n", strerror(errno));
+            }
+        } else {
+            if(setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *)&tv, sizeof(struct timeval)) < 0)
+                error("error on setsockopt() SO_RCVTIMEO: %s", strerror(errno));
+            if(setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, (struct timeval *)&send_tv, sizeof(struct timeval)) < 0)
+                error("error on setsockopt() SO_SNDTIMEO: %s", strerror(errno));
+            query_serve(conn, me);
+            close(conn);
+        }
+    }
+
+    /* the listening socket is shared, the last thread closes it */
+    if (__sync_sub_and_fetch(&nb_running_workers, 1) == 0)
+        close(sockfd);
+    free(worker_args);
+
+    return NULL;
+
+}
+
+/*
+ * Create, bind and returns the listening socket of the query server.
+ * Returns -1 on error.
+ */
+static int query_server_init_socket() {
+
+    int sockfd;
+    int optval = 1;
+    struct timeval tv;
+    struct sockaddr_in serveraddr;
+
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        error("error on opening socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int)) < 0) {
+        error("error on setsockopt() SO_REUSEADDR: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    /* 0.5 sec timeout */
+    tv.tv_sec = 0;
+    tv.tv_usec = 500000;
+
+    if(setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *)&tv, sizeof(struct timeval)) < 0) {
+        error("error on setsockopt() SO_RCVTIMEO: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short)conf->query_server_port);
+
+    if (bind(sockfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0) {
+        error("error on binding query server port %d: %s",
+              conf->query_server_port, strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    if (listen(sockfd, 64) < 0) {
+        error("error on listen: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+
+}
+
+/*
+ * Launch conf->query_server_threads threads serving queries. Returns the
+ * array of threads and sets nb_threads, or NULL if the server could not be
+ * started.
+ */
+carbon_thread_t ** launch_query_server_threads(int *nb_threads) {
+
+    int sockfd, id_thread;
+    carbon_thread_t **query_threads = NULL;
+    query_server_args_t *args = NULL;
+
+    *nb_threads = 0;
+
+    debug("creating the query server socket");
+
+    sockfd = query_server_init_socket();
+    if (sockfd < 0) {
+        error("query server disabled");
+        return NULL;
+    }
+
+    query_threads = calloc(conf->query_server_threads, sizeof(carbon_thread_t *));
+    nb_running_workers = conf->query_server_threads;
+
+    for (id_thread = 0; id_thread < conf->query_server_threads; id_thread++) {
+
+        query_threads[id_thread] = calloc(1, sizeof(carbon_thread_t));
+        args = calloc(1, sizeof(query_server_args_t));
+        args->id_thread = id_thread;
+        args->thread = query_threads[id_thread];
+        args->sockfd = sockfd;
+
+        thread_init(query_threads[id_thread], "query server");
+
+        if (pthread_create(&(query_threads[id_thread]->pthread), NULL, query_server_worker, (void*)args) != 0) {
+            error("error on pthread_create: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    *nb_threads = conf->query_server_threads;
+
+    return query_threads;
+
+}
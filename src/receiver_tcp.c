@@ -33,6 +33,7 @@
 #include "threads.h"
 #include "common.h"
 #include "protocol.h"
+#include "wal.h"
 
 void * receiver_tcp_worker(void * arg) {
 
@@ -42,6 +43,7 @@ void * receiver_tcp_worker(void * arg) {
     //int id_thread = worker_args->id_thread;
     int sockfd = worker_args->sockfd; /* fd on TCP socket */
     int conn; /* TCP connection */
+    uint32_t wal_segment = 0; /* segment of the message in write-ahead log */
 
     struct sockaddr_in cliaddr;
     socklen_t clilen = sizeof(struct sockaddr_in);
@@ -98,7 +100,13 @@ void * receiver_tcp_worker(void * arg) {
             } else {
                 debug("received %d bytes", n);
                 mesg[n] = '\0';
-                protocol_process_metrics_multiline(mesg);
+                /* points not logged are still cached, but lost on crash */
+                if (conf->wal_enabled && wal_append(mesg, n, &wal_segment)) {
+                    pthread_mutex_lock(&(monitoring->mutex_errors));
+                    monitoring->wal_errors++;
+                    pthread_mutex_unlock(&(monitoring->mutex_errors));
+                }
+                protocol_process_metrics_multiline(mesg, wal_segment);
             }
             //close(conn);
         }
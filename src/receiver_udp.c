@@ -32,6 +32,7 @@
 #include "common.h"
 #include "threads.h"
 #include "protocol.h"
+#include "wal.h"
 
 /*
  * UDP receiver thread worker.
@@ -44,6 +45,7 @@ void * receiver_udp_worker(void * arg) {
     //int id_thread = worker_args->id_thread;
     carbon_thread_t *me = worker_args->thread;
     int sockfd = worker_args->sockfd; /* fd on UDP socket */
+    uint32_t wal_segment = 0; /* segment of the message in write-ahead log */
 
     socklen_t len;
     struct sockaddr_in cliaddr;
@@ -83,7 +85,13 @@ void * receiver_udp_worker(void * arg) {
         } else {
             debug("received %d bytes", n);
             mesg[n] = '\0';
-            protocol_process_metrics_multiline(mesg);
+            /* points not logged are still cached, but lost on crash */
+            if (conf->wal_enabled && wal_append(mesg, n, &wal_segment)) {
+                pthread_mutex_lock(&(monitoring->mutex_errors));
+                monitoring->wal_errors++;
+                pthread_mutex_unlock(&(monitoring->mutex_errors));
+            }
+            protocol_process_metrics_multiline(mesg, wal_segment);
        }
     }
 
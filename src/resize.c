@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * carbond-resize rewrites the whisper files of the storage roots with the
+ * archives of the storage schemas and aggregations currently configured, after
+ * they have been changed, see whisper_resize_file(). The files are resized in
+ * parallel by several threads. carbond must be stopped meanwhile: the storage
+ * roots are locked, see whisper_lock_roots().
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <limits.h> /* PATH_MAX */
+#include <time.h>
+
+#include "common.h"
+#include "conf.h"
+#include "whisper.h"
+#include "aggregation.h"
+#include "codec.h"
+#include "log.h"
+
+#define RESIZE_DEFAULT_THREADS 4
+
+/*
+ * Global variables used by whisper functions
+ */
+carbon_conf_t *conf = NULL;
+monitoring_metrics_t *monitoring = NULL;
+
+struct resize_file_s {
+    char *path;
+    char *metric_name;
+};
+
+typedef struct resize_file_s resize_file_t;
+
+/* whisper files found in storage roots, shared by resize threads */
+struct resize_state_s {
+    resize_file_t *files;
+    uint32_t nb_files;
+    uint32_t size_files;
+    uint32_t next; /* index of next file to resize */
+    bool changed_only;
+    uint32_t nb_resized;
+    uint32_t nb_unchanged;
+    uint32_t nb_errors;
+};
+
+typedef struct resize_state_s resize_state_t;
+
+static void print_usage() {
+
+    printf("usage: carbond-resize [-h] [-d] [-c CONF] [-t THREADS] [-m]\n"
+           "-h, --help          Print this help\n"
+           "-d, --debug         Debug mode\n"
+           "-c, --conf CONF     Specify an alternative configuration file\n"
+           "                      (default: %%sysconfdir/carbon/carbon.conf)\n"
+           "-t, --threads N     Number of files resized in parallel (default: %d)\n"
+           "-m, --changed-only  Only rewrite the files whose archives or\n"
+           "                      aggregation differ from the configuration\n\n",
+           RESIZE_DEFAULT_THREADS);
+
+}
+
+/*
+ * Adds in state, given as data, a whisper file found in storage roots with
+ * the name of its metric.
+ */
+static void resize_add_file(const char *path, const char *metric_name,
+                            void *data) {
+
+    resize_state_t *state = data;
+
+    if (state->nb_files == state->size_files) {
+        state->size_files = state->size_files ? state->size_files * 2 : 1024;
+        state->files = realloc(state->files,
+                               state->size_files * sizeof(resize_file_t));
+    }
+
+    state->files[state->nb_files].path = strdup(path);
+    state->files[state->nb_files].metric_name = strdup(metric_name);
+    state->nb_files++;
+
+}
+
+static void * resize_thread(void *arg) {
+
+    resize_state_t *state = (resize_state_t *) arg;
+    resize_file_t *file = NULL;
+    uint32_t index = 0;
+
+    while ((index = __sync_fetch_and_add(&state->next, 1)) < state->nb_files) {
+
+        file = &state->files[index];
+
+        switch (whisper_resize_file(file->path, file->metric_name,
+                                    state->changed_only)) {
+            case 1:
+                info("resized %s", file->path);
+                __sync_add_and_fetch(&state->nb_resized, 1);
+                break;
+            case 0:
+                __sync_add_and_fetch(&state->nb_unchanged, 1);
+                break;
+            default:
+                __sync_add_and_fetch(&state->nb_errors, 1);
+                break;
+        }
+    }
+
+    return NULL;
+
+}
+
+int main(int argc, char **argv) {
+
+    const char *opt_string = "hdc:t:m";
+    const struct option long_opts[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "debug", no_argument, NULL, 'd' },
+        { "conf", required_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { "changed-only", no_argument, NULL, 'm' },
+        { NULL, no_argument, NULL, 0 }
+    };
+    resize_state_t state;
+    pthread_t *threads = NULL;
+    char dir[PATH_MAX];
+    char prefix[METRIC_NAME_MAX_LEN];
+    struct timespec start, end;
+    int opt = 0, nb_threads = RESIZE_DEFAULT_THREADS, i = 0;
+    uint32_t file = 0;
+    uint32_t root = 0;
+
+    conf = calloc(1, sizeof(carbon_conf_t));
+    monitoring = calloc(1, sizeof(monitoring_metrics_t));
+    memset(&state, 0, sizeof(resize_state_t));
+
+    conf_set_defaults(conf);
+
+    while ((opt = getopt_long(argc, argv, opt_string, long_opts, NULL)) != -1) {
+
+        switch(opt) {
+
+            case 'h':
+                print_usage();
+                return EXIT_SUCCESS;
+            case 'd':
+                conf->tracing = true;
+                conf->log_level = LOG_LEVEL_DEBUG;
+                break;
+            case 'c':
+                snprintf(conf->conf_file, PATH_MAX, "%s", optarg);
+                break;
+            case 't':
+                nb_threads = atoi(optarg);
+                if (nb_threads < 1) {
+                    error("invalid number of threads %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'm':
+                state.changed_only = true;
+                break;
+            default:
+                print_usage();
+                return EXIT_FAILURE;
+
+        }
+    }
+
+    if (conf_parse(conf))
+        return EXIT_FAILURE;
+
+    /* refuse to resize files that a running carbond keeps cached */
+    if (whisper_lock_roots())
+        return EXIT_FAILURE;
+
+    pthread_mutex_init(&(monitoring->mutex_points), NULL);
+    aggregation_init();
+    codec_init();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (root = 0; root < whisper_nb_roots(); root++) {
+        if (strlen(whisper_root_dir(root)) >= PATH_MAX)
+            continue;
+        strcpy(dir, whisper_root_dir(root));
+        prefix[0] = '\0';
+        state.nb_errors += whisper_scan_dir(dir, prefix, WHISPER_EXTENSION,
+                                            resize_add_file, &state);
+    }
+
+    info("%u whisper files found in %u storage roots", state.nb_files,
+         whisper_nb_roots());
+
+    threads = calloc(nb_threads, sizeof(pthread_t));
+
+    for (i = 0; i < nb_threads; i++)
+        if (pthread_create(&threads[i], NULL, resize_thread, &state) != 0) {
+            error("error on pthread_create: %s", strerror(errno));
+            break;
+        }
+
+    /* the files left by threads not created are resized by the others */
+    nb_threads = i;
+    if (nb_threads == 0)
+        resize_thread(&state);
+
+    for (i = 0; i < nb_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    info("%u files resized, %u unchanged, %u errors in %.3fs with %d threads",
+         state.nb_resized, state.nb_unchanged, state.nb_errors,
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+         nb_threads);
+
+    for (file = 0; file < state.nb_files; file++) {
+        free(state.files[file].path);
+        free(state.files[file].metric_name);
+    }
+    free(state.files);
+    free(threads);
+
+    return state.nb_errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+}
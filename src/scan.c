@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Startup scan of the storage roots: the directories are walked by
+ * several threads and every whisper file found is registered in database
+ * with the layout of its archives, so that the first write of a metric after
+ * a restart does not have to probe and read its file.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>    // DT_* entry types
+#include <limits.h>    // PATH_MAX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "scan.h"
+#include "common.h"
+#include "database.h"
+#include "whisper.h"
+#include "storage.h"
+#include "log.h"
+
+#define SCAN_DENTS_BUFFER_SIZE 32768
+
+/* record returned by getdents64 syscall */
+struct scan_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* directory waiting to be scanned, path is relative to storage root */
+struct scan_dir_s {
+    char *path;
+    struct scan_dir_s *next;
+};
+
+typedef struct scan_dir_s scan_dir_t;
+
+/* state shared by scan threads */
+struct scan_state_s {
+    uint32_t root; /* storage root being scanned */
+    int storage_fd;
+    scan_dir_t *queue;
+    int nb_busy; /* threads scanning a directory */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t nb_dirs;
+    uint32_t nb_metrics;
+    uint32_t nb_errors;
+};
+
+typedef struct scan_state_s scan_state_t;
+
+static void scan_push_dir(scan_state_t *state, const char *path) {
+
+    scan_dir_t *dir = malloc(sizeof(scan_dir_t));
+
+    dir->path = strdup(path);
+
+    pthread_mutex_lock(&state->lock);
+    dir->next = state->queue;
+    state->queue = dir;
+    pthread_cond_signal(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+
+}
+
+/*
+ * Registers in database the metric of file name in directory of storage root,
+ * with its state cached by the storage engine if it has to. Returns 0 on
+ * success, 1 on error.
+ */
+static int scan_register_file(uint32_t root, int dir_fd, const char *dir_path,
+                              const char *name, size_t name_len) {
+
+    char metric_name[METRIC_NAME_MAX_LEN];
+    size_t dir_len = strlen(dir_path), ext_len = strlen(storage->extension),
+           i = 0;
+    const char *slash = strrchr(dir_path, '/');
+    metric_t *metric = NULL;
+    int whisper_fd = -1, rc = 0;
+
+    /* leaves of fan-out directories belong to their parent */
+    if (whisper_is_fanout_dir(slash ? slash + 1 : dir_path))
+        dir_len = slash ? (size_t) (slash - dir_path) : 0;
+
+    /* metric name is the path with dots, without extension */
+    if (dir_len + name_len - ext_len + 2 > METRIC_NAME_MAX_LEN)
+        return 1;
+
+    if (dir_len) {
+        memcpy(metric_name, dir_path, dir_len);
+        for (i = 0; i < dir_len; i++)
+            if (metric_name[i] == '/')
+                metric_name[i] = '.';
+        metric_name[dir_len++] = '.';
+    }
+    memcpy(metric_name + dir_len, name, name_len - ext_len);
+    metric_name[dir_len + name_len - ext_len] = '\0';
+
+    /* written in another root from now on, until moved there */
+    if (whisper_metric_root(metric_name) != root) {
+        error("scan: metric %s found in %s belongs to storage root %s",
+              metric_name, whisper_root_dir(root),
+              whisper_root_dir(whisper_metric_root(metric_name)));
+        return 1;
+    }
+
+    metric = get_or_create_metric(db, metric_name);
+    if (storage->register_file == NULL)
+        return 0;
+
+    whisper_fd = openat(dir_fd, name, O_RDONLY);
+    if (whisper_fd < 0) {
+        error("scan: unable to open %s/%s: %s", dir_path, name,
+              strerror(errno));
+        return 1;
+    }
+
+    rc = storage->register_file(metric, whisper_fd);
+
+    close(whisper_fd);
+
+    return rc;
+
+}
+
+/*
+ * Reads all the entries of directory, queues its sub-directories and
+ * registers its whisper files.
+ */
+static void scan_dir(scan_state_t *state, const char *path) {
+
+    char buf[SCAN_DENTS_BUFFER_SIZE];
+    char sub_path[PATH_MAX];
+    struct scan_dirent64 *entry = NULL;
+    struct stat st;
+    long nread = 0, pos = 0;
+    size_t path_len = strlen(path), name_len = 0,
+           ext_len = strlen(storage->extension);
+    uint32_t nb_metrics = 0, nb_errors = 0;
+    unsigned char type = DT_UNKNOWN;
+    int dir_fd = -1;
+
+    if (path_len)
+        dir_fd = openat(state->storage_fd, path, O_RDONLY|O_DIRECTORY);
+    else
+        dir_fd = dup(state->storage_fd);
+
+    if (dir_fd < 0) {
+        error("scan: unable to open directory %s: %s", path, strerror(errno));
+        __sync_add_and_fetch(&state->nb_errors, 1);
+        return;
+    }
+
+    while ((nread = syscall(SYS_getdents64, dir_fd, buf, sizeof(buf))) > 0) {
+
+        for (pos = 0; pos < nread; pos += entry->d_reclen) {
+
+            entry = (struct scan_dirent64 *) (buf + pos);
+
+            if (entry->d_name[0] == '.' && !whisper_is_fanout_dir(entry->d_name))
+                continue;
+
+            type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                if (fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW))
+                    continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+
+            name_len = strlen(entry->d_name);
+
+            if (type == DT_DIR) {
+                if (path_len + name_len + 2 > PATH_MAX)
+                    continue;
+                if (path_len)
+                    snprintf(sub_path, PATH_MAX, "%s/%s", path, entry->d_name);
+                else
+                    snprintf(sub_path, PATH_MAX, "%s", entry->d_name);
+                scan_push_dir(state, sub_path);
+            } else if (type == DT_REG && name_len > ext_len &&
+                       strcmp(entry->d_name + name_len - ext_len,
+                              storage->extension) == 0) {
+                if (scan_register_file(state->root, dir_fd, path,
+                                       entry->d_name, name_len))
+                    nb_errors++;
+                else
+                    nb_metrics++;
+            }
+        }
+    }
+
+    if (nread < 0) {
+        error("scan: error while reading directory %s: %s", path,
+              strerror(errno));
+        nb_errors++;
+    }
+
+    close(dir_fd);
+
+    __sync_add_and_fetch(&state->nb_dirs, 1);
+    __sync_add_and_fetch(&state->nb_metrics, nb_metrics);
+    __sync_add_and_fetch(&state->nb_errors, nb_errors);
+
+}
+
+/*
+ * Scan directories from the queue until it is empty and no other thread may
+ * queue new directories.
+ */
+static void * scan_worker(void *arg) {
+
+    scan_state_t *state = (scan_state_t *) arg;
+    scan_dir_t *dir = NULL;
+
+    pthread_mutex_lock(&state->lock);
+
+    while (1) {
+
+        while (state->queue == NULL && state->nb_busy)
+            pthread_cond_wait(&state->cond, &state->lock);
+
+        if (state->queue == NULL)
+            break; /* nothing queued and nobody scanning: done */
+
+        dir = state->queue;
+        state->queue = dir->next;
+        state->nb_busy++;
+        pthread_mutex_unlock(&state->lock);
+
+        scan_dir(state, dir->path);
+        free(dir->path);
+        free(dir);
+
+        pthread_mutex_lock(&state->lock);
+        state->nb_busy--;
+    }
+
+    /* wake up the others so that they stop as well */
+    pthread_cond_broadcast(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+
+    return NULL;
+
+}
+
+/*
+ * Scan the storage root with nb_threads threads.
+ */
+static void scan_storage_root(scan_state_t *state, uint32_t root,
+                              int nb_threads) {
+
+    pthread_t *workers = NULL;
+    int id_thread = 0;
+
+    state->root = root;
+    state->storage_fd = open(whisper_root_dir(root), O_RDONLY|O_DIRECTORY);
+    if (state->storage_fd < 0) {
+        if (errno != ENOENT)
+            error("scan: unable to open storage directory %s: %s",
+                  whisper_root_dir(root), strerror(errno));
+        return;
+    }
+
+    scan_push_dir(state, "");
+
+    workers = calloc(nb_threads, sizeof(pthread_t));
+    for (id_thread = 0; id_thread < nb_threads; id_thread++)
+        if (pthread_create(&workers[id_thread], NULL, scan_worker, state) != 0) {
+            error("error on pthread_create: %s\n", strerror(errno));
+            exit(1);
+        }
+
+    for (id_thread = 0; id_thread < nb_threads; id_thread++)
+        pthread_join(workers[id_thread], NULL);
+
+    close(state->storage_fd);
+    free(workers);
+
+}
+
+/*
+ * Scan the storage roots with conf->startup_scan_threads threads and
+ * registers all the metrics found in database. Returns the number of
+ * metrics registered.
+ */
+uint32_t scan_storage() {
+
+    scan_state_t state;
+    struct timespec start, end;
+    uint32_t root = 0;
+    int nb_threads = conf->startup_scan_threads;
+
+    memset(&state, 0, sizeof(scan_state_t));
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (root = 0; root < whisper_nb_roots(); root++)
+        scan_storage_root(&state, root, nb_threads);
+
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.cond);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    info("startup scan: %u metrics found in %u directories in %.3fs "
+         "with %d threads (%u errors)", state.nb_metrics, state.nb_dirs,
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+         nb_threads, state.nb_errors);
+
+    return state.nb_metrics;
+
+}
@@ -0,0 +1,375 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Snapshot of the cache: on shutdown, the points still in cache are dumped in
+ * a binary file with one sequential write instead of being written in whisper
+ * files one by one. The snapshot is loaded back in cache at startup and then
+ * removed.
+ *
+ * File format, in host byte order:
+ *
+ *   char     magic[8]      "CARBSNAP"
+ *   uint32_t version
+ *   uint32_t number of metrics
+ *   for each metric:
+ *     uint16_t length of name
+ *     char     name[length]
+ *     uint32_t number of points
+ *     points:  uint32_t timestamp, double value
+ *   uint32_t CRC32 of all the above
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>    // PATH_MAX
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "common.h"
+#include "database.h"
+#include "crc32.h"
+#include "wal.h"
+#include "log.h"
+
+#define SNAPSHOT_MAGIC "CARBSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 16
+#define SNAPSHOT_POINT_SIZE (sizeof(uint32_t) + sizeof(double))
+
+static double snapshot_elapsed(struct timespec *start) {
+
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start->tv_sec)
+           + (end.tv_nsec - start->tv_nsec) / 1e9;
+
+}
+
+static void snapshot_path(char *path, const char *suffix) {
+
+    snprintf(path, PATH_MAX, "%s/%s%s", conf->storage_dir, SNAPSHOT_FILE_NAME,
+             suffix);
+
+}
+
+/*
+ * Writes the whole buffer in fd. Returns 0 on success, 1 on error.
+ */
+static int snapshot_write(int fd, const char *buf, size_t len) {
+
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+
+}
+
+/*
+ * Dumps all the points in cache into the snapshot file. Must be called once
+ * all threads are stopped. Returns 0 on success, 1 on error.
+ */
+int snapshot_save() {
+
+    metric_t *metric = NULL;
+    metric_point_t *point = NULL;
+    size_t size = SNAPSHOT_HEADER_SIZE + sizeof(uint32_t), pos = 0;
+    uint32_t nb_metrics = 0, nb_points = 0, version = SNAPSHOT_VERSION, crc = 0;
+    uint16_t name_len = 0;
+    char *buf = NULL;
+    char path[PATH_MAX], tmp_path[PATH_MAX], dir[PATH_MAX];
+    struct timespec start;
+    int fd = -1, dir_fd = -1, rc = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* compute size of the snapshot */
+    for (metric = db->first; metric; metric = metric->next) {
+        if (metric->nb_points == 0)
+            continue;
+        size += sizeof(uint16_t) + strlen(metric->name) + sizeof(uint32_t)
+                + metric->nb_points * SNAPSHOT_POINT_SIZE;
+        nb_metrics++;
+        nb_points += metric->nb_points;
+    }
+
+    /* nothing left in cache, typically after a drain */
+    if (nb_metrics == 0)
+        return 0;
+
+    buf = malloc(size);
+    if (buf == NULL) {
+        error("snapshot: unable to allocate %zu bytes", size);
+        return 1;
+    }
+
+    memcpy(buf, SNAPSHOT_MAGIC, 8);
+    memcpy(buf + 8, &version, sizeof(uint32_t));
+    memcpy(buf + 12, &nb_metrics, sizeof(uint32_t));
+    pos = SNAPSHOT_HEADER_SIZE;
+
+    for (metric = db->first; metric; metric = metric->next) {
+        if (metric->nb_points == 0)
+            continue;
+        name_len = strlen(metric->name);
+        memcpy(buf + pos, &name_len, sizeof(uint16_t));
+        pos += sizeof(uint16_t);
+        memcpy(buf + pos, metric->name, name_len);
+        pos += name_len;
+        memcpy(buf + pos, &metric->nb_points, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        for (point = metric->points; point; point = point->next) {
+            memcpy(buf + pos, &point->timestamp, sizeof(uint32_t));
+            memcpy(buf + pos + sizeof(uint32_t), &point->value, sizeof(double));
+            pos += SNAPSHOT_POINT_SIZE;
+        }
+    }
+
+    crc = crc32_buf(buf, pos);
+    memcpy(buf + pos, &crc, sizeof(uint32_t));
+
+    snapshot_path(path, "");
+    snapshot_path(tmp_path, ".tmp");
+
+    fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd < 0) {
+        error("snapshot: unable to open %s: %s", tmp_path, strerror(errno));
+        free(buf);
+        return 1;
+    }
+
+    if (snapshot_write(fd, buf, size) || fdatasync(fd)) {
+        error("snapshot: error while writing %s: %s", tmp_path,
+              strerror(errno));
+        rc = 1;
+    }
+
+    close(fd);
+    free(buf);
+
+    if (rc) {
+        unlink(tmp_path);
+        return 1;
+    }
+
+    if (rename(tmp_path, path)) {
+        error("snapshot: unable to rename %s: %s", tmp_path, strerror(errno));
+        return 1;
+    }
+
+    /* make the rename durable */
+    strncpy(dir, conf->storage_dir, PATH_MAX - 1);
+    dir[PATH_MAX - 1] = '\0';
+    dir_fd = open(dir, O_RDONLY|O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    info("snapshot: %u points of %u metrics saved in %.3fs (%zu bytes)",
+         nb_points, nb_metrics, snapshot_elapsed(&start), size);
+
+    return 0;
+
+}
+
+/*
+ * Adds the points of a metric read from snapshot in cache. When write-ahead
+ * log is enabled, the points are also logged since the snapshot is removed
+ * once loaded.
+ */
+static void snapshot_load_metric(const char *name, const char *points,
+                                 uint32_t nb_points, char *wal_buf) {
+
+    metric_t *metric = get_or_create_metric(db, name);
+    metric_point_t *point = NULL;
+    uint32_t timestamp = 0, i = 0, first = 0, wal_segment = 0;
+    double value = 0;
+    size_t len = 0;
+
+    while (first < nb_points) {
+
+        /* log points by batches fitting in a record */
+        len = 0;
+        for (i = first; conf->wal_enabled && i < nb_points
+                        && len < WAL_MAX_RECORD - METRIC_NAME_MAX_LEN - 64; i++) {
+            memcpy(&timestamp, points + i * SNAPSHOT_POINT_SIZE, sizeof(uint32_t));
+            memcpy(&value, points + i * SNAPSHOT_POINT_SIZE + sizeof(uint32_t),
+                   sizeof(double));
+            len += snprintf(wal_buf + len, WAL_MAX_RECORD - len,
+                            "%s %.17g %u\n", name, value, timestamp);
+        }
+        if (conf->wal_enabled)
+            wal_append(wal_buf, len, &wal_segment);
+        else
+            i = nb_points;
+
+        for (; first < i; first++) {
+            memcpy(&timestamp, points + first * SNAPSHOT_POINT_SIZE,
+                   sizeof(uint32_t));
+            memcpy(&value, points + first * SNAPSHOT_POINT_SIZE + sizeof(uint32_t),
+                   sizeof(double));
+            point = create_new_metric_point(timestamp, value);
+            point->wal_segment = wal_segment;
+            add_database_metric_point(db, metric, point);
+        }
+    }
+
+}
+
+/*
+ * Loads the snapshot file in cache, if any, and removes it. Must be called
+ * after the write-ahead log is opened, before the receivers and writer
+ * threads are launched. A corrupted snapshot is renamed with a ".corrupt"
+ * suffix and ignored, so that carbond still starts and the file is kept for
+ * inspection. Returns 0 on success or if there is no snapshot, 1 on error.
+ */
+int snapshot_load() {
+
+    char path[PATH_MAX], corrupt_path[PATH_MAX];
+    char name[METRIC_NAME_MAX_LEN];
+    char *buf = NULL, *wal_buf = NULL;
+    struct stat st;
+    struct timespec start;
+    size_t pos = 0, size = 0;
+    ssize_t n = 0;
+    uint32_t version = 0, nb_metrics = 0, nb_points = 0, total_points = 0,
+             crc = 0, i = 0;
+    uint16_t name_len = 0;
+    int fd = -1, rc = 1;
+    bool loaded = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    snapshot_path(path, "");
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        error("snapshot: unable to open %s: %s", path, strerror(errno));
+        return 1;
+    }
+
+    if (fstat(fd, &st)) {
+        error("snapshot: unable to stat %s: %s", path, strerror(errno));
+        goto end;
+    }
+
+    if (st.st_size < SNAPSHOT_HEADER_SIZE + (off_t) sizeof(uint32_t))
+        goto corrupted;
+
+    size = st.st_size;
+    buf = malloc(size);
+    while (pos < size) {
+        n = read(fd, buf + pos, size - pos);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            error("snapshot: error while reading %s", path);
+            goto end;
+        }
+        pos += n;
+    }
+
+    memcpy(&crc, buf + size - sizeof(uint32_t), sizeof(uint32_t));
+    memcpy(&version, buf + 8, sizeof(uint32_t));
+    memcpy(&nb_metrics, buf + 12, sizeof(uint32_t));
+
+    if (memcmp(buf, SNAPSHOT_MAGIC, 8) || version != SNAPSHOT_VERSION
+        || crc32_buf(buf, size - sizeof(uint32_t)) != crc)
+        goto corrupted;
+
+    size -= sizeof(uint32_t);
+    wal_buf = malloc(WAL_MAX_RECORD);
+
+    for (pos = SNAPSHOT_HEADER_SIZE, i = 0; i < nb_metrics; i++) {
+
+        if (pos + sizeof(uint16_t) > size)
+            break;
+        memcpy(&name_len, buf + pos, sizeof(uint16_t));
+        pos += sizeof(uint16_t);
+        if (name_len >= METRIC_NAME_MAX_LEN
+            || pos + name_len + sizeof(uint32_t) > size)
+            break;
+        memcpy(name, buf + pos, name_len);
+        name[name_len] = '\0';
+        pos += name_len;
+        memcpy(&nb_points, buf + pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        if (pos + (size_t) nb_points * SNAPSHOT_POINT_SIZE > size)
+            break;
+
+        snapshot_load_metric(name, buf + pos, nb_points, wal_buf);
+        pos += (size_t) nb_points * SNAPSHOT_POINT_SIZE;
+        total_points += nb_points;
+    }
+
+    if (i < nb_metrics)
+        error("snapshot: %s is truncated, %u metrics loaded out of %u",
+              path, i, nb_metrics);
+
+    info("snapshot: %u points of %u metrics loaded in %.3fs", total_points,
+         i, snapshot_elapsed(&start));
+
+    rc = 0;
+    loaded = true;
+    goto end;
+
+    corrupted:
+        snapshot_path(corrupt_path, ".corrupt");
+        error("snapshot: %s is corrupted, ignoring it and renaming it to %s",
+              path, corrupt_path);
+        if (rename(path, corrupt_path))
+            error("snapshot: unable to rename %s: %s", path, strerror(errno));
+        else
+            rc = 0;
+
+    end:
+        close(fd);
+        free(buf);
+        free(wal_buf);
+
+        /* points are in cache now, and in log if enabled */
+        if (loaded && unlink(path))
+            error("snapshot: unable to remove %s: %s", path, strerror(errno));
+
+        return rc;
+
+}
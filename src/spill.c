@@ -0,0 +1,462 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Spill of cache to disk: when the number of points in cache goes above
+ * CACHE_SPILL_THRESHOLD, the spill thread takes the points of metrics out of
+ * cache and appends them to sequential spill files, one per shard of
+ * metrics, until the cache is back under 3/4 of the threshold. The writer
+ * reloads spilled points, oldest first, once the cache is under half of the
+ * threshold.
+ *
+ * Spilled points are records of a shard file:
+ *
+ *   uint16_t length of metric name
+ *   char     name[length]
+ *   uint32_t number of points
+ *   points:  uint32_t timestamp, uint32_t wal segment, double value
+ *
+ * Spill files are not synced: with write-ahead log enabled, spilled points
+ * are still accounted in their segments and replayed after a crash, and spill
+ * files are reset at startup. Without log, points left in spill files are
+ * reloaded after restart.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>    // PATH_MAX
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "spill.h"
+#include "common.h"
+#include "database.h"
+#include "log.h"
+
+#define SPILL_POINT_SIZE 16
+#define SPILL_READ_SIZE (1024 * 1024)
+
+struct spill_shard_s {
+    int fd;
+    uint64_t read_offset; /* first record not reloaded yet */
+    uint64_t size;
+    uint64_t legacy_end;  /* records written before startup end here */
+    pthread_mutex_t lock;
+};
+
+typedef struct spill_shard_s spill_shard_t;
+
+static spill_shard_t *shards = NULL;
+static uint32_t nb_shards = 0;
+static uint32_t next_reload_shard = 0;
+
+static uint32_t spill_shard_index(const char *name) {
+
+    return fnv1a(FNV1A_INIT, name) % nb_shards;
+
+}
+
+static void spill_account(int64_t nb_points) {
+
+    pthread_mutex_lock(&(monitoring->mutex_spill));
+    monitoring->spilled_points += nb_points;
+    pthread_mutex_unlock(&(monitoring->mutex_spill));
+
+}
+
+/*
+ * Returns the number of points in cache above which it is spilled, lowered
+ * under memory pressure.
+ */
+static uint64_t spill_threshold() {
+
+    if (monitoring->under_pressure)
+        return conf->cache_spill_threshold / 4;
+
+    return conf->cache_spill_threshold;
+
+}
+
+/*
+ * Opens spill files of all shards. Returns 0 on success, 1 on error.
+ */
+int spill_init() {
+
+    char path[PATH_MAX];
+    struct stat st;
+    uint32_t id_shard = 0;
+    uint64_t nb_legacy = 0;
+
+    snprintf(path, PATH_MAX, "%s/%s", conf->storage_dir, SPILL_DIR_NAME);
+    if (mkdir(conf->storage_dir, S_IRWXU | S_IRWXG) && errno != EEXIST) {
+        error("spill: unable to create %s: %s", conf->storage_dir,
+              strerror(errno));
+        return 1;
+    }
+    if (mkdir(path, S_IRWXU) && errno != EEXIST) {
+        error("spill: unable to create %s: %s", path, strerror(errno));
+        return 1;
+    }
+
+    nb_shards = conf->cache_spill_shards;
+    shards = calloc(nb_shards, sizeof(spill_shard_t));
+
+    for (id_shard = 0; id_shard < nb_shards; id_shard++) {
+
+        snprintf(path, PATH_MAX, "%s/%s/%u.spill", conf->storage_dir,
+                 SPILL_DIR_NAME, id_shard);
+
+        shards[id_shard].fd = open(path, O_RDWR|O_CREAT|O_APPEND,
+                                   S_IRUSR|S_IWUSR);
+        if (shards[id_shard].fd < 0 || fstat(shards[id_shard].fd, &st)) {
+            error("spill: unable to open %s: %s", path, strerror(errno));
+            return 1;
+        }
+
+        /* points are replayed from write-ahead log */
+        if (conf->wal_enabled && st.st_size && ftruncate(shards[id_shard].fd, 0)) {
+            error("spill: unable to reset %s: %s", path, strerror(errno));
+            return 1;
+        }
+
+        if (!conf->wal_enabled) {
+            shards[id_shard].size = st.st_size;
+            shards[id_shard].legacy_end = st.st_size;
+            nb_legacy += st.st_size;
+        }
+
+        pthread_mutex_init(&shards[id_shard].lock, NULL);
+    }
+
+    if (nb_legacy)
+        info("spill: %lu bytes of points left by previous run to reload",
+             (unsigned long) nb_legacy);
+
+    return 0;
+
+}
+
+/*
+ * Takes all the points of metric out of cache and appends them to the spill
+ * file of its shard. On error, the partial record is removed from the file
+ * and the points are put back in cache. Returns the number of points spilled.
+ */
+static uint32_t spill_metric(metric_t *metric, char **buf, size_t *buf_size) {
+
+    metric_point_t *points = NULL, *point = NULL, *last = NULL, *next = NULL;
+    uint16_t name_len = strlen(metric->name);
+    uint32_t nb_points = 0;
+    size_t size = 0, pos = 0;
+    spill_shard_t *shard = &shards[spill_shard_index(metric->name)];
+    ssize_t n = 0;
+
+    points = take_metric_points(metric);
+    for (point = points; point; point = point->next, nb_points++)
+        last = point;
+
+    if (nb_points == 0)
+        return 0;
+
+    size = sizeof(uint16_t) + name_len + sizeof(uint32_t)
+           + (size_t) nb_points * SPILL_POINT_SIZE;
+    if (size > *buf_size) {
+        *buf_size = size;
+        *buf = realloc(*buf, size);
+    }
+
+    memcpy(*buf, &name_len, sizeof(uint16_t));
+    pos = sizeof(uint16_t);
+    memcpy(*buf + pos, metric->name, name_len);
+    pos += name_len;
+    memcpy(*buf + pos, &nb_points, sizeof(uint32_t));
+    pos += sizeof(uint32_t);
+
+    for (point = points; point; point = point->next) {
+        memcpy(*buf + pos, &point->timestamp, sizeof(uint32_t));
+        memcpy(*buf + pos + 4, &point->wal_segment, sizeof(uint32_t));
+        memcpy(*buf + pos + 8, &point->value, sizeof(double));
+        pos += SPILL_POINT_SIZE;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    do {
+        n = write(shard->fd, *buf, size);
+    } while (n < 0 && errno == EINTR);
+    if (n == (ssize_t) size)
+        shard->size += size;
+    else if (n > 0 && ftruncate(shard->fd, shard->size))
+        error("spill: unable to truncate spill file: %s", strerror(errno));
+    pthread_mutex_unlock(&shard->lock);
+
+    if (n != (ssize_t) size) {
+        error("spill: error while writing %u points of %s, points kept in "
+              "cache: %s", nb_points, metric->name,
+              n < 0 ? strerror(errno) : "short write");
+        prepend_metric_points(metric, points, last, nb_points);
+        return 0;
+    }
+
+    for (point = points; point; point = next) {
+        next = point->next;
+        free(point);
+    }
+
+    return nb_points;
+
+}
+
+/*
+ * Spills metrics in cache, in order of their creation, until the number of
+ * points in cache is under 3/4 of the threshold.
+ */
+static void spill_cache() {
+
+    metric_t *metric = NULL;
+    uint64_t low_mark = spill_threshold() / 4 * 3;
+    uint64_t nb_spilled = 0;
+    char *buf = NULL;
+    size_t buf_size = 0;
+
+    /* metrics are not evicted while walking the list */
+    pthread_rwlock_rdlock(&(db->lock));
+    for (metric = db->first; metric && db->nb_points > low_mark;
+         metric = metric->next)
+        if (metric->nb_points)
+            nb_spilled += spill_metric(metric, &buf, &buf_size);
+    pthread_rwlock_unlock(&(db->lock));
+
+    free(buf);
+
+    if (nb_spilled) {
+        spill_account(nb_spilled);
+        debug("spill: %lu points spilled", (unsigned long) nb_spilled);
+    }
+
+}
+
+/*
+ * Returns true if there are points in spill files.
+ */
+bool spill_pending() {
+
+    uint32_t id_shard = 0;
+
+    for (id_shard = 0; id_shard < nb_shards; id_shard++)
+        if (shards[id_shard].read_offset < shards[id_shard].size)
+            return true;
+
+    return false;
+
+}
+
+/*
+ * Adds back in cache the points of a record, before the points of the metric
+ * still in cache which are more recent.
+ */
+static void spill_reload_record(const char *name, const char *points,
+                                uint32_t nb_points, bool legacy) {
+
+    metric_t *metric = get_or_create_metric(db, name);
+    metric_point_t *first = NULL, *last = NULL, *point = NULL;
+    uint32_t i = 0;
+
+    for (i = 0; i < nb_points; i++) {
+        point = calloc(1, sizeof(metric_point_t));
+        memcpy(&point->timestamp, points + i * SPILL_POINT_SIZE, sizeof(uint32_t));
+        memcpy(&point->wal_segment, points + i * SPILL_POINT_SIZE + 4, sizeof(uint32_t));
+        memcpy(&point->value, points + i * SPILL_POINT_SIZE + 8, sizeof(double));
+        /* segments of previous run are gone */
+        if (legacy)
+            point->wal_segment = 0;
+        if (last)
+            last->next = point;
+        else
+            first = point;
+        last = point;
+    }
+
+    prepend_metric_points(metric, first, last, nb_points);
+
+}
+
+/*
+ * Reloads in cache the records of the next shard with spilled points, up to
+ * about max_points points.
+ */
+void spill_reload(uint32_t max_points) {
+
+    spill_shard_t *shard = NULL;
+    uint32_t id_shard = 0, nb_points = 0, nb_reloaded = 0;
+    uint16_t name_len = 0;
+    char name[METRIC_NAME_MAX_LEN];
+    char *buf = NULL;
+    size_t buf_size = SPILL_READ_SIZE, len = 0, pos = 0, record_size = 0;
+    ssize_t n = 0;
+
+    for (id_shard = 0; id_shard < nb_shards; id_shard++) {
+        shard = &shards[(next_reload_shard + id_shard) % nb_shards];
+        if (shard->read_offset < shard->size)
+            break;
+    }
+    if (id_shard == nb_shards)
+        return;
+    next_reload_shard = (next_reload_shard + id_shard + 1) % nb_shards;
+
+    buf = malloc(buf_size);
+
+    pthread_mutex_lock(&shard->lock);
+
+    while (nb_reloaded < max_points && shard->read_offset < shard->size) {
+
+        len = shard->size - shard->read_offset;
+        if (len > buf_size)
+            len = buf_size;
+        n = pread(shard->fd, buf, len, shard->read_offset);
+        if (n != (ssize_t) len) {
+            error("spill: error while reading spill file: %s", strerror(errno));
+            break;
+        }
+
+        /* reload complete records of buffer */
+        for (pos = 0; pos + sizeof(uint16_t) <= len; pos += record_size) {
+            memcpy(&name_len, buf + pos, sizeof(uint16_t));
+            if (pos + sizeof(uint16_t) + name_len + sizeof(uint32_t) > len)
+                break;
+            memcpy(&nb_points, buf + pos + sizeof(uint16_t) + name_len,
+                   sizeof(uint32_t));
+            record_size = sizeof(uint16_t) + name_len + sizeof(uint32_t)
+                          + (size_t) nb_points * SPILL_POINT_SIZE;
+            if (pos + record_size > len)
+                break;
+            if (name_len < METRIC_NAME_MAX_LEN) {
+                memcpy(name, buf + pos + sizeof(uint16_t), name_len);
+                name[name_len] = '\0';
+                spill_reload_record(name, buf + pos + record_size
+                                    - (size_t) nb_points * SPILL_POINT_SIZE,
+                                    nb_points,
+                                    shard->read_offset + pos < shard->legacy_end);
+                nb_reloaded += nb_points;
+            }
+        }
+
+        /* incomplete record at end of file, left by a crash */
+        if (pos == 0 && len == shard->size - shard->read_offset) {
+            error("spill: truncated record at end of spill file, %lu bytes "
+                  "dropped", (unsigned long) len);
+            if (ftruncate(shard->fd, shard->read_offset))
+                error("spill: unable to truncate spill file: %s",
+                      strerror(errno));
+            shard->size = shard->read_offset;
+            if (shard->legacy_end > shard->size)
+                shard->legacy_end = shard->size;
+            break;
+        }
+
+        /* first record larger than buffer */
+        if (pos == 0) {
+            buf_size = record_size > buf_size ? record_size : buf_size * 2;
+            buf = realloc(buf, buf_size);
+            continue;
+        }
+
+        shard->read_offset += pos;
+    }
+
+    /* all records reloaded, restart the file from scratch */
+    if (shard->read_offset == shard->size && shard->size) {
+        if (ftruncate(shard->fd, 0))
+            error("spill: unable to truncate spill file: %s", strerror(errno));
+        shard->read_offset = shard->size = shard->legacy_end = 0;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    free(buf);
+
+    if (nb_reloaded) {
+        spill_account(-(int64_t) nb_reloaded);
+        debug("spill: %u points reloaded", nb_reloaded);
+    }
+
+}
+
+/*
+ * Reloads all spilled points in cache, before carbond stops.
+ */
+void spill_reload_all() {
+
+    while (spill_pending())
+        spill_reload(UINT32_MAX);
+
+}
+
+void * spill_thread(void * thread_args) {
+
+    struct spill_thread_args *args = (struct spill_thread_args *) thread_args;
+    carbon_thread_t *me = args->thread;
+
+    block_signals();
+
+    thread_run_lock(me);
+
+    for(;conf->run;) {
+
+        if(thread_must_pause(me)) {
+            thread_pause_and_wait_run_signal(me);
+        }
+
+        if (db->nb_points > spill_threshold())
+            spill_cache();
+
+        usleep(100000);
+    }
+
+    free(args);
+
+    return NULL;
+
+}
+
+carbon_thread_t * launch_spill_thread() {
+
+    carbon_thread_t *thread;
+    struct spill_thread_args *args = NULL;
+
+    thread = calloc(1, sizeof(carbon_thread_t));
+    thread_init(thread, "spill");
+
+    args = malloc(sizeof(struct spill_thread_args));
+    args->id_thread = 0;
+    args->thread = thread;
+
+    if (pthread_create(&(thread->pthread), NULL, spill_thread, (void*)args) != 0) {
+        error("error on pthread_create: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    return thread;
+
+}
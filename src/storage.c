@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <pthread.h>
+#include <stdlib.h> // NULL
+
+#include "storage.h"
+#include "gorilla.h"
+#include "log.h"
+
+static const storage_backend_t whisper_backend = {
+    .name = "whisper",
+    .extension = WHISPER_EXTENSION,
+    .write_points = whisper_write_points,
+    .fetch = whisper_fetch,
+    .register_file = whisper_register_file,
+    .sync_files = whisper_sync_files,
+    .close_files = whisper_close_files,
+};
+
+static const storage_backend_t gorilla_backend = {
+    .name = "gorilla",
+    .extension = GORILLA_EXTENSION,
+    .write_points = gorilla_write_points,
+    .fetch = gorilla_fetch,
+    .register_file = NULL,
+    .sync_files = gorilla_sync_files,
+    .close_files = gorilla_close_files,
+};
+
+const storage_backend_t *storage = &whisper_backend;
+
+/*
+ * Selects the storage backend of conf->storage_engine.
+ */
+void storage_init() {
+
+    if (conf->storage_engine == STORAGE_ENGINE_GORILLA)
+        storage = &gorilla_backend;
+    else
+        storage = &whisper_backend;
+
+    debug("storage engine: %s", storage->name);
+
+}
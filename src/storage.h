@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef CARBON_STORAGE_H
+#define CARBON_STORAGE_H
+
+#include <stdint.h>
+
+#include "common.h"
+#include "whisper.h" // whisper_series_t type
+
+/*
+ * Storage engine of the files of metrics. The writer, the query server and
+ * the startup scan only go through this interface.
+ */
+struct storage_backend_s {
+    const char *name;
+    const char *extension; /* of the files of metrics */
+    /* writes points of metric in its file, returns EXIT_FAILURE on error */
+    int (*write_points)(metric_t *, const uint32_t *, const double *, uint32_t);
+    /* values of metric between from and until, NULL if unknown */
+    whisper_series_t * (*fetch)(const char *, uint32_t, uint32_t);
+    /* caches state of the file of metric found by scan, may be NULL */
+    int (*register_file)(metric_t *, int);
+    /* syncs the files written since last call, returns their number */
+    uint32_t (*sync_files)();
+    /* closes the files kept open, on shutdown */
+    void (*close_files)();
+};
+
+typedef struct storage_backend_s storage_backend_t;
+
+extern const storage_backend_t *storage;
+
+void storage_init();
+
+#endif
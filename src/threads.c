@@ -39,6 +39,7 @@ void block_signals() {
 
     sigemptyset(&set);
     sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
     sigaddset(&set, SIGHUP);
 
     if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
@@ -70,6 +71,9 @@ void thread_init(carbon_thread_t *thread, char *name) {
  */
 static void thread_order_pause(carbon_thread_t *thread) {
 
+    if (thread == NULL) /* thread disabled in conf */
+        return;
+
     debug("ordered pause for thread %s", thread->name);
     thread->must_pause = true;
 
@@ -86,6 +90,9 @@ void thread_run_lock(carbon_thread_t *thread) {
  */
 static void thread_wait_paused(carbon_thread_t *thread) {
 
+    if (thread == NULL)
+        return;
+
     thread_run_lock(thread);
 
 }
@@ -95,6 +102,9 @@ static void thread_wait_paused(carbon_thread_t *thread) {
  */
 static void thread_resume(carbon_thread_t *thread) {
 
+    if (thread == NULL)
+        return;
+
     debug("resuming thread %s", thread->name);
     thread->must_pause = false;
     pthread_cond_signal(&(thread->can_run));
@@ -121,6 +131,9 @@ void thread_pause_and_wait_run_signal(carbon_thread_t *thread) {
  */
 static void thread_wait_stopped(carbon_thread_t *thread) {
 
+    if (thread == NULL)
+        return;
+
     pthread_join(thread->pthread, NULL);
     debug("%s thread stopped.", thread->name);
 
@@ -131,9 +144,18 @@ static void thread_wait_stopped(carbon_thread_t *thread) {
  */
 void threads_wait_all_stopped() {
 
+    int i = 0;
+
     thread_wait_stopped(threads->receiver_udp_thread);
     thread_wait_stopped(threads->receiver_tcp_thread);
-    thread_wait_stopped(threads->writer_thread);
+    for (i = 0; i < threads->nb_writer_threads; i++)
+        thread_wait_stopped(threads->writer_threads[i]);
+    thread_wait_stopped(threads->propagator_thread);
+    thread_wait_stopped(threads->compactor_thread);
+    thread_wait_stopped(threads->spill_thread);
+    thread_wait_stopped(threads->cache_query_thread);
+    for (i = 0; i < threads->nb_query_server_threads; i++)
+        thread_wait_stopped(threads->query_server_threads[i]);
     thread_wait_stopped(threads->monitoring_thread);
     debug("all threads are stopped");
 
@@ -145,15 +167,31 @@ void threads_wait_all_stopped() {
  */
 void threads_pause_all() {
 
+    int i = 0;
+
     debug("pausing all threads");
     thread_order_pause(threads->receiver_udp_thread);
     thread_order_pause(threads->receiver_tcp_thread);
-    thread_order_pause(threads->writer_thread);
+    for (i = 0; i < threads->nb_writer_threads; i++)
+        thread_order_pause(threads->writer_threads[i]);
+    thread_order_pause(threads->propagator_thread);
+    thread_order_pause(threads->compactor_thread);
+    thread_order_pause(threads->spill_thread);
+    thread_order_pause(threads->cache_query_thread);
+    for (i = 0; i < threads->nb_query_server_threads; i++)
+        thread_order_pause(threads->query_server_threads[i]);
     thread_order_pause(threads->monitoring_thread);
 
     thread_wait_paused(threads->receiver_udp_thread);
     thread_wait_paused(threads->receiver_tcp_thread);
-    thread_wait_paused(threads->writer_thread);
+    for (i = 0; i < threads->nb_writer_threads; i++)
+        thread_wait_paused(threads->writer_threads[i]);
+    thread_wait_paused(threads->propagator_thread);
+    thread_wait_paused(threads->compactor_thread);
+    thread_wait_paused(threads->spill_thread);
+    thread_wait_paused(threads->cache_query_thread);
+    for (i = 0; i < threads->nb_query_server_threads; i++)
+        thread_wait_paused(threads->query_server_threads[i]);
     thread_wait_paused(threads->monitoring_thread);
 
 }
@@ -163,10 +201,19 @@ void threads_pause_all() {
  */
 void threads_resume_all() {
 
+    int i = 0;
+
     debug("resuming all threads");
     thread_resume(threads->receiver_udp_thread);
     thread_resume(threads->receiver_tcp_thread);
-    thread_resume(threads->writer_thread);
+    for (i = 0; i < threads->nb_writer_threads; i++)
+        thread_resume(threads->writer_threads[i]);
+    thread_resume(threads->propagator_thread);
+    thread_resume(threads->compactor_thread);
+    thread_resume(threads->spill_thread);
+    thread_resume(threads->cache_query_thread);
+    for (i = 0; i < threads->nb_query_server_threads; i++)
+        thread_resume(threads->query_server_threads[i]);
     thread_resume(threads->monitoring_thread);
 
 }
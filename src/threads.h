@@ -39,7 +39,14 @@ typedef struct carbon_thread_s carbon_thread_t;
 struct carbon_threads_s {
     carbon_thread_t *receiver_udp_thread;
     carbon_thread_t *receiver_tcp_thread;
-    carbon_thread_t *writer_thread;
+    carbon_thread_t **writer_threads; /* one per storage root */
+    int nb_writer_threads;
+    carbon_thread_t *propagator_thread;
+    carbon_thread_t *compactor_thread; /* gorilla storage engine only */
+    carbon_thread_t *spill_thread;
+    carbon_thread_t *cache_query_thread;
+    carbon_thread_t **query_server_threads;
+    int nb_query_server_threads;
     carbon_thread_t *monitoring_thread;
 };
 
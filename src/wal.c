@@ -0,0 +1,637 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Write-ahead log of the points received, so that the points in cache are
+ * not lost on crash.
+ *
+ * Receivers append each message they receive as one record in the current
+ * segment of the log before adding its points in cache, and wait for the
+ * record to be on disk. Concurrent receivers share the same fdatasync() call
+ * (group commit). Records are not delayed to wait for other receivers, so
+ * each receiver pays one sync per message when they do not overlap. Segments
+ * are rotated once they reach the configured size.
+ *
+ * Each point in cache carries the id of the segment of its record. A segment
+ * keeps a count of its points still in cache, decreased by the writer once
+ * the points are written in whisper files. With deferred propagation, the
+ * points whose slots are not propagated yet are held by their metric and
+ * only released by the propagator. Rotated segments without points left in
+ * cache are removed once the storage filesystem is synced.
+ *
+ * At startup, the records of the remaining segments are replayed into the
+ * cache.
+ *
+ * A record is a header followed by the message:
+ *
+ *   uint32_t length of the message
+ *   uint32_t CRC32 of the message
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>    // PATH_MAX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>   // writev()
+#include <sys/syscall.h>
+
+#include "wal.h"
+#include "common.h"
+#include "protocol.h"
+#include "crc32.h"
+#include "log.h"
+#include "whisper.h"
+
+#define WAL_SEGMENT_FORMAT "%010u.wal"
+
+struct wal_record_header_s {
+    uint32_t length;
+    uint32_t crc;
+};
+
+typedef struct wal_record_header_s wal_record_header_t;
+
+/* segment with points possibly still in cache */
+struct wal_segment_s {
+    uint32_t id;
+    int64_t nb_points; /* points of the segment still in cache */
+    bool closed;       /* no more records appended */
+};
+
+typedef struct wal_segment_s wal_segment_t;
+
+struct wal_s {
+    int storage_fd;
+    int dir_fd;
+    int fd;               /* current segment */
+    uint32_t current_id;
+    uint64_t current_size;
+    uint64_t written_seq; /* last record appended */
+    uint64_t synced_seq;  /* last record on disk */
+    bool syncing;         /* a receiver is running fdatasync() */
+    time_t last_truncate;
+    pthread_mutex_t truncate_lock; /* held by the writer truncating the log */
+    wal_segment_t *segments;
+    uint32_t nb_segments;
+    uint32_t size_segments;
+    pthread_mutex_t lock;
+    pthread_cond_t synced;
+};
+
+static struct wal_s wal = {
+    .storage_fd = -1,
+    .dir_fd = -1,
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .truncate_lock = PTHREAD_MUTEX_INITIALIZER,
+    .synced = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Number of points in message, ie. its number of non-empty lines as parsed by
+ * protocol_process_metrics_multiline().
+ */
+static uint32_t wal_count_lines(const char *msg, size_t len) {
+
+    uint32_t nb_lines = 0;
+    size_t i = 0;
+
+    for (i = 0; i < len; i++)
+        if (msg[i] != '\n' && (i == 0 || msg[i-1] == '\n'))
+            nb_lines++;
+
+    return nb_lines;
+
+}
+
+static bool wal_id_in(const uint32_t *ids, uint32_t nb_ids, uint32_t id) {
+
+    uint32_t i = 0;
+
+    for (i = 0; i < nb_ids; i++)
+        if (ids[i] == id)
+            return true;
+
+    return false;
+
+}
+
+/*
+ * Returns the segment with id, NULL if it has already been removed. Must be
+ * called with wal locked.
+ */
+static wal_segment_t * wal_get_segment(uint32_t id) {
+
+    uint32_t i = 0;
+
+    /* segments are sorted by id and few of them are alive */
+    for (i = 0; i < wal.nb_segments; i++)
+        if (wal.segments[i].id == id)
+            return &wal.segments[i];
+
+    return NULL;
+
+}
+
+static wal_segment_t * wal_add_segment(uint32_t id) {
+
+    if (wal.nb_segments == wal.size_segments) {
+        wal.size_segments = wal.size_segments ? wal.size_segments * 2 : 8;
+        wal.segments = realloc(wal.segments,
+                               wal.size_segments * sizeof(wal_segment_t));
+    }
+
+    wal.segments[wal.nb_segments].id = id;
+    wal.segments[wal.nb_segments].nb_points = 0;
+    wal.segments[wal.nb_segments].closed = false;
+
+    return &wal.segments[wal.nb_segments++];
+
+}
+
+/*
+ * Opens a new segment and makes it the current one. Must be called with wal
+ * locked. Returns 0 on success, 1 on error.
+ */
+static int wal_open_segment(uint32_t id) {
+
+    char name[32];
+
+    snprintf(name, sizeof(name), WAL_SEGMENT_FORMAT, id);
+
+    wal.fd = openat(wal.dir_fd, name, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND,
+                    S_IRUSR|S_IWUSR);
+    if (wal.fd < 0) {
+        error("wal: unable to open segment %s: %s", name, strerror(errno));
+        return 1;
+    }
+
+    /* make the new segment entry durable in directory */
+    fsync(wal.dir_fd);
+
+    wal.current_id = id;
+    wal.current_size = 0;
+    wal_add_segment(id);
+
+    debug("wal: opened segment %s", name);
+
+    return 0;
+
+}
+
+/*
+ * Closes the current segment once all its records are on disk and opens the
+ * next one. Must be called with wal locked.
+ */
+static int wal_rotate() {
+
+    wal_segment_t *segment = NULL;
+
+    while (wal.syncing)
+        pthread_cond_wait(&wal.synced, &wal.lock);
+
+    if (fdatasync(wal.fd))
+        error("wal: error on fdatasync(): %s", strerror(errno));
+    wal.synced_seq = wal.written_seq;
+    close(wal.fd);
+    wal.fd = -1;
+
+    segment = wal_get_segment(wal.current_id);
+    if (segment)
+        segment->closed = true;
+
+    return wal_open_segment(wal.current_id + 1);
+
+}
+
+/*
+ * Appends the message as a record of the current segment and waits for it to
+ * be on disk. The points of the message are accounted in the segment, whose
+ * id is set in segment. Returns 0 on success, 1 on error.
+ */
+int wal_append(const char *msg, size_t len, uint32_t *segment) {
+
+    wal_record_header_t header;
+    struct iovec iov[2];
+    uint64_t seq = 0, target = 0;
+    ssize_t n = 0;
+    int fd = -1, rc = 0;
+    wal_segment_t *cur_segment = NULL;
+
+    *segment = 0;
+
+    if (len == 0 || len > WAL_MAX_RECORD)
+        return 1;
+
+    header.length = len;
+    header.crc = crc32_buf(msg, len);
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *) msg;
+    iov[1].iov_len = len;
+
+    pthread_mutex_lock(&wal.lock);
+
+    if (wal.fd < 0) {
+        pthread_mutex_unlock(&wal.lock);
+        return 1;
+    }
+
+    if (wal.current_size >= (uint64_t) conf->wal_segment_size * 1024 * 1024
+        && wal_rotate()) {
+        pthread_mutex_unlock(&wal.lock);
+        return 1;
+    }
+
+    do {
+        n = writev(wal.fd, iov, 2);
+    } while (n < 0 && errno == EINTR);
+
+    if (n != (ssize_t) (sizeof(header) + len)) {
+        error("wal: error while appending record: %s", strerror(errno));
+        pthread_mutex_unlock(&wal.lock);
+        return 1;
+    }
+
+    wal.current_size += n;
+    seq = ++wal.written_seq;
+
+    cur_segment = wal_get_segment(wal.current_id);
+    cur_segment->nb_points += wal_count_lines(msg, len);
+    *segment = wal.current_id;
+
+    /* group commit: one receiver syncs the records of all the others */
+    while (wal.synced_seq < seq) {
+        if (wal.syncing) {
+            pthread_cond_wait(&wal.synced, &wal.lock);
+            continue;
+        }
+        wal.syncing = true;
+        target = wal.written_seq;
+        fd = wal.fd;
+        pthread_mutex_unlock(&wal.lock);
+
+        if (fdatasync(fd)) {
+            error("wal: error on fdatasync(): %s", strerror(errno));
+            rc = 1;
+        }
+
+        pthread_mutex_lock(&wal.lock);
+        wal.syncing = false;
+        if (target > wal.synced_seq)
+            wal.synced_seq = target;
+        pthread_cond_broadcast(&wal.synced);
+    }
+
+    pthread_mutex_unlock(&wal.lock);
+
+    return rc;
+
+}
+
+/*
+ * Accounts nb_points points of segment that are no longer in cache.
+ */
+void wal_release(uint32_t segment_id, uint32_t nb_points) {
+
+    wal_segment_t *segment = NULL;
+
+    if (segment_id == 0 || nb_points == 0)
+        return;
+
+    pthread_mutex_lock(&wal.lock);
+    segment = wal_get_segment(segment_id);
+    if (segment)
+        segment->nb_points -= nb_points;
+    pthread_mutex_unlock(&wal.lock);
+
+}
+
+/*
+ * Keeps nb_points points of segment, written in the whisper file of metric,
+ * in the log until the propagation of its pending slots, see
+ * wal_release_held(). Must be called with the metric locked.
+ */
+void wal_hold(metric_t *m, uint32_t segment_id, uint32_t nb_points) {
+
+    if (segment_id == 0 || nb_points == 0)
+        return;
+
+    if (m->nb_wal_held && m->wal_held[m->nb_wal_held-1].segment == segment_id) {
+        m->wal_held[m->nb_wal_held-1].nb_points += nb_points;
+        return;
+    }
+
+    if (m->nb_wal_held == m->size_wal_held) {
+        m->size_wal_held = m->size_wal_held ? m->size_wal_held * 2 : 4;
+        m->wal_held = realloc(m->wal_held,
+                              m->size_wal_held * sizeof(struct metric_wal_hold));
+    }
+
+    m->wal_held[m->nb_wal_held].segment = segment_id;
+    m->wal_held[m->nb_wal_held].nb_points = nb_points;
+    m->nb_wal_held++;
+
+}
+
+/*
+ * Releases the points held by metric once its pending slots are propagated.
+ * If the propagation failed, they are forgotten without being released, so
+ * that they are replayed at next start. Must be called with the metric
+ * locked.
+ */
+void wal_release_held(metric_t *m, bool propagated) {
+
+    uint32_t i = 0;
+
+    if (propagated)
+        for (i = 0; i < m->nb_wal_held; i++)
+            wal_release(m->wal_held[i].segment, m->wal_held[i].nb_points);
+
+    m->nb_wal_held = 0;
+
+}
+
+/*
+ * Removes the closed segments without points left in cache. The storage
+ * filesystems are synced first so that their points are durably in whisper
+ * files. Must be called with truncate_lock held.
+ */
+static void wal_truncate_segments() {
+
+    uint32_t *ids = NULL;
+    uint32_t nb_ids = 0, i = 0, nb_alive = 0;
+    char name[32];
+
+    pthread_mutex_lock(&wal.lock);
+    ids = malloc(sizeof(uint32_t) * (wal.nb_segments + 1));
+    for (i = 0; i < wal.nb_segments; i++)
+        if (wal.segments[i].closed && wal.segments[i].nb_points <= 0)
+            ids[nb_ids++] = wal.segments[i].id;
+    pthread_mutex_unlock(&wal.lock);
+
+    if (nb_ids == 0) {
+        free(ids);
+        return;
+    }
+
+    if (syscall(SYS_syncfs, wal.storage_fd)) {
+        error("wal: error on syncfs(): %s", strerror(errno));
+        free(ids);
+        return;
+    }
+
+    /* whisper files may be on other filesystems */
+    if (conf->nb_storage_dirs && whisper_syncfs_roots()) {
+        free(ids);
+        return;
+    }
+
+    for (i = 0; i < nb_ids; i++) {
+        snprintf(name, sizeof(name), WAL_SEGMENT_FORMAT, ids[i]);
+        if (unlinkat(wal.dir_fd, name, 0))
+            error("wal: unable to remove segment %s: %s", name,
+                  strerror(errno));
+        else
+            debug("wal: removed segment %s", name);
+    }
+
+    /* forget the removed segments */
+    pthread_mutex_lock(&wal.lock);
+    for (i = 0; i < wal.nb_segments; i++) {
+        if (wal_id_in(ids, nb_ids, wal.segments[i].id))
+            continue;
+        wal.segments[nb_alive++] = wal.segments[i];
+    }
+    wal.nb_segments = nb_alive;
+    pthread_mutex_unlock(&wal.lock);
+
+    free(ids);
+
+}
+
+/*
+ * Truncates the log, unless it has already been done in the last second or
+ * another writer is truncating it.
+ */
+void wal_truncate() {
+
+    time_t now = time(NULL);
+
+    if (wal.fd < 0 || now == wal.last_truncate)
+        return;
+
+    if (pthread_mutex_trylock(&wal.truncate_lock))
+        return;
+
+    wal.last_truncate = now;
+    wal_truncate_segments();
+
+    pthread_mutex_unlock(&wal.truncate_lock);
+
+}
+
+/*
+ * Replays the records of segment into cache. Reading stops at the first
+ * truncated or corrupted record, which is the end of the log after a crash.
+ * Returns the number of points replayed.
+ */
+static uint32_t wal_replay_segment(uint32_t id) {
+
+    char name[32];
+    char *msg = malloc(WAL_MAX_RECORD + 1);
+    wal_record_header_t header;
+    wal_segment_t *segment = wal_add_segment(id);
+    uint32_t nb_points = 0, nb_lines = 0;
+    int fd = -1;
+
+    segment->closed = true;
+
+    snprintf(name, sizeof(name), WAL_SEGMENT_FORMAT, id);
+    fd = openat(wal.dir_fd, name, O_RDONLY);
+    if (fd < 0) {
+        error("wal: unable to open segment %s: %s", name, strerror(errno));
+        free(msg);
+        return 0;
+    }
+
+    while (read(fd, &header, sizeof(header)) == sizeof(header)) {
+
+        if (header.length == 0 || header.length > WAL_MAX_RECORD
+            || read(fd, msg, header.length) != header.length
+            || crc32_buf(msg, header.length) != header.crc) {
+            warning("wal: segment %s truncated or corrupted, ignoring its end",
+                    name);
+            break;
+        }
+
+        msg[header.length] = '\0';
+        nb_lines = wal_count_lines(msg, header.length);
+        segment->nb_points += nb_lines;
+        nb_points += nb_lines;
+        protocol_process_metrics_multiline(msg, id);
+    }
+
+    close(fd);
+    free(msg);
+
+    return nb_points;
+
+}
+
+static int compare_ids(const void *a, const void *b) {
+
+    uint32_t ia = *(const uint32_t *)a,
+             ib = *(const uint32_t *)b;
+
+    return (ia > ib) - (ia < ib);
+
+}
+
+/*
+ * Opens the log in storage directory, replays its segments into cache and
+ * starts a new segment. Must be called before receivers and writer threads
+ * are launched. Returns 0 on success, 1 on error.
+ */
+int wal_init() {
+
+    DIR *dirp = NULL;
+    struct dirent *entry = NULL;
+    uint32_t *ids = NULL;
+    uint32_t nb_ids = 0, size_ids = 0, id = 0, i = 0, nb_points = 0;
+    char suffix[8];
+    int rc = 0;
+
+    if (mkdir(conf->storage_dir, S_IRWXU | S_IRWXG) && errno != EEXIST) {
+        error("wal: unable to create %s: %s", conf->storage_dir,
+              strerror(errno));
+        return 1;
+    }
+
+    wal.storage_fd = open(conf->storage_dir, O_RDONLY|O_DIRECTORY);
+    if (wal.storage_fd < 0) {
+        error("wal: unable to open %s: %s", conf->storage_dir,
+              strerror(errno));
+        return 1;
+    }
+
+    if (mkdirat(wal.storage_fd, WAL_DIR_NAME, S_IRWXU) && errno != EEXIST) {
+        error("wal: unable to create log directory: %s", strerror(errno));
+        return 1;
+    }
+
+    wal.dir_fd = openat(wal.storage_fd, WAL_DIR_NAME, O_RDONLY|O_DIRECTORY);
+    if (wal.dir_fd < 0) {
+        error("wal: unable to open log directory: %s", strerror(errno));
+        return 1;
+    }
+
+    /* list existing segments */
+    dirp = fdopendir(dup(wal.dir_fd));
+    while (dirp && (entry = readdir(dirp))) {
+        if (sscanf(entry->d_name, "%u%7s", &id, suffix) != 2
+            || strcmp(suffix, ".wal") != 0 || id == 0)
+            continue;
+        if (nb_ids == size_ids) {
+            size_ids = size_ids ? size_ids * 2 : 16;
+            ids = realloc(ids, size_ids * sizeof(uint32_t));
+        }
+        ids[nb_ids++] = id;
+    }
+    if (dirp)
+        closedir(dirp);
+
+    qsort(ids, nb_ids, sizeof(uint32_t), compare_ids);
+
+    for (i = 0; i < nb_ids; i++)
+        nb_points += wal_replay_segment(ids[i]);
+
+    if (nb_ids)
+        info("wal: %u points replayed from %u segments", nb_points, nb_ids);
+
+    pthread_mutex_lock(&wal.lock);
+    rc = wal_open_segment(nb_ids ? ids[nb_ids-1] + 1 : 1);
+    pthread_mutex_unlock(&wal.lock);
+
+    free(ids);
+
+    return rc;
+
+}
+
+/*
+ * Syncs and closes the current segment. Segments are kept for replay at next
+ * startup.
+ */
+void wal_close() {
+
+    pthread_mutex_lock(&wal.lock);
+
+    if (wal.fd >= 0) {
+        if (fdatasync(wal.fd))
+            error("wal: error on fdatasync(): %s", strerror(errno));
+        close(wal.fd);
+        wal.fd = -1;
+    }
+
+    pthread_mutex_unlock(&wal.lock);
+
+}
+
+/*
+ * Closes the log and removes all its segments, once the storage filesystem
+ * is synced. Used when all the points in cache are saved elsewhere.
+ */
+void wal_remove_all() {
+
+    uint32_t i = 0;
+    char name[32];
+
+    wal_close();
+
+    if (syscall(SYS_syncfs, wal.storage_fd)) {
+        error("wal: error on syncfs(): %s", strerror(errno));
+        return;
+    }
+
+    pthread_mutex_lock(&wal.lock);
+
+    for (i = 0; i < wal.nb_segments; i++) {
+        snprintf(name, sizeof(name), WAL_SEGMENT_FORMAT, wal.segments[i].id);
+        if (unlinkat(wal.dir_fd, name, 0) && errno != ENOENT)
+            error("wal: unable to remove segment %s: %s", name,
+                  strerror(errno));
+    }
+    wal.nb_segments = 0;
+
+    pthread_mutex_unlock(&wal.lock);
+
+    debug("wal: all segments removed");
+
+}
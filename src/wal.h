@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2014 - Rémi Palancher <remi@rezib.org>
+ *
+ * This file is part of carbond, an implementation in C of Graphite
+ * carbon daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef CARBON_WAL_H
+#define CARBON_WAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+#define WAL_DIR_NAME ".wal"
+#define WAL_MAX_RECORD 65536
+
+int wal_init();
+int wal_append(const char *, size_t, uint32_t *);
+void wal_release(uint32_t, uint32_t);
+void wal_hold(metric_t *, uint32_t, uint32_t);
+void wal_release_held(metric_t *, bool);
+void wal_truncate();
+void wal_close();
+void wal_remove_all();
+
+#endif
@@ -33,10 +33,17 @@
 #include <sys/types.h> // stat()
 #include <sys/stat.h>  // stat()
 #include <assert.h>
+#include <math.h>      // NAN
 #include <pcre.h>
 #include <pthread.h>   // pthread_mutex_[un]lock()
+#include <time.h>      // time()
+#include <sys/syscall.h> // SYS_syncfs
+#include <dirent.h>    // opendir()
+#include <sys/file.h>  // flock()
 #include "common.h"
 #include "whisper.h"
+#include "aggregation.h"
+#include "codec.h"
 
 
 static inline void hton_whisper_metadata(whisper_metadata_t *wsp_md) {
@@ -239,30 +246,6 @@ static archive_info_t * whisper_read_archive_info(int whisper_fd, int archive_id
 
 }
 
-/*
- * Read archive point w/o seeking
- */
-
-static archive_point_t * whisper_read_archive_point(int whisper_fd) {
-
-    archive_point_t *arch_pt = calloc(1, WHISPER_POINT_SIZE);
-
-    if (read(whisper_fd, &(arch_pt->timestamp), sizeof(uint32_t)) < 0) {
-        error("error while reading file: %s\n", strerror(errno));
-        return NULL;
-    }
-
-    if (read(whisper_fd, &(arch_pt->value), sizeof(double)) < 0) {
-        error("error while reading file: %s\n", strerror(errno));
-        return NULL;
-    }
-
-    ntoh_archive_point(arch_pt);
-
-    return arch_pt;
-
-}
-
 /*
  * Tests if pattern matches str. Returns:
  *   - 0 if matches
@@ -308,7 +291,7 @@ static int whisper_pattern_match(const char *pattern, const char *str) {
  * matches metric name and returns its retention_t list.
  * Returns NULL if not found or on error.
  */
-static retention_t * whisper_find_retention(const metric_t *metric) {
+retention_t * whisper_find_retention(const metric_t *metric) {
 
     const pattern_retention_t *cur_patret = conf->schema;
     int match = 0;
@@ -333,7 +316,7 @@ static retention_t * whisper_find_retention(const metric_t *metric) {
  * matches metric name.
  * Returns NULL if not found or on error.
  */
-static pattern_aggregation_t * whisper_find_aggregation(const metric_t *metric) {
+pattern_aggregation_t * whisper_find_aggregation(const metric_t *metric) {
 
     pattern_aggregation_t *agg = conf->aggregation;
     int match = 0;
@@ -387,25 +370,349 @@ static void create_dir(char * dir_name) {
 
 }
 
-static char * whisper_metric_filename(const metric_t *metric) {
+/*
+ * Returns the number of storage roots whisper files are spread over.
+ */
+uint32_t whisper_nb_roots() {
+
+    return conf->nb_storage_dirs ? conf->nb_storage_dirs : 1;
+
+}
+
+/*
+ * Returns the directory of storage root.
+ */
+const char * whisper_root_dir(uint32_t root) {
+
+    return conf->nb_storage_dirs ? conf->storage_dirs[root] : conf->storage_dir;
+
+}
+
+/*
+ * Returns the storage root of metric by rendezvous hashing: the name is hashed
+ * with the directory of each root and the root with the highest score wins.
+ * Adding a root only moves to it the metrics it wins, the others stay where
+ * they are whatever the order of the roots.
+ */
+uint32_t whisper_metric_root(const char *metric_name) {
+
+    uint32_t name_hash = 0, score = 0, max_score = 0, root = 0, i = 0;
+
+    if (conf->nb_storage_dirs < 2)
+        return 0;
+
+    name_hash = fnv1a(FNV1A_INIT, metric_name);
+
+    for (i = 0; i < conf->nb_storage_dirs; i++) {
+        /* continued on the directory, then mixed by murmur3 finalizer */
+        score = fnv1a(name_hash, conf->storage_dirs[i]);
+        score ^= score >> 16;
+        score *= 0x85ebca6bu;
+        score ^= score >> 13;
+        score *= 0xc2b2ae35u;
+        score ^= score >> 16;
+        if (i == 0 || score > max_score) {
+            max_score = score;
+            root = i;
+        }
+    }
+
+    return root;
+
+}
+
+/* number of fan-out directories of leaves in each storage root, 0 if none */
+static uint32_t *wsp_fanout = NULL;
+
+static uint32_t whisper_root_fanout(uint32_t root) {
+
+    return wsp_fanout ? wsp_fanout[root] : 0;
+
+}
+
+/*
+ * Returns true if name is the name of a fan-out directory, whatever the
+ * layout of the storage root. Metric names cannot start with a dot.
+ */
+bool whisper_is_fanout_dir(const char *name) {
+
+    return strlen(name) == WHISPER_FANOUT_NAME_LEN - 1 && name[0] == '.'
+           && strspn(name + 1, "0123456789abcdef") == WHISPER_FANOUT_NAME_LEN - 2;
+
+}
+
+/*
+ * Recursively calls callback with the path and the metric name of the files
+ * with extension found in directory, prefix being the metric name of the
+ * directory. Fan-out directories are transparent. dir and prefix are
+ * restored on return, they must have room for PATH_MAX and
+ * METRIC_NAME_MAX_LEN bytes. Returns the number of directories which could
+ * not be opened, missing ones aside.
+ */
+uint32_t whisper_scan_dir(char *dir, char *prefix, const char *extension,
+                          whisper_scan_cb_t callback, void *data) {
+
+    DIR *dirp = opendir(dir);
+    struct dirent *entry = NULL;
+    struct stat st;
+    size_t dir_len = strlen(dir), prefix_len = strlen(prefix), name_len = 0,
+           ext_len = strlen(extension);
+    uint32_t nb_errors = 0;
+    bool is_dir = false;
+
+    if (dirp == NULL) {
+        if (errno == ENOENT)
+            return 0;
+        error("unable to open directory %s: %s", dir, strerror(errno));
+        return 1;
+    }
+
+    while ((entry = readdir(dirp))) {
+
+        if (entry->d_name[0] == '.' && !whisper_is_fanout_dir(entry->d_name))
+            continue;
+
+        name_len = strlen(entry->d_name);
+        if (dir_len + name_len + 2 > PATH_MAX ||
+            prefix_len + name_len + 2 > METRIC_NAME_MAX_LEN)
+            continue;
+
+        if (entry->d_type == DT_UNKNOWN) {
+            if (fstatat(dirfd(dirp), entry->d_name, &st, 0))
+                continue;
+            is_dir = S_ISDIR(st.st_mode);
+        } else
+            is_dir = (entry->d_type == DT_DIR);
+
+        sprintf(dir + dir_len, "/%s", entry->d_name);
+
+        /* leaves of fan-out directories belong to this directory */
+        if (entry->d_name[0] == '.') {
+            if (is_dir)
+                nb_errors += whisper_scan_dir(dir, prefix, extension,
+                                              callback, data);
+            dir[dir_len] = '\0';
+            continue;
+        }
+
+        if (prefix_len)
+            sprintf(prefix + prefix_len, ".%s", entry->d_name);
+        else
+            strcpy(prefix, entry->d_name);
+
+        if (is_dir)
+            nb_errors += whisper_scan_dir(dir, prefix, extension, callback,
+                                          data);
+        else if (name_len > ext_len &&
+                 strcmp(entry->d_name + name_len - ext_len, extension) == 0) {
+            prefix[strlen(prefix) - ext_len] = '\0';
+            callback(dir, prefix, data);
+        }
+
+        dir[dir_len] = '\0';
+        prefix[prefix_len] = '\0';
+    }
+
+    closedir(dirp);
+
+    return nb_errors;
+
+}
+
+/*
+ * Writes in bucket the name of the fan-out directory of leaf in storage root.
+ * Returns false if the root has a plain layout.
+ */
+static bool whisper_fanout_bucket(uint32_t root, const char *leaf,
+                                  char *bucket) {
+
+    uint32_t hash = 0, fanout = whisper_root_fanout(root);
+
+    if (fanout == 0)
+        return false;
+
+    hash = fnv1a(FNV1A_INIT, leaf);
+
+    /* fanout is at most WHISPER_FANOUT_MAX, 3 hex digits */
+    snprintf(bucket, WHISPER_FANOUT_NAME_LEN, ".%03x", (hash % fanout) & 0xfff);
+
+    return true;
+
+}
+
+/*
+ * Returns true if directory does not exist or holds no metric yet.
+ */
+static bool whisper_root_is_empty(const char *dir) {
+
+    DIR *dirp = opendir(dir);
+    struct dirent *entry = NULL;
+    bool empty = true;
+
+    if (dirp == NULL)
+        return true;
+
+    while (empty && (entry = readdir(dirp)))
+        if (entry->d_name[0] != '.')
+            empty = false;
+
+    closedir(dirp);
+
+    return empty;
+
+}
+
+/*
+ * Reads the layout of each storage root from its marker file. A root without
+ * marker file gets the fan-out of conf->storage_fanout if it holds no metric
+ * yet, else it keeps the plain layout its files were written with. The layout
+ * of a root never changes afterwards. Returns 0 on success, 1 on error.
+ */
+int whisper_layout_init() {
+
+    char path[PATH_MAX];
+    const char *dir = NULL;
+    uint32_t root = 0, fanout = 0;
+    FILE *fh = NULL;
+
+    free(wsp_fanout);
+    wsp_fanout = calloc(whisper_nb_roots(), sizeof(uint32_t));
+
+    for (root = 0; root < whisper_nb_roots(); root++) {
+
+        dir = whisper_root_dir(root);
+        snprintf(path, PATH_MAX, "%s/%s", dir, WHISPER_LAYOUT_FILE);
+        fanout = 0;
+
+        fh = fopen(path, "r");
+        if (fh) {
+            if (fscanf(fh, "fanout %" SCNu32, &fanout) != 1
+                || fanout > WHISPER_FANOUT_MAX) {
+                error("invalid layout marker file %s", path);
+                fclose(fh);
+                return 1;
+            }
+            fclose(fh);
+            if (fanout != conf->storage_fanout)
+                info("storage root %s has a fan-out of %" PRIu32 ", "
+                     "STORAGE_FANOUT ignored", dir, fanout);
+        } else if (errno != ENOENT) {
+            error("unable to open %s: %s", path, strerror(errno));
+            return 1;
+        } else if (conf->storage_fanout && whisper_root_is_empty(dir)) {
+            fanout = conf->storage_fanout;
+            create_dir((char *) dir);
+            fh = fopen(path, "w");
+            if (fh == NULL || fprintf(fh, "fanout %" PRIu32 "\n", fanout) < 0
+                || fclose(fh)) {
+                error("unable to write layout marker file %s: %s", path,
+                      strerror(errno));
+                return 1;
+            }
+        } else if (conf->storage_fanout)
+            info("storage root %s already has metrics in plain layout, "
+                 "STORAGE_FANOUT ignored", dir);
+
+        wsp_fanout[root] = fanout;
+        debug("storage root %s fan-out: %" PRIu32, dir, fanout);
+    }
+
+    return 0;
+
+}
+
+/*
+ * Takes an exclusive lock on the lock file of each storage root, held until
+ * the process exits. carbond and the offline tools (carbond-resize,
+ * carbond-import) keep layouts, bases and file descriptors cached, so they
+ * must not work on the same roots at the same time. Returns 0 on success, 1
+ * if a root is locked by another process or cannot be locked.
+ */
+int whisper_lock_roots() {
+
+    char path[PATH_MAX];
+    const char *dir = NULL;
+    uint32_t root = 0;
+    int fd = -1;
+
+    for (root = 0; root < whisper_nb_roots(); root++) {
+
+        dir = whisper_root_dir(root);
+        create_dir((char *) dir);
+        snprintf(path, PATH_MAX, "%s/%s", dir, WHISPER_LOCK_FILE);
+
+        fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+        if (fd < 0) {
+            error("unable to open lock file %s: %s", path, strerror(errno));
+            return 1;
+        }
+        if (flock(fd, LOCK_EX|LOCK_NB)) {
+            if (errno == EWOULDBLOCK)
+                error("storage root %s is in use by another carbond process, "
+                      "stop it first", dir);
+            else
+                error("unable to lock %s: %s", path, strerror(errno));
+            close(fd);
+            return 1;
+        }
+        /* the fd is never closed, the lock is released at exit */
+    }
+
+    return 0;
+
+}
+
+/*
+ * Syncs the filesystems of all the storage roots. Returns 0 on success, 1 if
+ * one of them could not be synced.
+ */
+int whisper_syncfs_roots() {
+
+    uint32_t root = 0;
+    int root_fd = -1, rc = 0;
+
+    for (root = 0; root < whisper_nb_roots(); root++) {
+        root_fd = open(whisper_root_dir(root), O_RDONLY|O_DIRECTORY);
+        if (root_fd < 0 || syscall(SYS_syncfs, root_fd)) {
+            error("error on syncfs() of %s: %s", whisper_root_dir(root),
+                  strerror(errno));
+            rc = 1;
+        }
+        if (root_fd >= 0)
+            close(root_fd);
+    }
+
+    return rc;
+
+}
+
+/*
+ * Returns the full path of the file of metric with extension, in its storage
+ * root. The returned string must be freed.
+ */
+char * whisper_metric_filename(const char *metric_name, const char *extension) {
 
     char metric_name_cpy[METRIC_NAME_MAX_LEN];
     char *metric_substr_next,
          *metric_substr_last,
          *saveptr;
     char *tmp_dir_name = malloc(sizeof(char)*PATH_MAX);
+    char bucket[WHISPER_FANOUT_NAME_LEN];
+    const char *root_dir = NULL;
+    uint32_t root = whisper_metric_root(metric_name);
 
     char *res_filename = malloc(sizeof(char)*PATH_MAX);
     memset(res_filename, 0, sizeof(char)*PATH_MAX);
 
-    strncpy(tmp_dir_name, conf->storage_dir, strlen(conf->storage_dir)+1);
+    root_dir = whisper_root_dir(root);
+    strncpy(tmp_dir_name, root_dir, strlen(root_dir)+1);
     /* TODO: handle relative path with:
     if (realpath(".", tmp_dir_name) == NULL) {
         error("error during realpath(): %s\n", strerror(errno));
     }
     */
 
-    strncpy(metric_name_cpy, metric->name, METRIC_NAME_MAX_LEN);
+    strncpy(metric_name_cpy, metric_name, METRIC_NAME_MAX_LEN);
     metric_substr_next = strtok_r(metric_name_cpy, ".", &saveptr);
     metric_substr_last = metric_substr_next;
 
@@ -417,8 +724,15 @@ static char * whisper_metric_filename(const metric_t *metric) {
         metric_substr_next = strtok_r(NULL, ".", &saveptr);
 
         if(metric_substr_next == NULL) { /* last is the filename */
-            strncpy(res_filename, tmp_dir_name, strlen(tmp_dir_name)); 
-            strncat(res_filename, ".wsp", 4);
+            if (whisper_fanout_bucket(root, metric_substr_last, bucket)) {
+                /* in fan-out directory of its parent */
+                snprintf(res_filename, PATH_MAX, "%.*s/%s/%s%s",
+                         (int) (strlen(tmp_dir_name) - strlen(metric_substr_last) - 1),
+                         tmp_dir_name, bucket, metric_substr_last, extension);
+            } else {
+                strncpy(res_filename, tmp_dir_name, strlen(tmp_dir_name)); 
+                strncat(res_filename, extension, strlen(extension));
+            }
         }
 
         metric_substr_last = metric_substr_next;
@@ -430,13 +744,18 @@ static char * whisper_metric_filename(const metric_t *metric) {
 
 }
 
-static void whisper_create_dirs(const metric_t *metric) {
+/*
+ * Creates the missing directories of the file of metric in its storage root.
+ */
+void whisper_create_dirs(const metric_t *metric) {
 
     char metric_name_cpy[METRIC_NAME_MAX_LEN];
     char * metric_substr_next, * metric_substr_last, * saveptr;
     char * tmp_dir_name = malloc(sizeof(char) * PATH_MAX);
+    char bucket[WHISPER_FANOUT_NAME_LEN];
+    const char *root_dir = whisper_root_dir(metric->storage_root);
 
-    strncpy(tmp_dir_name, conf->storage_dir, strlen(conf->storage_dir)+1);
+    strncpy(tmp_dir_name, root_dir, strlen(root_dir)+1);
     /* TODO: handle relative path with:
     if (realpath(".", tmp_dir_name) == NULL) {
         error("error during realpath(): %s\n", strerror(errno));
@@ -459,6 +778,12 @@ static void whisper_create_dirs(const metric_t *metric) {
         if(metric_substr_next != NULL) {
             /* there is a non-null string after last, last is a dir */
             create_dir(tmp_dir_name);
+        } else if (whisper_fanout_bucket(metric->storage_root,
+                                         metric_substr_last, bucket)) {
+            /* last is the filename, in fan-out directory of its parent */
+            tmp_dir_name[strlen(tmp_dir_name) - strlen(metric_substr_last)] = '\0';
+            strncat(tmp_dir_name, bucket, WHISPER_FANOUT_NAME_LEN);
+            create_dir(tmp_dir_name);
         }
 
         metric_substr_last = metric_substr_next;
@@ -467,6 +792,298 @@ static void whisper_create_dirs(const metric_t *metric) {
     free(tmp_dir_name);
 
 }
+
+/* number of buckets of the hash table of directories */
+#define WHISPER_DIRS_BUCKETS 4096
+
+/*
+ * Directories of the metrics tree kept open, in LRU order, so that whisper
+ * files are opened and created relative to their directory without walking
+ * their full path. A directory is only closed when no thread is using it.
+ */
+struct whisper_dir_s {
+    uint32_t root;
+    char *path;    /* relative to storage root, empty for the root itself */
+    int fd;
+    uint32_t refs; /* threads using the fd */
+    struct whisper_dir_s *hash_next;
+    struct whisper_dir_s *lru_prev;
+    struct whisper_dir_s *lru_next;
+};
+
+typedef struct whisper_dir_s whisper_dir_t;
+
+static struct {
+    pthread_mutex_t lock;
+    whisper_dir_t *buckets[WHISPER_DIRS_BUCKETS];
+    whisper_dir_t *first;
+    whisper_dir_t *last;
+    uint32_t nb_open;
+} wsp_dirs = { PTHREAD_MUTEX_INITIALIZER, { NULL }, NULL, NULL, 0 };
+
+/*
+ * FNV-1a hash of directory path in storage root.
+ */
+static uint32_t whisper_dirs_hash(uint32_t root, const char *path) {
+
+    return fnv1a(FNV1A_INIT ^ root, path) & (WHISPER_DIRS_BUCKETS - 1);
+
+}
+
+/*
+ * Closes the least recently used directories not in use until at most
+ * conf->open_dirs_cache are open. Must be called with wsp_dirs locked.
+ */
+static void whisper_dirs_shrink() {
+
+    whisper_dir_t *dir = wsp_dirs.last, *prev = NULL, **bucket = NULL;
+
+    for (; dir && wsp_dirs.nb_open > conf->open_dirs_cache; dir = prev) {
+
+        prev = dir->lru_prev;
+        if (dir->refs)
+            continue;
+
+        if (dir->lru_prev)
+            dir->lru_prev->lru_next = dir->lru_next;
+        else
+            wsp_dirs.first = dir->lru_next;
+        if (dir->lru_next)
+            dir->lru_next->lru_prev = dir->lru_prev;
+        else
+            wsp_dirs.last = dir->lru_prev;
+
+        bucket = &wsp_dirs.buckets[whisper_dirs_hash(dir->root, dir->path)];
+        while (*bucket != dir)
+            bucket = &(*bucket)->hash_next;
+        *bucket = dir->hash_next;
+
+        close(dir->fd);
+        free(dir->path);
+        free(dir);
+        wsp_dirs.nb_open--;
+    }
+
+}
+
+/*
+ * Returns the directory path in storage root with a reference taken on it, or
+ * NULL if not cached. Must be called with wsp_dirs locked.
+ */
+static whisper_dir_t * whisper_dirs_lookup(uint32_t root, const char *path) {
+
+    whisper_dir_t *dir = wsp_dirs.buckets[whisper_dirs_hash(root, path)];
+
+    for (; dir; dir = dir->hash_next)
+        if (dir->root == root && strcmp(dir->path, path) == 0)
+            break;
+
+    if (dir == NULL)
+        return NULL;
+
+    dir->refs++;
+
+    if (dir != wsp_dirs.first) {
+        dir->lru_prev->lru_next = dir->lru_next;
+        if (dir->lru_next)
+            dir->lru_next->lru_prev = dir->lru_prev;
+        else
+            wsp_dirs.last = dir->lru_prev;
+        dir->lru_prev = NULL;
+        dir->lru_next = wsp_dirs.first;
+        wsp_dirs.first->lru_prev = dir;
+        wsp_dirs.first = dir;
+    }
+
+    return dir;
+
+}
+
+static void whisper_dir_release(whisper_dir_t *dir) {
+
+    if (dir == NULL)
+        return;
+
+    pthread_mutex_lock(&wsp_dirs.lock);
+    dir->refs--;
+    whisper_dirs_shrink();
+    pthread_mutex_unlock(&wsp_dirs.lock);
+
+}
+
+/*
+ * Returns the directory path in storage root with a reference taken on it,
+ * which must be released with whisper_dir_release(). It is opened relative
+ * to its parent directory, itself from the cache, if not cached yet. Missing
+ * directories are created if create is true. Returns NULL on error, with
+ * errno set.
+ */
+static whisper_dir_t * whisper_dir_get(uint32_t root, const char *path,
+                                       bool create) {
+
+    whisper_dir_t *dir = NULL, *parent = NULL;
+    char parent_path[PATH_MAX];
+    const char *leaf = NULL, *slash = NULL;
+    int fd = -1, saved_errno = 0;
+
+    pthread_mutex_lock(&wsp_dirs.lock);
+    dir = whisper_dirs_lookup(root, path);
+    pthread_mutex_unlock(&wsp_dirs.lock);
+
+    if (dir)
+        return dir;
+
+    if (path[0] == '\0') {
+        if (create && mkdir(whisper_root_dir(root), S_IRWXU | S_IRWXG) == 0) {
+            debug("create database directory: %s", whisper_root_dir(root));
+        }
+        fd = open(whisper_root_dir(root), O_RDONLY|O_DIRECTORY);
+    } else {
+        slash = strrchr(path, '/');
+        leaf = slash ? slash + 1 : path;
+        snprintf(parent_path, PATH_MAX, "%.*s",
+                 slash ? (int) (slash - path) : 0, path);
+
+        parent = whisper_dir_get(root, parent_path, create);
+        if (parent == NULL)
+            return NULL;
+
+        fd = openat(parent->fd, leaf, O_RDONLY|O_DIRECTORY);
+        if (fd < 0 && errno == ENOENT && create) {
+            debug("create database directory: %s/%s", whisper_root_dir(root),
+                  path);
+            if (mkdirat(parent->fd, leaf, S_IRWXU | S_IRWXG) == 0
+                || errno == EEXIST)
+                fd = openat(parent->fd, leaf, O_RDONLY|O_DIRECTORY);
+        }
+        saved_errno = errno;
+        whisper_dir_release(parent);
+        errno = saved_errno;
+    }
+
+    if (fd < 0) {
+        if (errno != ENOENT || create)
+            error("unable to open directory %s/%s: %s\n",
+                  whisper_root_dir(root), path, strerror(errno));
+        return NULL;
+    }
+
+    pthread_mutex_lock(&wsp_dirs.lock);
+
+    /* opened by another thread in the meantime */
+    dir = whisper_dirs_lookup(root, path);
+    if (dir) {
+        pthread_mutex_unlock(&wsp_dirs.lock);
+        close(fd);
+        return dir;
+    }
+
+    dir = calloc(1, sizeof(whisper_dir_t));
+    dir->root = root;
+    dir->path = strdup(path);
+    dir->fd = fd;
+    dir->refs = 1;
+    dir->hash_next = wsp_dirs.buckets[whisper_dirs_hash(root, path)];
+    wsp_dirs.buckets[whisper_dirs_hash(root, path)] = dir;
+    dir->lru_next = wsp_dirs.first;
+    if (wsp_dirs.first)
+        wsp_dirs.first->lru_prev = dir;
+    else
+        wsp_dirs.last = dir;
+    wsp_dirs.first = dir;
+    wsp_dirs.nb_open++;
+
+    whisper_dirs_shrink();
+
+    pthread_mutex_unlock(&wsp_dirs.lock);
+
+    return dir;
+
+}
+
+/*
+ * Resolves the whisper file of metric into a directory fd and the name of the
+ * file relative to it, written in name of PATH_MAX bytes: the fd of its
+ * directory from the directories cache and its base name if the cache is
+ * enabled, else AT_FDCWD and its full path. The directories are created if
+ * create is true. Returns the directory fd, or -1 on error with errno set.
+ * The directory set in dir must be released with whisper_dir_release().
+ */
+static int whisper_metric_dir(const metric_t *metric, bool create,
+                              char *name, whisper_dir_t **dir) {
+
+    char metric_name_cpy[METRIC_NAME_MAX_LEN];
+    char path[PATH_MAX];
+    char *token = NULL, *next = NULL, *saveptr = NULL, *filename = NULL;
+    char bucket[WHISPER_FANOUT_NAME_LEN];
+    size_t path_len = 0;
+
+    *dir = NULL;
+
+    if (!conf->open_dirs_cache) {
+        filename = whisper_metric_filename(metric->name, WHISPER_EXTENSION);
+        strncpy(name, filename, PATH_MAX - 1);
+        name[PATH_MAX - 1] = '\0';
+        free(filename);
+        if (create)
+            whisper_create_dirs(metric);
+        return AT_FDCWD;
+    }
+
+    /* same components as whisper_metric_filename() */
+    path[0] = '\0';
+    strncpy(metric_name_cpy, metric->name, METRIC_NAME_MAX_LEN);
+    metric_name_cpy[METRIC_NAME_MAX_LEN - 1] = '\0';
+    token = strtok_r(metric_name_cpy, ".", &saveptr);
+
+    for (; token; token = next) {
+        next = strtok_r(NULL, ".", &saveptr);
+        if (next == NULL) /* last is the filename */
+            break;
+        path_len += snprintf(path + path_len, PATH_MAX - path_len, "%s%s",
+                             path_len ? "/" : "", token);
+    }
+
+    if (token == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    snprintf(name, PATH_MAX, "%s%s", token, WHISPER_EXTENSION);
+
+    if (whisper_fanout_bucket(metric->storage_root, token, bucket))
+        snprintf(path + path_len, PATH_MAX - path_len, "%s%s",
+                 path_len ? "/" : "", bucket);
+
+    *dir = whisper_dir_get(metric->storage_root, path, create);
+    if (*dir == NULL)
+        return -1;
+
+    return (*dir)->fd;
+
+}
+
+/*
+ * Closes all the directories of the directories cache.
+ */
+static void whisper_close_dirs() {
+
+    whisper_dir_t *dir = NULL, *next = NULL;
+
+    pthread_mutex_lock(&wsp_dirs.lock);
+    for (dir = wsp_dirs.first; dir; dir = next) {
+        next = dir->lru_next;
+        close(dir->fd);
+        free(dir->path);
+        free(dir);
+    }
+    memset(wsp_dirs.buckets, 0, sizeof(wsp_dirs.buckets));
+    wsp_dirs.first = wsp_dirs.last = NULL;
+    wsp_dirs.nb_open = 0;
+    pthread_mutex_unlock(&wsp_dirs.lock);
+
+}
+
 static uint32_t whisper_get_archive_offset(const retention_t *retention_list,
                                            const int id_ret) {
 
@@ -509,6 +1126,35 @@ uint32_t whisper_higher_archive_timestamp_start(uint32_t timestamp,
            + higher->seconds_per_point;
 }
 
+/*
+ * Syncs the directory of filename, opened on dir_fd unless it is AT_FDCWD and
+ * filename is a full path, so that the entry of the file survives a crash.
+ */
+static void whisper_sync_dir(int dir_fd, const char *filename) {
+
+    char dirname[PATH_MAX];
+    char *slash = NULL;
+    int fd = dir_fd;
+
+    if (dir_fd == AT_FDCWD) {
+        strncpy(dirname, filename, PATH_MAX - 1);
+        dirname[PATH_MAX - 1] = '\0';
+        slash = strrchr(dirname, '/');
+        if (slash == NULL)
+            return;
+        *slash = '\0';
+        fd = open(dirname, O_RDONLY|O_DIRECTORY);
+    }
+
+    if (fd < 0 || fsync(fd))
+        error("error while syncing directory of file %s: %s\n", filename,
+              strerror(errno));
+
+    if (fd >= 0 && fd != dir_fd)
+        close(fd);
+
+}
+
 static int whisper_create_file(const metric_t *metric) {
 
     retention_t *ret = whisper_find_retention(metric);
@@ -527,10 +1173,22 @@ static int whisper_create_file(const metric_t *metric) {
 
     uint32_t nb_arch = 0;
     uint32_t max_retention = 0;
-    char *filename = NULL;
+    char filename[PATH_MAX];
+    char tmp_filename[PATH_MAX + 4];
+    whisper_dir_t *dir = NULL;
+    int dir_fd = -1;
+
+    dir_fd = whisper_metric_dir(metric, true, filename, &dir);
+    if (dir_fd == -1)
+        return -1;
 
-    filename = whisper_metric_filename(metric);
-    whisper_create_dirs(metric);
+    /*
+     * The file is written under a temporary name and renamed once complete,
+     * so that a crash of carbond never leaves a truncated whisper file
+     * behind. Unless durability is none, the file is synced before it is
+     * renamed and its directory after, so that a power loss does not either.
+     */
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
 
     // count nb of archs
     for(cur_ret=ret; cur_ret; cur_ret=cur_ret->next, nb_arch++)
@@ -539,7 +1197,10 @@ static int whisper_create_file(const metric_t *metric) {
 
     agg = whisper_find_aggregation(metric);
     // return here if pattern_aggregation_t not found
-    if(!agg) return -1;
+    if(!agg) {
+        whisper_dir_release(dir);
+        return -1;
+    }
 
     new_wsp_md.aggregation_type = agg->method;
     new_wsp_md.max_retention = max_retention;
@@ -547,10 +1208,11 @@ static int whisper_create_file(const metric_t *metric) {
     new_wsp_md.archive_count = nb_arch;
 
     debug("creating file %s", filename);
-    whisper_fd = open(filename, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+    whisper_fd = openat(dir_fd, tmp_filename, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
 
     if(whisper_fd == -1) {
         error("failed to open file: %s\n", strerror(errno));
+        whisper_dir_release(dir);
         return -1;
     }
 
@@ -559,7 +1221,7 @@ static int whisper_create_file(const metric_t *metric) {
     debug("writing whisper headers in file");
     if (write(whisper_fd, &new_wsp_md, WHISPER_HEADER_SIZE) < WHISPER_HEADER_SIZE) {
         error("error while writing file: %s\n", strerror(errno));
-        return -1;
+        goto create_error;
     }
 
     // restart from beginning of retentions list to write archive headers
@@ -575,7 +1237,7 @@ static int whisper_create_file(const metric_t *metric) {
         debug("writing archive %d header in file", id_ret);
         if (write(whisper_fd, &wsp_cur_arch, WHISPER_ARCHIVE_SIZE) < WHISPER_ARCHIVE_SIZE) {
             error("error while writing file: %s\n", strerror(errno));
-            return -1;
+            goto create_error;
         }
 
         id_ret++;
@@ -594,332 +1256,2071 @@ static int whisper_create_file(const metric_t *metric) {
         debug("whisper: writing empty archive in file (%" PRIu32 " points, %lu bytes)",
                nb_points, sizeof_arch);
 
-        if (write(whisper_fd, empty_arch, sizeof_arch) < sizeof_arch) {
+        if (write(whisper_fd, empty_arch, sizeof_arch) != (ssize_t) sizeof_arch) {
             error("error while writing file: %s\n", strerror(errno));
-            return -1;
+            goto create_error;
         }
 
         free(empty_arch);
+        empty_arch = NULL;
         cur_ret = cur_ret->next;
 
     }
 
-    free(filename);
-
-    return whisper_fd;
+    if (conf->durability != DURABILITY_NONE && fsync(whisper_fd)) {
+        error("error while syncing file %s: %s\n", tmp_filename, strerror(errno));
+        goto create_error;
+    }
 
-}
+    if (renameat(dir_fd, tmp_filename, dir_fd, filename)) {
+        error("error while renaming file %s: %s\n", tmp_filename, strerror(errno));
+        goto create_error;
+    }
 
-static double whisper_aggregate_values(double *aggregated_values,
-                                       uint32_t nb_known_points,
-                                       uint32_t aggregation_type) {
+    if (conf->durability != DURABILITY_NONE)
+        whisper_sync_dir(dir_fd, filename);
 
-    double value = 0.0;
-    int i = 0;
+    whisper_dir_release(dir);
 
-    switch(aggregation_type) {
+    return whisper_fd;
 
-        case AGG_TYPE_AVERAGE:
-            for(i=0; i<nb_known_points; i++) value += aggregated_values[i];
-            value /= nb_known_points;
-            break;
-        case AGG_TYPE_SUM:
-            for(i=0; i<nb_known_points; i++) value += aggregated_values[i];
-            break;
-        default:
-            debug("unhandled aggregation type %" PRIu32 "", aggregation_type);
+    create_error:
+    /* never leave an incomplete temporary file behind */
+    close(whisper_fd);
+    if (unlinkat(dir_fd, tmp_filename, 0))
+        error("error while removing file %s: %s\n", tmp_filename, strerror(errno));
+    free(empty_arch);
+    whisper_dir_release(dir);
 
-    }
+    return -1;
 
-    return value;
 }
 
 /*
- * Write point in archive of whisper_fd at proper offset according to timestamp.
+ * Read the header and all the archives infos of the file in cache, unless
+ * they are already known for this file. The inode is checked on each call so
+ * that a file replaced behind carbond is read again.
+ * Returns 0 on success, 1 on error.
  */
-int whisper_write_point(int whisper_fd, archive_info_t *archive, uint32_t timestamp, archive_point_t point) {
+static int whisper_read_layout(int whisper_fd, whisper_cache_t *cache) {
 
-    archive_point_t *first_arch_pt = NULL;
-    uint32_t time_distance = 0;
-    // offset of lower precision archive
-    uint32_t write_offset = 0;
+    struct stat st;
+    uint32_t archive_id = 0;
+    size_t archives_size = 0;
 
-    // goto first point of archive
-    if (whisper_seek(whisper_fd, archive->offset))
+    if (fstat(whisper_fd, &st)) {
+        error("error during fstat: %s\n", strerror(errno));
         return 1;
+    }
 
-    // read first archive point
-    first_arch_pt = whisper_read_archive_point(whisper_fd);
+    if (cache->has_layout && cache->inode == st.st_ino)
+        return 0;
 
-    debug("timestamp of first point: %" PRIu32 "", first_arch_pt->timestamp);
-    // check if first update
-    if(first_arch_pt->timestamp == 0) {
-        write_offset = archive->offset;
-        debug("whisper: computed write offset: %" PRIu32 " (0)", write_offset);
-    }
-    else {
-        // calculate distance in number of metrics points
-        time_distance = (timestamp - first_arch_pt->timestamp) / archive->seconds_per_point;
-        write_offset = archive->offset + (time_distance * WHISPER_POINT_SIZE % archive_size(archive));
-        debug("whisper: computed write offset: %" PRIu32 " (%" PRIu32 ")",
-              write_offset,
-              (write_offset - archive->offset)/WHISPER_POINT_SIZE);
-    }
+    cache->has_layout = false;
 
-    // goto write offset
-    if (lseek(whisper_fd, write_offset , SEEK_SET) < 0) {
-        error("error while seeking file: %s\n", strerror(errno));
+    if (pread(whisper_fd, &cache->metadata, WHISPER_HEADER_SIZE, 0)
+        != WHISPER_HEADER_SIZE) {
+        error("error while reading file header: %s\n", strerror(errno));
         return 1;
     }
 
-    // write point    
-    if (write(whisper_fd, &point, WHISPER_POINT_SIZE) < WHISPER_POINT_SIZE) {
-        error("error while writing file: %s\n", strerror(errno));
+    ntoh_whisper_metadata(&cache->metadata);
+
+    if (cache->metadata.archive_count == 0) {
+        error("whisper: file without archive\n");
         return 1;
     }
 
-    // update internal monitoring data
+    archives_size = cache->metadata.archive_count * WHISPER_ARCHIVE_SIZE;
+    free(cache->archives);
+    cache->archives = malloc(archives_size);
+
+    if (pread(whisper_fd, cache->archives, archives_size, WHISPER_HEADER_SIZE)
+        != archives_size) {
+        error("error while reading archives infos: %s\n", strerror(errno));
+        return 1;
+    }
+
+    free(cache->bases);
+    cache->bases = calloc(cache->metadata.archive_count, sizeof(uint32_t));
+
+    for (archive_id = 0; archive_id < cache->metadata.archive_count; archive_id++) {
+        ntoh_archive_info(&cache->archives[archive_id]);
+        if (pread(whisper_fd, &cache->bases[archive_id], sizeof(uint32_t),
+                  cache->archives[archive_id].offset) != sizeof(uint32_t)) {
+            error("error while reading archive base: %s\n", strerror(errno));
+            return 1;
+        }
+        cache->bases[archive_id] = ntohl(cache->bases[archive_id]);
+    }
+
+    cache->inode = st.st_ino;
+    cache->has_layout = true;
+
+    return 0;
+
+}
+
+/*
+ * Sets the retention of the highest precision archive of metric, from the
+ * layout of its file if known, from the storage schema otherwise.
+ */
+void whisper_resolve_retention(metric_t *metric) {
+
+    retention_t *ret = NULL;
+    archive_info_t *archive = NULL;
+
+    if (metric->wsp_cache && metric->wsp_cache->has_layout) {
+        archive = &metric->wsp_cache->archives[0];
+        metric->retention_step = archive->seconds_per_point;
+        metric->retention_period = archive->seconds_per_point * archive->points;
+        return;
+    }
+
+    ret = whisper_find_retention(metric);
+    if (ret) {
+        metric->retention_step = ret->time_per_point;
+        metric->retention_period = ret->time_to_store;
+    }
+
+}
+
+/*
+ * Returns true if timestamp is covered by the highest precision archive of
+ * metric at time now, ie. it is neither older than its retention nor ahead of
+ * now by more than one point. Points of metrics with unknown retention are
+ * accepted. On false, the point is accounted as rejected in monitoring.
+ */
+bool whisper_in_retention(const metric_t *metric, uint32_t timestamp,
+                          uint32_t now) {
+
+    bool too_old = false, too_new = false;
+
+    if (metric->retention_period == 0)
+        return true;
+
+    if (timestamp > now)
+        too_new = timestamp - now > metric->retention_step;
+    else
+        too_old = now - timestamp >= metric->retention_period;
+
+    if (!too_old && !too_new)
+        return true;
+
+    pthread_mutex_lock(&(monitoring->mutex_rejected));
+    if (too_old)
+        monitoring->rejected_old++;
+    else
+        monitoring->rejected_future++;
+    pthread_mutex_unlock(&(monitoring->mutex_rejected));
+
+    return false;
+
+}
+
+/*
+ * Allocates the whisper cache of metric.
+ */
+static whisper_cache_t * whisper_cache_alloc(metric_t *metric) {
+
+    metric->wsp_cache = calloc(1, sizeof(whisper_cache_t));
+    metric->wsp_cache->metric_lock = &metric->lock;
+
+    return metric->wsp_cache;
+
+}
+
+/*
+ * Read the layout of the opened whisper file of metric into its cache, so
+ * that the first write to this file does not have to read it.
+ * Returns 0 on success, 1 on error.
+ */
+int whisper_register_file(metric_t *metric, int whisper_fd) {
+
+    if (!metric->wsp_cache)
+        whisper_cache_alloc(metric);
+
+    if (whisper_read_layout(whisper_fd, metric->wsp_cache))
+        return 1;
+
+    whisper_resolve_retention(metric);
+
+    return 0;
+
+}
+
+/*
+ * Returns the timestamp of the slot of the lower precision archive which
+ * aggregates the point at timestamp in the higher precision archive, ie. the
+ * first multiple of lower archive seconds per point not before timestamp.
+ * See whisper_higher_archive_timestamp_start() for the reverse operation.
+ */
+static inline uint32_t whisper_lower_archive_slot(uint32_t timestamp,
+                                                  archive_info_t *lower) {
+
+    uint32_t remainder = timestamp % lower->seconds_per_point;
+
+    if (remainder == 0)
+        return timestamp;
+
+    return timestamp - remainder + lower->seconds_per_point;
+}
+
+/*
+ * Files kept open between writes, in LRU order. A file is only used by the
+ * thread holding the lock of its metric, so a file is closed to make room in
+ * the cache only if this lock can be taken.
+ */
+static struct {
+    pthread_mutex_t lock;
+    whisper_cache_t *first;
+    whisper_cache_t *last;
+    uint32_t nb_open;
+} wsp_files = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0 };
+
+/*
+ * Removes the file of cache from the open files cache and closes it, after
+ * syncing it if it is dirty. Must be called with wsp_files locked.
+ */
+static void whisper_files_close(whisper_cache_t *cache) {
+
+    if (cache->lru_prev)
+        cache->lru_prev->lru_next = cache->lru_next;
+    else
+        wsp_files.first = cache->lru_next;
+    if (cache->lru_next)
+        cache->lru_next->lru_prev = cache->lru_prev;
+    else
+        wsp_files.last = cache->lru_prev;
+    cache->lru_prev = cache->lru_next = NULL;
+
+    if (cache->dirty && fdatasync(cache->fd))
+        error("error while syncing file: %s\n", strerror(errno));
+    close(cache->fd);
+
+    cache->has_fd = false;
+    cache->dirty = false;
+    wsp_files.nb_open--;
+
+}
+
+/*
+ * Adds the opened file of metric in front of the open files cache, closing
+ * the least recently used files not in use above conf->open_files_cache.
+ */
+static void whisper_files_add(metric_t *metric, int whisper_fd) {
+
+    whisper_cache_t *cache = metric->wsp_cache, *cur = NULL, *prev = NULL;
+
+    pthread_mutex_lock(&wsp_files.lock);
+
+    cache->fd = whisper_fd;
+    cache->has_fd = true;
+    cache->lru_prev = NULL;
+    cache->lru_next = wsp_files.first;
+    if (wsp_files.first)
+        wsp_files.first->lru_prev = cache;
+    else
+        wsp_files.last = cache;
+    wsp_files.first = cache;
+    wsp_files.nb_open++;
+
+    for (cur = wsp_files.last; cur && wsp_files.nb_open > conf->open_files_cache;
+         cur = prev) {
+        prev = cur->lru_prev;
+        if (cur == cache || pthread_mutex_trylock(cur->metric_lock))
+            continue;
+        whisper_files_close(cur);
+        pthread_mutex_unlock(cur->metric_lock);
+    }
+
+    pthread_mutex_unlock(&wsp_files.lock);
+
+}
+
+/*
+ * Returns a descriptor on the whisper file of metric, from the open files
+ * cache if it is there. Else the file is opened, created first if create is
+ * true and it does not exist. Returns -1 on error.
+ */
+static int whisper_open_file(metric_t *metric, bool create) {
+
+    whisper_cache_t *cache = metric->wsp_cache;
+    char filename[PATH_MAX];
+    whisper_dir_t *dir = NULL;
+    int whisper_fd = -1, dir_fd = -1, saved_errno = 0;
+
+    if (cache && cache->has_fd) {
+        pthread_mutex_lock(&wsp_files.lock);
+        if (cache != wsp_files.first) {
+            cache->lru_prev->lru_next = cache->lru_next;
+            if (cache->lru_next)
+                cache->lru_next->lru_prev = cache->lru_prev;
+            else
+                wsp_files.last = cache->lru_prev;
+            cache->lru_prev = NULL;
+            cache->lru_next = wsp_files.first;
+            wsp_files.first->lru_prev = cache;
+            wsp_files.first = cache;
+        }
+        pthread_mutex_unlock(&wsp_files.lock);
+        return cache->fd;
+    }
+
+    /* a missing directory is created with the file */
+    dir_fd = whisper_metric_dir(metric, false, filename, &dir);
+    if (dir_fd != -1) {
+        debug("whisper: opening file %s", filename);
+        whisper_fd = openat(dir_fd, filename, O_RDWR);
+    }
+    saved_errno = errno;
+    whisper_dir_release(dir);
+    errno = saved_errno;
+
+    if (whisper_fd < 0) {
+        if (errno == ENOENT && create)
+            whisper_fd = whisper_create_file(metric);
+        else
+            error("error while opening file %s: %s\n", metric->name,
+                  strerror(errno));
+    }
+
+    return whisper_fd;
+
+}
+
+/*
+ * Gives back the file of metric once written. It is kept in the open files
+ * cache if enabled, else it is closed. In batched durability mode, it is
+ * synced later with the other dirty files, or before it is closed.
+ */
+static void whisper_release_file(metric_t *metric, int whisper_fd) {
+
+    whisper_cache_t *cache = metric->wsp_cache;
+    bool batched = conf->durability == DURABILITY_BATCHED;
+
+    if (cache && cache->has_fd && cache->fd == whisper_fd) {
+        if (batched) {
+            pthread_mutex_lock(&wsp_files.lock);
+            cache->dirty = true;
+            pthread_mutex_unlock(&wsp_files.lock);
+        }
+        return;
+    }
+
+    if (cache && conf->open_files_cache) {
+        if (batched)
+            cache->dirty = true;
+        whisper_files_add(metric, whisper_fd);
+        return;
+    }
+
+    if (batched && fdatasync(whisper_fd))
+        error("error while syncing file: %s\n", strerror(errno));
+    close(whisper_fd);
+
+}
+
+/*
+ * Syncs the data of all dirty files of the open files cache. The descriptors
+ * of the dirty files are duplicated under the lock and synced once it is
+ * released, so that writers opening files are not blocked meanwhile. Returns
+ * the number of files synced.
+ */
+uint32_t whisper_sync_files() {
+
+    static int *fds = NULL;
+    static uint32_t size_fds = 0;
+    whisper_cache_t *cur = NULL;
+    uint32_t nb_fds = 0, nb_synced = 0, i = 0;
+    int fd = -1;
+
+    pthread_mutex_lock(&wsp_files.lock);
+
+    for (cur = wsp_files.first; cur; cur = cur->lru_next) {
+        if (!cur->dirty)
+            continue;
+        fd = dup(cur->fd);
+        if (fd < 0) {
+            error("error while duplicating file descriptor: %s\n",
+                  strerror(errno));
+            continue;
+        }
+        /* cleared first not to miss a write during sync */
+        cur->dirty = false;
+        if (nb_fds == size_fds) {
+            size_fds = size_fds ? size_fds * 2 : 256;
+            fds = realloc(fds, size_fds * sizeof(int));
+        }
+        fds[nb_fds++] = fd;
+    }
+
+    pthread_mutex_unlock(&wsp_files.lock);
+
+    for (i = 0; i < nb_fds; i++) {
+        if (fdatasync(fds[i]))
+            error("error while syncing file: %s\n", strerror(errno));
+        else
+            nb_synced++;
+        close(fds[i]);
+    }
+
+    return nb_synced;
+
+}
+
+/*
+ * Closes all the files of the open files cache, syncing the dirty ones, and
+ * the directories of the directories cache. Must be called once no more
+ * thread writes files.
+ */
+void whisper_close_files() {
+
+    pthread_mutex_lock(&wsp_files.lock);
+    while (wsp_files.first)
+        whisper_files_close(wsp_files.first);
+    pthread_mutex_unlock(&wsp_files.lock);
+
+    whisper_close_dirs();
+
+}
+
+/*
+ * Frees the whisper cache of a metric removed from database.
+ */
+void whisper_cache_free(whisper_cache_t *cache) {
+
+    if (!cache)
+        return;
+
+    /* the file may have been closed by another thread meanwhile */
+    pthread_mutex_lock(&wsp_files.lock);
+    if (cache->has_fd)
+        whisper_files_close(cache);
+    pthread_mutex_unlock(&wsp_files.lock);
+
+    free(cache->archives);
+    free(cache->bases);
+    free(cache->rollups);
+    free(cache->pending);
+    free(cache);
+
+}
+
+/*
+ * Returns the whisper cache of the metric, allocating it on first use. The
+ * rollup accumulators are (re)allocated if the number of archives of the file
+ * changed and released when accumulators are disabled in configuration or
+ * when propagation is deferred, so that they never keep stale slots.
+ */
+static whisper_cache_t * whisper_get_cache(metric_t *metric,
+                                           uint32_t archive_count) {
+
+    whisper_cache_t *cache = metric->wsp_cache;
+
+    if (!cache)
+        cache = whisper_cache_alloc(metric);
+
+    if (!conf->rollup_accumulators || conf->propagation_deferred
+        || cache->nb_rollups != archive_count) {
+        free(cache->rollups);
+        cache->rollups = NULL;
+        cache->nb_rollups = 0;
+    }
+
+    if (conf->rollup_accumulators && !conf->propagation_deferred
+        && !cache->rollups) {
+        cache->rollups = calloc(archive_count, sizeof(archive_rollup_t));
+        cache->nb_rollups = archive_count;
+    }
+
+    return cache;
+
+}
+
+/*
+ * Add slot of archive 1 to the list of slots waiting for deferred propagation
+ * of the metric, unless it is already the last one queued.
+ */
+static void whisper_propagation_enqueue(whisper_cache_t *cache,
+                                        uint32_t timestamp) {
+
+    if (cache->nb_pending && cache->pending[cache->nb_pending-1] == timestamp)
+        return;
+
+    if (cache->nb_pending == cache->size_pending) {
+        cache->size_pending = cache->size_pending ? cache->size_pending * 2 : 8;
+        cache->pending = realloc(cache->pending,
+                                 cache->size_pending * sizeof(uint32_t));
+    }
+
+    if (cache->nb_pending == 0)
+        cache->pending_since = (uint32_t)time(NULL);
+
+    cache->pending[cache->nb_pending++] = timestamp;
+
+    pthread_mutex_lock(&(monitoring->mutex_propagation));
+    monitoring->propagation_backlog++;
+    pthread_mutex_unlock(&(monitoring->mutex_propagation));
+
+}
+
+/*
+ * Feed the accumulator of lower precision archive with value written at
+ * timestamp in the archive just above it. Returns true if the accumulator
+ * holds all the values of the slot after this update, false if the slot must
+ * be aggregated by reading the higher archive on disk. This is notably the
+ * case for the first slot after a restart and for out-of-order points.
+ */
+static bool whisper_rollup_feed(archive_rollup_t *rollup,
+                                archive_info_t *lower,
+                                uint32_t timestamp, double value) {
+
+    uint32_t slot = whisper_lower_archive_slot(timestamp, lower);
+
+    if (slot > rollup->timestamp) {
+        /*
+         * New slot: all its values will go through the accumulator if it was
+         * already tracking a previous slot.
+         */
+        rollup->trusted = (rollup->timestamp != 0);
+        rollup->timestamp = slot;
+        rollup->last_timestamp = timestamp;
+        rollup->count = 1;
+        rollup->sum = rollup->min = rollup->max = rollup->last = value;
+    } else if (slot == rollup->timestamp
+               && timestamp > rollup->last_timestamp) {
+        rollup->last_timestamp = timestamp;
+        rollup->count++;
+        rollup->sum += value;
+        if (value < rollup->min) rollup->min = value;
+        if (value > rollup->max) rollup->max = value;
+        rollup->last = value;
+    } else {
+        /*
+         * Point older than the current slot, or overwrite of a value already
+         * accumulated in the current slot which is therefore no more exact.
+         */
+        if (slot == rollup->timestamp)
+            rollup->trusted = false;
+        debug("out-of-order point %" PRIu32 " for slot %" PRIu32 "",
+              timestamp, rollup->timestamp);
+        return false;
+    }
+
+    return rollup->trusted;
+
+}
+
+/*
+ * Returns the aggregated value of the slot held by the accumulator.
+ */
+static double whisper_rollup_value(archive_rollup_t *rollup,
+                                   uint32_t aggregation_type) {
+
+    double value = 0.0;
+
+    switch(aggregation_type) {
+
+        case AGG_TYPE_AVERAGE:
+            value = rollup->sum / rollup->count;
+            break;
+        case AGG_TYPE_SUM:
+            value = rollup->sum;
+            break;
+        case AGG_TYPE_LAST:
+            value = rollup->last;
+            break;
+        case AGG_TYPE_MAX:
+            value = rollup->max;
+            break;
+        case AGG_TYPE_MIN:
+            value = rollup->min;
+            break;
+        default:
+            debug("unhandled aggregation type %" PRIu32 "", aggregation_type);
+
+    }
+
+    return value;
+}
+
+/*
+ * Returns the index of the slot holding timestamp in archive, given the
+ * timestamp of the first point of the archive.
+ */
+static inline uint32_t whisper_archive_slot_index(archive_info_t *archive,
+                                                  uint32_t base,
+                                                  uint32_t timestamp) {
+
+    int64_t distance = ((int64_t)timestamp - (int64_t)base)
+                       / archive->seconds_per_point;
+    int64_t index = distance % archive->points;
+
+    if (index < 0)
+        index += archive->points;
+
+    return (uint32_t)index;
+}
+
+/*
+ * Read the timestamp of the first point of archive, 0 if archive is empty.
+ */
+static uint32_t whisper_read_base_timestamp(int whisper_fd,
+                                            archive_info_t *archive) {
+
+    uint32_t base = 0;
+
+    if (pread(whisper_fd, &base, sizeof(uint32_t), archive->offset)
+        != sizeof(uint32_t)) {
+        error("error while reading file: %s\n", strerror(errno));
+        return 0;
+    }
+
+    return ntohl(base);
+}
+
+/*
+ * Write point in archive of whisper_fd at proper offset according to timestamp.
+ * The offset is computed from base, the timestamp of the first point of the
+ * archive kept in whisper cache, which is updated once the first slot is
+ * (over)written. On error, the base on disk may differ from the cached one,
+ * the caller must read the layout of the file again.
+ */
+int whisper_write_point(int whisper_fd, archive_info_t *archive, uint32_t *base,
+                        uint32_t timestamp, archive_point_t point) {
+
+    uint32_t index = 0;
+    off_t write_offset = 0;
+
+    // check if first update
+    if (*base == 0)
+        index = 0;
+    else
+        index = whisper_archive_slot_index(archive, *base, timestamp);
+
+    write_offset = archive->offset + (off_t) index * WHISPER_POINT_SIZE;
+    debug("whisper: computed write offset: %" PRIu32 " (%" PRIu32 ")",
+          (uint32_t) write_offset, index);
+
+    // write point
+    if (pwrite(whisper_fd, &point, WHISPER_POINT_SIZE, write_offset)
+        < WHISPER_POINT_SIZE) {
+        error("error while writing file: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (index == 0)
+        *base = timestamp;
+
+    // update internal monitoring data
     pthread_mutex_lock(&(monitoring->mutex_points));
     monitoring->points++;
     pthread_mutex_unlock(&(monitoring->mutex_points));
 
-    return 0;
+    return 0;
+
+}
+
+/*
+ * Read nb_points consecutive raw points of archive starting at the slot of
+ * timestamp from, in one positional read or two if the span wraps around the
+ * end of the archive. nb_points must not exceed the number of points of the
+ * archive. Returns 0 on success, 1 on error.
+ */
+static int whisper_read_span(int whisper_fd, archive_info_t *archive,
+                             uint32_t base, uint32_t from,
+                             uint32_t nb_points, void *buf) {
+
+    uint32_t index = 0,
+             nb_first = 0;
+    size_t len = 0;
+
+    assert(nb_points <= archive->points);
+
+    if (base == 0) {
+        /* nothing written in archive yet */
+        memset(buf, 0, nb_points * WHISPER_POINT_SIZE);
+        return 0;
+    }
+
+    index = whisper_archive_slot_index(archive, base, from);
+    nb_first = archive->points - index;
+    if (nb_first > nb_points)
+        nb_first = nb_points;
+
+    len = nb_first * WHISPER_POINT_SIZE;
+    debug("reading %" PRIu32 " points from slot %" PRIu32 "", nb_first, index);
+    if (pread(whisper_fd, buf, len, archive->offset + index * WHISPER_POINT_SIZE)
+        != len) {
+        error("error while reading file: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (nb_first < nb_points) {
+        len = (nb_points - nb_first) * WHISPER_POINT_SIZE;
+        debug("reading %" PRIu32 " points from slot 0", nb_points - nb_first);
+        if (pread(whisper_fd, (char *)buf + nb_first * WHISPER_POINT_SIZE,
+                  len, archive->offset) != len) {
+            error("error while reading file: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Write nb_points consecutive raw points of buf in archive starting at the
+ * slot of timestamp from, in one positional write or two if the span wraps
+ * around the end of the archive, see whisper_read_span(). base must be set.
+ * Returns 0 on success, 1 on error.
+ */
+static int whisper_write_span(int whisper_fd, archive_info_t *archive,
+                              uint32_t base, uint32_t from,
+                              uint32_t nb_points, const void *buf) {
+
+    uint32_t index = 0,
+             nb_first = 0;
+    size_t len = 0;
+
+    assert(nb_points <= archive->points && base != 0);
+
+    index = whisper_archive_slot_index(archive, base, from);
+    nb_first = archive->points - index;
+    if (nb_first > nb_points)
+        nb_first = nb_points;
+
+    len = nb_first * WHISPER_POINT_SIZE;
+    debug("writing %" PRIu32 " points from slot %" PRIu32 "", nb_first, index);
+    if (pwrite(whisper_fd, buf, len, archive->offset + index * WHISPER_POINT_SIZE)
+        != len) {
+        error("error while writing file: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (nb_first < nb_points) {
+        len = (nb_points - nb_first) * WHISPER_POINT_SIZE;
+        debug("writing %" PRIu32 " points from slot 0", nb_points - nb_first);
+        if (pwrite(whisper_fd, (const char *)buf + nb_first * WHISPER_POINT_SIZE,
+                   len, archive->offset) != len) {
+            error("error while writing file: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Aggregate points of the higher precision archive into the slots of lower
+ * precision archive given in slots, which must be sorted in ascending order.
+ * The higher precision archive is read once for all the slots whose span fits
+ * into it. For each slot, written[i] tells if the point has been written in
+ * lower archive and values[i] holds its value. Returns 0 on success, 1 if the
+ * higher archive could not be read or a point could not be written.
+ */
+static int whisper_propagate_slots(int whisper_fd,
+                                   whisper_metadata_t *wsp_md,
+                                   archive_info_t *wsp_arch_higher,
+                                   archive_info_t *wsp_arch_lower,
+                                   uint32_t base, uint32_t *base_lower,
+                                   const uint32_t *slots, uint32_t nb_slots,
+                                   double *values, bool *written) {
+
+    archive_point_t *rd_buf = NULL;
+    archive_point_t new_arch_pt;
+    uint32_t *timestamps = NULL;
+    double *rd_values = NULL;
+    uint32_t span_start = 0,
+             span_points = 0,
+             nb_higher_points = 0,
+             nb_known_points = 0,
+             nb_points = 0,
+             slot_start = 0,
+             first_point = 0;
+    uint32_t id_slot = 0,
+             id_group = 0;
+    double new_value = 0.0;
+
+    nb_higher_points = wsp_arch_lower->seconds_per_point /
+                       wsp_arch_higher->seconds_per_point;
+
+    rd_buf = malloc(archive_size(wsp_arch_higher));
+    timestamps = malloc(wsp_arch_higher->points * sizeof(uint32_t));
+    rd_values = malloc(wsp_arch_higher->points * sizeof(double));
+
+    for (id_group = 0; id_group < nb_slots; id_group = id_slot) {
+
+        /*
+         * determine the group of slots whose span of points in higher
+         * precision archive can be read at once
+         */
+        span_start = whisper_higher_archive_timestamp_start(slots[id_group],
+                         wsp_arch_higher, wsp_arch_lower);
+        for (id_slot = id_group + 1; id_slot < nb_slots; id_slot++)
+            if ((slots[id_slot] - span_start) / wsp_arch_higher->seconds_per_point
+                + 1 > wsp_arch_higher->points)
+                break;
+        span_points = (slots[id_slot - 1] - span_start)
+                      / wsp_arch_higher->seconds_per_point + 1;
+        if (span_points > wsp_arch_higher->points)
+            span_points = wsp_arch_higher->points;
+
+        if (whisper_read_span(whisper_fd, wsp_arch_higher, base, span_start,
+                              span_points, rd_buf)) {
+            free(rd_buf);
+            free(timestamps);
+            free(rd_values);
+            return 1;
+        }
+
+        decode_archive_points(rd_buf, span_points, timestamps, rd_values);
+
+        for (; id_group < id_slot; id_group++) {
+
+            slot_start = whisper_higher_archive_timestamp_start(slots[id_group],
+                             wsp_arch_higher, wsp_arch_lower);
+            first_point = (slot_start - span_start)
+                          / wsp_arch_higher->seconds_per_point;
+            nb_points = nb_higher_points;
+            if (first_point + nb_points > span_points)
+                nb_points = span_points - first_point;
+
+            /* unknown points are skipped by the aggregation kernel */
+            nb_known_points = aggregate_points(wsp_md->aggregation_type,
+                                               timestamps + first_point,
+                                               rd_values + first_point,
+                                               nb_points, slot_start,
+                                               wsp_arch_higher->seconds_per_point,
+                                               &new_value);
+
+            written[id_group] = false;
+
+            if (nb_known_points == 0
+                || (float)nb_known_points / nb_higher_points < wsp_md->x_files_factor) {
+                debug("known values (%" PRIu32 ") below xff", nb_known_points);
+                continue;
+            }
+
+            // write new value
+            debug("write value %f with timestamp %" PRIu32 "",
+                  new_value, slots[id_group]);
+            new_arch_pt.timestamp = slots[id_group];
+            new_arch_pt.value = new_value;
+            hton_archive_point(&new_arch_pt);
+
+            if (whisper_write_point(whisper_fd, wsp_arch_lower, base_lower,
+                                    slots[id_group], new_arch_pt)) {
+                free(rd_buf);
+                free(timestamps);
+                free(rd_values);
+                return 1;
+            }
+            values[id_group] = new_value;
+            written[id_group] = true;
+        }
+    }
+
+    free(rd_buf);
+    free(timestamps);
+    free(rd_values);
+
+    return 0;
+
+}
+
+/*
+ * Aggregate the points of the higher precision archive read on disk into the
+ * point at timestamp in lower precision archive. On success, the written value
+ * is stored in propagated_value. Returns 0 if the point has been written, 1 if
+ * there were not enough known values according to xff and -1 on error.
+ */
+static int whisper_write_propagate(int whisper_fd, uint32_t timestamp,
+                                   whisper_metadata_t *wsp_md,
+                                   archive_info_t *wsp_arch_higher,
+                                   archive_info_t *wsp_arch_lower,
+                                   uint32_t base, uint32_t *base_lower,
+                                   double *propagated_value) {
+
+    bool written = false;
+
+    if (whisper_propagate_slots(whisper_fd, wsp_md, wsp_arch_higher,
+                                wsp_arch_lower, base, base_lower,
+                                &timestamp, 1,
+                                propagated_value, &written))
+        return -1;
+
+    return written ? 0 : 1;
+
+}
+
+/*
+ * Same as whisper_write_propagate() but aggregates the values held by the
+ * accumulator of the lower precision archive without reading the higher
+ * precision archive.
+ */
+static int whisper_write_rollup(int whisper_fd, uint32_t timestamp,
+                                whisper_metadata_t *wsp_md,
+                                archive_info_t *wsp_arch_higher,
+                                archive_info_t *wsp_arch_lower,
+                                uint32_t *base_lower,
+                                archive_rollup_t *rollup,
+                                double *propagated_value) {
+
+    uint32_t nb_higher_points = wsp_arch_lower->seconds_per_point /
+                                wsp_arch_higher->seconds_per_point;
+    double new_value = 0.0;
+    archive_point_t new_arch_pt;
+
+    if ((float)rollup->count / nb_higher_points < wsp_md->x_files_factor) {
+        debug("accumulated values (%" PRIu32 ") below xff", rollup->count);
+        return 1;
+    }
+
+    new_value = whisper_rollup_value(rollup, wsp_md->aggregation_type);
+    debug("write accumulated value %f with timestamp %" PRIu32 "",
+          new_value, timestamp);
+    new_arch_pt.timestamp = timestamp;
+    new_arch_pt.value = new_value;
+    hton_archive_point(&new_arch_pt);
+
+    if (whisper_write_point(whisper_fd, wsp_arch_lower, base_lower, timestamp,
+                            new_arch_pt))
+        return -1;
+    *propagated_value = new_value;
+
+    return 0;
+
+}
+
+/*
+ * Writes the point of metric at timestamp in the first archive of its whisper
+ * file and propagates it to the lower precision archives, or queues it for
+ * deferred propagation. Returns EXIT_FAILURE if a point could not be written.
+ */
+int whisper_write_value(metric_t * metric,
+                        uint32_t timestamp, double value) {
+
+    int whisper_fd = -1;
+    int archive_id = 0;
+    int rc = 0, status = EXIT_SUCCESS;
+    uint32_t aligned_timestamp = 0;
+    bool end_loop = false; // flag for propagation loop
+    bool propagated = true; // value written in higher archive
+    bool accumulated = false; // slot of lower archive fully accumulated
+    double propagated_value = 0.0;
+
+    whisper_cache_t *cache = NULL;
+    archive_rollup_t *rollup = NULL;
+
+    whisper_metadata_t *wsp_md = NULL;
+    archive_info_t *wsp_arch = NULL;
+    archive_info_t *wsp_arch_higher = NULL, // for propagation
+                   *wsp_arch_lower = NULL;
+    archive_point_t new_arch_pt;
+
+    whisper_fd = whisper_open_file(metric, true);
+
+    if (whisper_fd < 0)
+        return EXIT_FAILURE;
+
+    if (whisper_register_file(metric, whisper_fd)) {
+        if (!metric->wsp_cache->has_fd)
+            close(whisper_fd);
+        return EXIT_FAILURE;
+    }
+
+    wsp_md = &metric->wsp_cache->metadata;
+
+    /*
+     * Points are checked when added in cache, but they may have expired
+     * since. Writing them would overwrite a recent slot.
+     */
+    if (!whisper_in_retention(metric, timestamp, (uint32_t)time(NULL))) {
+        debug("whisper: point %u of %s out of retention, dropped", timestamp,
+              metric->name);
+        whisper_release_file(metric, whisper_fd);
+        return EXIT_SUCCESS;
+    }
+
+    wsp_arch = &metric->wsp_cache->archives[0];
+
+    /*
+     * Align timestamp to archive sampling rate.
+     * for example, with:
+     *   - timestamp: 188
+     *   - seconds_per_point: 60
+     * arch_pt.timestamp = 188 - (188 % 60)
+     *                   = 188 - 8
+     *                   = 180
+     */
+    aligned_timestamp = timestamp - (timestamp % wsp_arch->seconds_per_point);
+    new_arch_pt.timestamp = aligned_timestamp;
+    new_arch_pt.value = value;
+    //printf("whisper: before %#010" PRIx32" %#018" PRIx64 "\n", new_arch_pt.timestamp, *(int64_t *)&new_arch_pt.value);
+    hton_archive_point(&new_arch_pt);
+    //printf("whisper: after  %#010" PRIx32" %#018" PRIx64 "\n", new_arch_pt.timestamp, *(int64_t *)&new_arch_pt.value);
+
+    // propogation to lower precision archives
+    cache = whisper_get_cache(metric, wsp_md->archive_count);
+
+    if (whisper_write_point(whisper_fd, wsp_arch, &cache->bases[0],
+                            aligned_timestamp, new_arch_pt)) {
+        cache->has_layout = false;
+        whisper_release_file(metric, whisper_fd);
+        return EXIT_FAILURE;
+    }
+
+    wsp_arch_higher = wsp_arch;
+    propagated_value = value;
+    end_loop = false;
+
+    /*
+     * In deferred mode, only queue the slot of archive 1 this point ends.
+     * Propagation is done later by whisper_propagate_pending().
+     */
+    if (conf->propagation_deferred && wsp_md->archive_count > 1) {
+        wsp_arch_lower = &cache->archives[1];
+        if (aligned_timestamp % wsp_arch_lower->seconds_per_point == 0)
+            whisper_propagation_enqueue(cache, aligned_timestamp);
+        end_loop = true;
+    }
+
+    for(archive_id=1; !end_loop && archive_id < wsp_md->archive_count; archive_id++) {
+        wsp_arch_lower = &cache->archives[archive_id];
+
+        assert(wsp_arch_lower->seconds_per_point != 0);
+
+        /*
+         * Feed the accumulator with the value written in higher archive. If
+         * nothing was written there, the accumulator is still usable for the
+         * slot as long as it was exact.
+         */
+        accumulated = false;
+        if (cache->rollups) {
+            rollup = &cache->rollups[archive_id];
+            if (propagated)
+                accumulated = whisper_rollup_feed(rollup, wsp_arch_lower,
+                                                  aligned_timestamp,
+                                                  propagated_value);
+            else
+                accumulated = rollup->trusted
+                              && rollup->timestamp == aligned_timestamp;
+        }
+
+        // only if timestamp can be divided by lower archive seconds per point
+        if (aligned_timestamp % wsp_arch_lower->seconds_per_point == 0) {
+            debug("propagate to archive %d", archive_id);
+            if (accumulated)
+                rc = whisper_write_rollup(whisper_fd, aligned_timestamp,
+                                          wsp_md, wsp_arch_higher,
+                                          wsp_arch_lower,
+                                          &cache->bases[archive_id],
+                                          rollup, &propagated_value);
+            else
+                rc = whisper_write_propagate(whisper_fd, aligned_timestamp,
+                                             wsp_md, wsp_arch_higher,
+                                             wsp_arch_lower,
+                                             cache->bases[archive_id-1],
+                                             &cache->bases[archive_id],
+                                             &propagated_value);
+            propagated = (rc == 0);
+            if (rc < 0) {
+                cache->has_layout = false;
+                status = EXIT_FAILURE;
+                end_loop = true;
+            }
+        }
+        else {
+            debug("end loop at archive %d", archive_id);
+            end_loop = true;
+        }
+        wsp_arch_higher = wsp_arch_lower;
+
+    }
+
+    whisper_release_file(metric, whisper_fd);
+
+    debug("end writing value %f at timestamp %" PRIu32 " (%" PRIu32 ")",
+           value, timestamp, aligned_timestamp);
+
+    return status;
+
+}
+
+/*
+ * Writes the nb_points points of metric in its whisper file, one after the
+ * other in the given order. Returns EXIT_FAILURE if one of them could not be
+ * written.
+ */
+int whisper_write_points(metric_t * metric, const uint32_t *timestamps,
+                         const double *values, uint32_t nb_points) {
+
+    uint32_t i = 0;
+    int rc = EXIT_SUCCESS;
+
+    for (i = 0; i < nb_points; i++)
+        if (whisper_write_value(metric, timestamps[i], values[i]))
+            rc = EXIT_FAILURE;
+
+    return rc;
+
+}
+
+static int compare_timestamps(const void *a, const void *b) {
+
+    uint32_t ta = *(const uint32_t *)a,
+             tb = *(const uint32_t *)b;
+
+    return (ta > tb) - (ta < tb);
+}
+
+/*
+ * Propagate all the slots of archive 1 queued for deferred propagation of the
+ * metric down to lower precision archives. The file is opened once and each
+ * higher precision archive is read once for all the pending slots, instead of
+ * once per slot. Must be called with the metric locked.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int whisper_propagate_pending(metric_t *metric) {
+
+    whisper_cache_t *cache = metric->wsp_cache;
+    int whisper_fd = -1;
+    int archive_id = 0;
+    int status = EXIT_SUCCESS;
+    uint32_t nb_queued = 0,
+             nb_pending = 0,
+             nb_slots = 0,
+             id_slot = 0;
+    uint32_t *slots = NULL;
+    double *values = NULL;
+    bool *written = NULL;
+    whisper_metadata_t *wsp_md = NULL;
+    archive_info_t *wsp_arch_higher = NULL,
+                   *wsp_arch_lower = NULL;
+
+    if (!cache || !cache->nb_pending)
+        return EXIT_SUCCESS;
+
+    /* take ownership of the pending slots */
+    slots = cache->pending;
+    nb_queued = nb_pending = nb_slots = cache->nb_pending;
+    cache->pending = NULL;
+    cache->nb_pending = cache->size_pending = 0;
+
+    /* sort and remove duplicates */
+    qsort(slots, nb_slots, sizeof(uint32_t), compare_timestamps);
+    for (id_slot = 1, nb_slots = 1; id_slot < nb_pending; id_slot++)
+        if (slots[id_slot] != slots[nb_slots-1])
+            slots[nb_slots++] = slots[id_slot];
+
+    debug("whisper: propagating %" PRIu32 " slots of metric %s",
+          nb_slots, metric->name);
+    whisper_fd = whisper_open_file(metric, false);
+
+    if (whisper_fd < 0) {
+        status = EXIT_FAILURE;
+        goto end;
+    }
+
+    if (whisper_read_layout(whisper_fd, cache)) {
+        status = EXIT_FAILURE;
+        goto end;
+    }
+
+    wsp_md = &cache->metadata;
+    values = calloc(nb_slots, sizeof(double));
+    written = calloc(nb_slots, sizeof(bool));
+    wsp_arch_higher = &cache->archives[0];
+
+    for (archive_id = 1; nb_slots && archive_id < wsp_md->archive_count;
+         archive_id++) {
+
+        wsp_arch_lower = &cache->archives[archive_id];
+
+        assert(wsp_arch_lower->seconds_per_point != 0);
 
-}
+        /* keep only the slots which are also slots of this lower archive */
+        for (id_slot = 0, nb_pending = 0; id_slot < nb_slots; id_slot++)
+            if (slots[id_slot] % wsp_arch_lower->seconds_per_point == 0)
+                slots[nb_pending++] = slots[id_slot];
+        nb_slots = nb_pending;
+
+        if (nb_slots) {
+            debug("propagate %" PRIu32 " slots to archive %d",
+                  nb_slots, archive_id);
+            if (whisper_propagate_slots(whisper_fd, wsp_md, wsp_arch_higher,
+                                        wsp_arch_lower,
+                                        cache->bases[archive_id-1],
+                                        &cache->bases[archive_id],
+                                        slots, nb_slots, values, written)) {
+                cache->has_layout = false;
+                status = EXIT_FAILURE;
+                nb_slots = 0;
+            }
+        }
 
-static int whisper_write_propagate(int whisper_fd, uint32_t timestamp,
-                                   whisper_metadata_t *wsp_md,
-                                   archive_info_t *wsp_arch_higher,
-                                   archive_info_t *wsp_arch_lower) {
-
-    archive_point_t *first_higher_point = NULL,
-                    *tmp_point = NULL;
-    // for later usage
-    //archive_point_t * first_lower_point = NULL;
-    int rd_len = -1,
-        rd_len2 = -1,
-        higher_point_id = -1;
-    double new_value = 0.0;
-    uint32_t points_distance = 0;
-    uint32_t higher_start_offset = 0,
-             higher_end_offset = 0;
-    uint32_t nb_higher_points = 0,
-             nb_known_points = 0,
-             cur_timestamp = 0;
+        wsp_arch_higher = wsp_arch_lower;
+    }
 
+    end:
+        pthread_mutex_lock(&(monitoring->mutex_propagation));
+        monitoring->propagation_backlog -= nb_queued;
+        pthread_mutex_unlock(&(monitoring->mutex_propagation));
 
-    void * rd_buf = malloc(archive_size(wsp_arch_higher));
-    double agregated_values[wsp_arch_higher->points];
+        if (whisper_fd >= 0)
+            whisper_release_file(metric, whisper_fd);
+        free(values);
+        free(written);
+        free(slots);
 
-    archive_point_t new_arch_pt;
+        return status;
 
-    memset(rd_buf, 0, archive_size(wsp_arch_higher));
+}
+
+/*
+ * Read the values of the whisper file between from and until (excluded) in
+ * the archive with the highest precision whose retention covers from, as done
+ * by the reference implementation. Only the needed slots are read, in one
+ * positional read or two if the range wraps around the end of the archive.
+ * Returns NULL if the file cannot be read or if the range is out of the file
+ * retention.
+ */
+static whisper_series_t * whisper_fetch_file(const char *filename,
+                                             uint32_t from, uint32_t until) {
 
-    /* determine read interval in higher precision archive */
+    int whisper_fd = -1;
+    int archive_id = 0;
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t oldest = 0,
+             base = 0,
+             from_interval = 0,
+             until_interval = 0,
+             nb_points = 0,
+             i = 0;
+    whisper_metadata_t *wsp_md = NULL;
+    archive_info_t *arch_info = NULL;
+    whisper_series_t *series = NULL;
+    void *rd_buf = NULL;
+    uint32_t *timestamps = NULL;
 
-    // goto first point of higher precision archive to get its timestamp
-    whisper_seek(whisper_fd, wsp_arch_higher->offset);
-    first_higher_point = whisper_read_archive_point(whisper_fd);
+    whisper_fd = open(filename, O_RDONLY);
 
-    // calculate the number of points between the first and the one with good timestamp
-    points_distance = (whisper_higher_archive_timestamp_start(timestamp, wsp_arch_higher, wsp_arch_lower)
-                       - first_higher_point->timestamp )
-                      / wsp_arch_higher->seconds_per_point;
+    if (whisper_fd < 0) {
+        if (errno != ENOENT)
+            error("error while opening file %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
 
-    higher_start_offset = wsp_arch_higher->offset +
-                          ((points_distance * WHISPER_POINT_SIZE)
-                           % archive_size(wsp_arch_higher));
+    wsp_md = whisper_read_metadata(whisper_fd);
+    if (wsp_md == NULL)
+        goto end;
 
-    nb_higher_points = wsp_arch_lower->seconds_per_point /
-                       wsp_arch_higher->seconds_per_point;
+    oldest = now > wsp_md->max_retention ? now - wsp_md->max_retention : 0;
 
-    higher_end_offset = (higher_start_offset +
-                         nb_higher_points * WHISPER_POINT_SIZE)
-                        % archive_size(wsp_arch_higher);
-
-    if (higher_start_offset < higher_end_offset) {
-        whisper_seek(whisper_fd, higher_start_offset);
-        rd_len = higher_end_offset - higher_start_offset;
-        debug("reading from %d->%d", higher_start_offset, higher_end_offset);
-        read(whisper_fd, rd_buf, higher_end_offset - higher_start_offset);
-    }
-    else {
-        whisper_seek(whisper_fd, higher_start_offset);
-        rd_len = archive_offset_end(wsp_arch_higher) - higher_start_offset;
-        debug("reading from %d->%d + %d->%d",
-              higher_start_offset,
-              archive_offset_end(wsp_arch_higher),
-              wsp_arch_higher->offset,
-              higher_end_offset);
-        if (read(whisper_fd, rd_buf, rd_len) != rd_len) {
-            error("error while reading file: %s\n", strerror(errno));
-        }
-        whisper_seek(whisper_fd, wsp_arch_higher->offset);
-        rd_len2 = wsp_arch_higher->offset - higher_end_offset;
-        if (read(whisper_fd, rd_buf+rd_len, rd_len2) != rd_len2) {
-            error("error while reading file: %s\n", strerror(errno));
-        }
-        rd_len += rd_len2;
+    if (until > now)
+        until = now;
+    if (from < oldest)
+        from = oldest;
+    if (from >= until) {
+        debug("whisper: fetch range out of retention of %s", filename);
+        goto end;
     }
 
-    nb_known_points = 0;
-    cur_timestamp = whisper_higher_archive_timestamp_start(timestamp, wsp_arch_higher, wsp_arch_lower);
+    /* select the first archive whose retention covers from */
+    for (archive_id = 0; archive_id < wsp_md->archive_count; archive_id++) {
+        free(arch_info);
+        arch_info = whisper_read_archive_info(whisper_fd, archive_id);
+        if (arch_info == NULL)
+            goto end;
+        if (archive_retention(arch_info) >= now - from)
+            break;
+    }
 
-    for(higher_point_id=0; higher_point_id < nb_higher_points; higher_point_id++) {
-        tmp_point = ((archive_point_t *)rd_buf) + higher_point_id;
-        ntoh_archive_point(tmp_point);
+    if (arch_info == NULL)
+        goto end;
 
-        if (tmp_point->timestamp == cur_timestamp)
-            agregated_values[nb_known_points++] = tmp_point->value;
-        
-        cur_timestamp += wsp_arch_higher->seconds_per_point;
+    from_interval = from - (from % arch_info->seconds_per_point)
+                    + arch_info->seconds_per_point;
+    until_interval = until - (until % arch_info->seconds_per_point)
+                     + arch_info->seconds_per_point;
+    if (from_interval == until_interval)
+        until_interval += arch_info->seconds_per_point;
+
+    nb_points = (until_interval - from_interval) / arch_info->seconds_per_point;
+    if (nb_points > arch_info->points) {
+        nb_points = arch_info->points;
+        from_interval = until_interval - nb_points * arch_info->seconds_per_point;
     }
 
-    // print agregated values
-    /*
-    printf("agregated_values: ");
-    for(higher_point_id=0; higher_point_id < nb_known_values; higher_point_id++) {
-        printf("%f ", agregated_values[higher_point_id]);
+    series = calloc(1, sizeof(whisper_series_t));
+    series->from = from_interval;
+    series->until = until_interval;
+    series->step = arch_info->seconds_per_point;
+    series->nb_values = nb_points;
+    series->values = malloc(nb_points * sizeof(double));
+
+    rd_buf = malloc(nb_points * WHISPER_POINT_SIZE);
+    timestamps = malloc(nb_points * sizeof(uint32_t));
+
+    base = whisper_read_base_timestamp(whisper_fd, arch_info);
+
+    if (whisper_read_span(whisper_fd, arch_info, base, from_interval,
+                          nb_points, rd_buf)) {
+        whisper_series_free(series);
+        series = NULL;
+        goto end;
     }
-    printf("\n");
-    */
 
-    if (nb_known_points / nb_higher_points >= wsp_md->x_files_factor) {
+    decode_archive_points(rd_buf, nb_points, timestamps, series->values);
+
+    /* points left by a previous round of the archive are unknown */
+    for (i = 0; i < nb_points; i++)
+        if (timestamps[i] != from_interval + i * arch_info->seconds_per_point)
+            series->values[i] = NAN;
+
+    end:
+        close(whisper_fd);
+        free(wsp_md);
+        free(arch_info);
+        free(rd_buf);
+        free(timestamps);
+
+        return series;
+
+}
+
+/*
+ * Fetch the values of metric between from and until, see
+ * whisper_fetch_file(). The returned series must be released with
+ * whisper_series_free().
+ */
+whisper_series_t * whisper_fetch(const char *metric_name,
+                                 uint32_t from, uint32_t until) {
+
+    whisper_series_t *series = NULL;
+    char *filename = whisper_metric_filename(metric_name, WHISPER_EXTENSION);
+
+    debug("whisper: fetching %s from %" PRIu32 " until %" PRIu32 "",
+          filename, from, until);
+    series = whisper_fetch_file(filename, from, until);
+    free(filename);
+
+    return series;
+
+}
+
+/*
+ * Returns the number of seconds per point of the highest precision archive of
+ * metric according to storage schemas, 0 if no schema matches. The longest
+ * retention of its archives, in seconds, is set in max_retention.
+ */
+uint32_t whisper_metric_step(const char *metric_name, uint32_t *max_retention) {
+
+    metric_t metric;
+    retention_t *retention = NULL, *cur_ret = NULL;
+
+    memset(&metric, 0, sizeof(metric_t));
+    metric.name = (char *) metric_name;
+
+    retention = whisper_find_retention(&metric);
 
-        new_value = whisper_aggregate_values(agregated_values, 
-                                             nb_known_points,
-                                             wsp_md->aggregation_type);
-        // write new value
-        debug("write value %f with timestamp %" PRIu32 "", new_value, timestamp);
-        new_arch_pt.timestamp = timestamp;
-        new_arch_pt.value = new_value;
-        hton_archive_point(&new_arch_pt);
+    *max_retention = 0;
+    for (cur_ret = retention; cur_ret; cur_ret = cur_ret->next)
+        if (cur_ret->time_to_store > *max_retention)
+            *max_retention = cur_ret->time_to_store;
 
-        whisper_write_point(whisper_fd, wsp_arch_lower, timestamp, new_arch_pt);
+    return retention ? retention->time_per_point : 0;
 
+}
+
+void whisper_series_free(whisper_series_t *series) {
+
+    if (!series)
+        return;
+
+    free(series->values);
+    free(series);
+
+}
+
+/*
+ * New archive of a whisper file being resized, or span of archive being
+ * imported, as a dense series of slots from start. Unknown slots have a null
+ * timestamp.
+ */
+struct whisper_resize_s {
+    archive_info_t info;
+    uint32_t start;
+    uint32_t *timestamps;
+    double *values;
+};
+
+typedef struct whisper_resize_s whisper_resize_t;
+
+static int compare_archive_points(const void *a, const void *b) {
+
+    uint32_t ta = ((const archive_point_t *)a)->timestamp,
+             tb = ((const archive_point_t *)b)->timestamp;
+
+    return (ta > tb) - (ta < tb);
+
+}
+
+/*
+ * Fill the unknown slots of new archive with the nb_points points, sorted by
+ * timestamp, of an old archive with step seconds per point. The points are
+ * aggregated according to aggregation type and xff into the slots they are
+ * propagated to by whisper_write_value() when the new archive has lower
+ * precision, copied when it has the same, or put in the slot of their
+ * timestamp otherwise.
+ */
+static void whisper_resize_fill(whisper_resize_t *new,
+                                const archive_point_t *points,
+                                uint32_t nb_points, uint32_t step,
+                                uint32_t aggregation_type, float xff) {
+
+    uint32_t new_step = new->info.seconds_per_point,
+             end = new->start + new->info.points * new_step,
+             ratio = new_step / step,
+             slot = 0, start = 0, index = 0, nb_known = 0, i = 0, j = 0;
+    uint32_t *span_ts = NULL;
+    double *span_values = NULL, value = 0.0;
+
+    if (new_step % step) {
+        for (i = 0; i < nb_points; i++) {
+            slot = points[i].timestamp - points[i].timestamp % new_step;
+            if (slot < new->start || slot >= end)
+                continue;
+            index = (slot - new->start) / new_step;
+            if (new->timestamps[index])
+                continue;
+            new->timestamps[index] = slot;
+            new->values[index] = points[i].value;
+        }
+        return;
     }
-    else
-        debug("known values (%" PRIu32 ") below xff", nb_known_points);
 
-    free(first_higher_point);
-    free(rd_buf);
+    span_ts = calloc(ratio, sizeof(uint32_t));
+    span_values = calloc(ratio, sizeof(double));
 
-    return EXIT_SUCCESS;
+    for (i = 0; i < nb_points; i = j) {
+
+        slot = whisper_lower_archive_slot(points[i].timestamp, &new->info);
+        start = slot - new_step + step;
+        for (j = i; j < nb_points && points[j].timestamp <= slot; j++) {
+            /* points not aligned on the step of their archive */
+            if (points[j].timestamp < start
+                || (points[j].timestamp - start) % step)
+                continue;
+            span_ts[(points[j].timestamp - start) / step] = points[j].timestamp;
+            span_values[(points[j].timestamp - start) / step] = points[j].value;
+        }
+
+        if (slot >= new->start && slot < end) {
+            index = (slot - new->start) / new_step;
+            nb_known = aggregate_points(aggregation_type, span_ts, span_values,
+                                        ratio, start, step, &value);
+            if (!new->timestamps[index] && nb_known
+                && (float) nb_known / ratio >= xff) {
+                new->timestamps[index] = slot;
+                new->values[index] = value;
+            }
+        }
+
+        /* clear span for next slot */
+        memset(span_ts, 0, ratio * sizeof(uint32_t));
+    }
+
+    free(span_ts);
+    free(span_values);
 
 }
 
-int whisper_write_value(const metric_t * metric,
-                        uint32_t timestamp, double value) {
+/*
+ * Write the slots of new archive in file, starting with its oldest known slot
+ * so that the archive base is the timestamp of its first point. Returns 0 on
+ * success, 1 on error.
+ */
+static int whisper_resize_write(int whisper_fd, const whisper_resize_t *new) {
 
-    int whisper_fd = -1;
-    int archive_id = 0;
-    uint32_t aligned_timestamp = 0;
-    bool end_loop = false; // flag for propagation loop
+    uint32_t nb_points = new->info.points, first = 0, i = 0;
+    uint32_t *timestamps = calloc(nb_points, sizeof(uint32_t));
+    double *values = calloc(nb_points, sizeof(double));
+    void *buf = malloc(nb_points * WHISPER_POINT_SIZE);
+    size_t len = nb_points * WHISPER_POINT_SIZE;
+    int rc = 0;
 
-    whisper_metadata_t *wsp_md = NULL;
-    archive_info_t *wsp_arch = NULL;
-    archive_info_t *wsp_arch_higher = NULL, // for propagation
-                   *wsp_arch_lower = NULL;
-    archive_point_t *first_arch_pt = NULL;
-    archive_point_t new_arch_pt;
-    char *filename = whisper_metric_filename(metric);
+    while (first < nb_points && new->timestamps[first] == 0)
+        first++;
+
+    for (i = first; i < nb_points; i++) {
+        timestamps[i - first] = new->timestamps[i];
+        values[i - first] = new->values[i];
+    }
+
+    encode_archive_points(timestamps, values, nb_points, buf);
+
+    if (pwrite(whisper_fd, buf, len, new->info.offset) != (ssize_t) len) {
+        error("error while writing file: %s\n", strerror(errno));
+        rc = 1;
+    }
+
+    free(timestamps);
+    free(values);
+    free(buf);
 
-    debug("whisper: opening file %s", filename);
-    whisper_fd = open(filename, O_RDWR);
+    return rc;
 
+}
+
+/*
+ * Rewrite the whisper file of metric with the archives of the storage schema
+ * and the aggregation currently matching its name, as whisper-resize does. Each
+ * new archive is propagated from the new archive above, then the points of old
+ * archives, from the highest precision, fill its slots still unknown, see
+ * whisper_resize_fill(). The new file is written under a temporary name and
+ * renamed over the old one. If changed_only is true, files which already have
+ * this layout are left untouched. Returns 1 if the file is rewritten, 0 if it
+ * is left untouched and -1 on error.
+ */
+int whisper_resize_file(const char *filename, const char *metric_name,
+                        bool changed_only) {
+
+    metric_t metric;
+    retention_t *retention = NULL, *cur_ret = NULL;
+    pattern_aggregation_t *agg = NULL;
+    whisper_metadata_t *wsp_md = NULL, new_wsp_md;
+    archive_info_t *arch_info = NULL, new_arch_info;
+    whisper_resize_t *new_archs = NULL;
+    archive_point_t **old_points = NULL, *new_points = NULL, *points = NULL;
+    uint32_t *old_nb_points = NULL, *old_steps = NULL, *timestamps = NULL;
+    double *values = NULL;
+    void *rd_buf = NULL;
+    uint32_t now = (uint32_t) time(NULL), nb_new = 0, max_retention = 0,
+             nb_points = 0, oldest = 0, id = 0, i = 0;
+    bool same = true;
+    char tmp_filename[PATH_MAX + 4];
+    struct stat st;
+    int whisper_fd = -1, new_fd = -1, ret = -1;
+
+    memset(&metric, 0, sizeof(metric_t));
+    metric.name = (char *) metric_name;
+
+    retention = whisper_find_retention(&metric);
+    agg = whisper_find_aggregation(&metric);
+    if (retention == NULL || agg == NULL) {
+        error("no storage schema or aggregation for metric %s", metric_name);
+        return -1;
+    }
+
+    whisper_fd = open(filename, O_RDONLY);
     if (whisper_fd < 0) {
-        switch(errno) {
-            case ENOENT:
-                whisper_fd = whisper_create_file(metric);
-                break;
-            default:
-                error("error while opening file: %s\n", strerror(errno));
-                return EXIT_FAILURE;
-        }
+        error("error while opening file %s: %s", filename, strerror(errno));
+        return -1;
     }
 
     wsp_md = whisper_read_metadata(whisper_fd);
+    if (wsp_md == NULL || fstat(whisper_fd, &st)
+        || st.st_size < WHISPER_HEADER_SIZE
+                        + wsp_md->archive_count * WHISPER_ARCHIVE_SIZE) {
+        error("invalid whisper file %s", filename);
+        goto end;
+    }
 
-    if (wsp_md == NULL)
-        return EXIT_FAILURE;
+    for (cur_ret = retention; cur_ret; cur_ret = cur_ret->next) {
+        if (cur_ret->time_to_store > max_retention)
+            max_retention = cur_ret->time_to_store;
+        nb_new++;
+    }
 
-    /* TODO: check timestamp < wsp max retention of the highest precision archive */
-    wsp_arch = whisper_read_archive_info(whisper_fd, 0);
+    new_archs = calloc(nb_new, sizeof(whisper_resize_t));
+
+    for (cur_ret = retention, id = 0; cur_ret; cur_ret = cur_ret->next, id++) {
+        new_archs[id].info.offset = whisper_get_archive_offset(retention, id);
+        new_archs[id].info.seconds_per_point = cur_ret->time_per_point;
+        new_archs[id].info.points = cur_ret->time_to_store
+                                    / cur_ret->time_per_point;
+        /* the newest slot is the one of now */
+        new_archs[id].start = now - now % cur_ret->time_per_point
+                              - (new_archs[id].info.points - 1)
+                                * cur_ret->time_per_point;
+    }
 
-    if (wsp_arch == NULL)
-        return EXIT_FAILURE;
+    same = wsp_md->archive_count == nb_new
+           && wsp_md->aggregation_type == agg->method
+           && wsp_md->x_files_factor == agg->xff;
 
-    /*
-     * Align timestamp to archive sampling rate.
-     * for example, with:
-     *   - timestamp: 188
-     *   - seconds_per_point: 60
-     * arch_pt.timestamp = 188 - (188 % 60)
-     *                   = 188 - 8
-     *                   = 180
-     */
-    aligned_timestamp = timestamp - (timestamp % wsp_arch->seconds_per_point);
-    new_arch_pt.timestamp = aligned_timestamp;
-    new_arch_pt.value = value;
-    //printf("whisper: before %#010" PRIx32" %#018" PRIx64 "\n", new_arch_pt.timestamp, *(int64_t *)&new_arch_pt.value);
-    hton_archive_point(&new_arch_pt);
-    //printf("whisper: after  %#010" PRIx32" %#018" PRIx64 "\n", new_arch_pt.timestamp, *(int64_t *)&new_arch_pt.value);
+    for (id = 0; same && id < nb_new; id++) {
+        free(arch_info);
+        arch_info = whisper_read_archive_info(whisper_fd, id);
+        same = arch_info
+               && arch_info->seconds_per_point
+                  == new_archs[id].info.seconds_per_point
+               && arch_info->points == new_archs[id].info.points;
+    }
 
-    whisper_write_point(whisper_fd, wsp_arch, aligned_timestamp, new_arch_pt);
+    if (same && changed_only) {
+        ret = 0;
+        goto end;
+    }
 
-    // propogation to lower precision archives
-    wsp_arch_higher = wsp_arch;
-    end_loop = false;
+    for (id = 0; id < nb_new; id++) {
+        new_archs[id].timestamps = calloc(new_archs[id].info.points,
+                                          sizeof(uint32_t));
+        new_archs[id].values = calloc(new_archs[id].info.points,
+                                      sizeof(double));
+    }
 
-    for(archive_id=1; !end_loop && archive_id < wsp_md->archive_count; archive_id++) {
-        wsp_arch_lower = whisper_read_archive_info(whisper_fd, archive_id);
+    old_points = calloc(wsp_md->archive_count, sizeof(archive_point_t *));
+    old_nb_points = calloc(wsp_md->archive_count, sizeof(uint32_t));
+    old_steps = calloc(wsp_md->archive_count, sizeof(uint32_t));
 
-        assert(wsp_arch_lower->seconds_per_point != 0);
+    for (id = 0; id < wsp_md->archive_count; id++) {
 
-        // only if timestamp can be divided by lower archive seconds per point
-        if (aligned_timestamp % wsp_arch_lower->seconds_per_point == 0) {
-            debug("propagate to archive %d", archive_id);
-            whisper_write_propagate(whisper_fd, aligned_timestamp, wsp_md, wsp_arch_higher, wsp_arch_lower);
+        free(arch_info);
+        arch_info = whisper_read_archive_info(whisper_fd, id);
+        if (arch_info == NULL || arch_info->seconds_per_point == 0
+            || (off_t) archive_offset_end(arch_info) > st.st_size) {
+            error("invalid archive %" PRIu32 " in whisper file %s", id,
+                  filename);
+            goto end;
         }
-        else {
-            debug("end loop at archive %d", archive_id);
-            end_loop = true;
+
+        rd_buf = realloc(rd_buf, archive_size(arch_info));
+        timestamps = realloc(timestamps, arch_info->points * sizeof(uint32_t));
+        values = realloc(values, arch_info->points * sizeof(double));
+        points = malloc(arch_info->points * sizeof(archive_point_t));
+        old_points[id] = points;
+        old_steps[id] = arch_info->seconds_per_point;
+
+        if (pread(whisper_fd, rd_buf, archive_size(arch_info), arch_info->offset)
+            != (ssize_t) archive_size(arch_info)) {
+            error("error while reading file %s: %s", filename, strerror(errno));
+            goto end;
+        }
+
+        decode_archive_points(rd_buf, arch_info->points, timestamps, values);
+
+        /* points left by a previous round of the archive are dropped */
+        oldest = now > archive_retention(arch_info)
+                 ? now - archive_retention(arch_info) : 0;
+        for (i = 0, nb_points = 0; i < arch_info->points; i++) {
+            if (timestamps[i] == 0 || timestamps[i] <= oldest)
+                continue;
+            points[nb_points].timestamp = timestamps[i];
+            points[nb_points].value = values[i];
+            nb_points++;
         }
-        if(wsp_arch_higher != wsp_arch)
-            free(wsp_arch_higher);
-        wsp_arch_higher = wsp_arch_lower;
 
+        qsort(points, nb_points, sizeof(archive_point_t),
+              compare_archive_points);
+        old_nb_points[id] = nb_points;
     }
 
-    free(wsp_arch_lower);
-    free(wsp_md);
-    free(wsp_arch);
-    free(first_arch_pt);
-    free(filename);
+    for (id = 0; id < nb_new; id++) {
 
-    close(whisper_fd);
+        /*
+         * Lower archives are first propagated from the new archive above, as
+         * whisper_write_value() does, old archives fill the slots left.
+         */
+        if (id > 0) {
+            points = realloc(new_points,
+                             new_archs[id - 1].info.points
+                             * sizeof(archive_point_t));
+            new_points = points;
+            for (i = 0, nb_points = 0; i < new_archs[id - 1].info.points; i++) {
+                if (new_archs[id - 1].timestamps[i] == 0)
+                    continue;
+                points[nb_points].timestamp = new_archs[id - 1].timestamps[i];
+                points[nb_points].value = new_archs[id - 1].values[i];
+                nb_points++;
+            }
+            whisper_resize_fill(&new_archs[id], points, nb_points,
+                                new_archs[id - 1].info.seconds_per_point,
+                                agg->method, agg->xff);
+        }
 
-    debug("end writing value %f at timestamp %" PRIu32 " (%" PRIu32 ")",
-           value, timestamp, aligned_timestamp);
+        /* highest precision first, its points win */
+        for (i = 0; i < wsp_md->archive_count; i++)
+            whisper_resize_fill(&new_archs[id], old_points[i], old_nb_points[i],
+                                old_steps[i], agg->method, agg->xff);
+    }
 
-    return EXIT_SUCCESS;
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+
+    new_fd = open(tmp_filename, O_WRONLY|O_CREAT|O_TRUNC, st.st_mode & 0777);
+    if (new_fd < 0) {
+        error("error while creating file %s: %s", tmp_filename,
+              strerror(errno));
+        goto end;
+    }
+
+    new_wsp_md.aggregation_type = agg->method;
+    new_wsp_md.max_retention = max_retention;
+    new_wsp_md.x_files_factor = agg->xff;
+    new_wsp_md.archive_count = nb_new;
+    hton_whisper_metadata(&new_wsp_md);
+
+    if (write(new_fd, &new_wsp_md, WHISPER_HEADER_SIZE) < WHISPER_HEADER_SIZE)
+        goto write_error;
+
+    for (id = 0; id < nb_new; id++) {
+        new_arch_info = new_archs[id].info;
+        hton_archive_info(&new_arch_info);
+        if (write(new_fd, &new_arch_info, WHISPER_ARCHIVE_SIZE)
+            < WHISPER_ARCHIVE_SIZE)
+            goto write_error;
+    }
+
+    for (id = 0; id < nb_new; id++)
+        if (whisper_resize_write(new_fd, &new_archs[id]))
+            goto write_error;
+
+    if (fdatasync(new_fd))
+        goto write_error;
+    if (close(new_fd)) {
+        new_fd = -1;
+        goto write_error;
+    }
+
+    if (rename(tmp_filename, filename)) {
+        error("error while renaming file %s: %s", tmp_filename,
+              strerror(errno));
+        unlink(tmp_filename);
+        goto end;
+    }
+
+    debug("whisper: resized %s with %" PRIu32 " archives", filename, nb_new);
+    ret = 1;
+    goto end;
+
+    write_error:
+        error("error while writing file %s: %s", tmp_filename,
+              strerror(errno));
+        if (new_fd >= 0)
+            close(new_fd);
+        unlink(tmp_filename);
+
+    end:
+        close(whisper_fd);
+        for (id = 0; new_archs && id < nb_new; id++) {
+            free(new_archs[id].timestamps);
+            free(new_archs[id].values);
+        }
+        free(new_archs);
+        for (id = 0; old_points && id < wsp_md->archive_count; id++)
+            free(old_points[id]);
+        free(old_points);
+        free(old_nb_points);
+        free(old_steps);
+        free(new_points);
+        free(wsp_md);
+        free(arch_info);
+        free(rd_buf);
+        free(timestamps);
+        free(values);
+
+        return ret;
+
+}
+
+/*
+ * Returns the slot of archive which a point of the highest precision archive,
+ * with step seconds per point, at timestamp goes to, see whisper_resize_fill().
+ */
+static inline uint32_t whisper_import_slot(uint32_t timestamp,
+                                           archive_info_t *archive,
+                                           uint32_t step) {
+
+    if (archive->seconds_per_point % step)
+        return timestamp - timestamp % archive->seconds_per_point;
+
+    return whisper_lower_archive_slot(timestamp, archive);
+}
+
+/*
+ * Decode the nb_points raw points of buf, read from the slot of timestamp from
+ * of an archive with step seconds per point, into points in ascending order.
+ * Unknown slots and those left by a previous round of the archive are skipped.
+ * Returns the number of points decoded.
+ */
+static uint32_t whisper_span_points(const void *buf, uint32_t nb_points,
+                                    uint32_t from, uint32_t step,
+                                    archive_point_t *points) {
+
+    uint32_t *timestamps = malloc(nb_points * sizeof(uint32_t));
+    double *values = malloc(nb_points * sizeof(double));
+    uint32_t nb_known = 0, i = 0;
+
+    decode_archive_points(buf, nb_points, timestamps, values);
+
+    for (i = 0; i < nb_points; i++) {
+        if (timestamps[i] != from + i * step)
+            continue;
+        points[nb_known].timestamp = timestamps[i];
+        points[nb_known].value = values[i];
+        nb_known++;
+    }
+
+    free(timestamps);
+    free(values);
+
+    return nb_known;
+
+}
+
+/*
+ * Import the nb_points points of metric, sorted by timestamp, in its whisper
+ * file, created if missing, without going through the cache. Each point goes
+ * to the highest precision archive whose retention covers it, the others are
+ * dropped. The last point of a slot wins in the highest precision archive, the
+ * points of a slot are aggregated in the others. The archives are updated in
+ * turn over the span of slots imported, read and written back at once, and the
+ * slots of the span of the archive above are propagated to the next one in the
+ * same pass, as whisper_write_value() does. Slots already known in the file
+ * are kept, unless overwrite is true or they are propagated. carbond must not
+ * write the file meanwhile. Returns the number of points imported, -1 on
+ * error.
+ */
+int whisper_import_points(metric_t *metric, const uint32_t *timestamps,
+                          const double *values, uint32_t nb_points,
+                          bool overwrite) {
+
+    whisper_cache_t *cache = NULL;
+    archive_info_t *arch = NULL, *higher = NULL;
+    whisper_resize_t span;
+    archive_point_t *rd_buf = NULL, *existing = NULL, *direct = NULL,
+                    *propagated = NULL;
+    uint32_t *oldest = NULL, *newest = NULL;
+    uint32_t now = (uint32_t) time(NULL), step = 0, slot = 0, lower = 0,
+             first = 0, last = 0, prev_first = 0, prev_last = 0, from = 0, to = 0,
+             nb_existing = 0, nb_direct = 0, nb_propagated = 0, nb_span = 0,
+             nb_imported = 0, agg = 0, count = 0, id = 0, i = 0;
+    uint64_t span_retention = 0;
+    float xff = 0.0;
+    bool prev = false;
+    int whisper_fd = -1, ret = -1;
+
+    memset(&span, 0, sizeof(whisper_resize_t));
+
+    whisper_fd = whisper_open_file(metric, true);
+
+    if (whisper_fd < 0)
+        return -1;
+
+    if (whisper_register_file(metric, whisper_fd)) {
+        if (!metric->wsp_cache->has_fd)
+            close(whisper_fd);
+        return -1;
+    }
+
+    cache = metric->wsp_cache;
+    count = cache->metadata.archive_count;
+    agg = cache->metadata.aggregation_type;
+    xff = cache->metadata.x_files_factor;
+
+    oldest = calloc(count, sizeof(uint32_t));
+    newest = calloc(count, sizeof(uint32_t));
+
+    /* the newest slot of lower archives is the one now is propagated to */
+    step = cache->archives[0].seconds_per_point;
+    for (id = 0; id < count; id++) {
+        arch = &cache->archives[id];
+        newest[id] = whisper_import_slot(now - now % step, arch, step);
+        span_retention = (uint64_t) (arch->points - 1) * arch->seconds_per_point;
+        oldest[id] = newest[id] > span_retention ? newest[id] - span_retention : 0;
+    }
+
+    /* points out of the retentions of all archives are dropped */
+    for (i = 0; i < nb_points; i++) {
+        slot = timestamps[i] - timestamps[i] % step;
+        for (id = 0; slot <= newest[0] && id < count; id++)
+            if (whisper_import_slot(slot, &cache->archives[id], step)
+                >= oldest[id]) {
+                nb_imported++;
+                break;
+            }
+    }
+
+    direct = malloc(nb_points * sizeof(archive_point_t));
+
+    for (id = 0; id < count; id++, higher = arch) {
+
+        arch = &cache->archives[id];
+        first = UINT32_MAX;
+        last = 0;
+
+        /*
+         * Points imported in the slots of this archive which the archive
+         * above does not entirely cover, aligned on the highest precision
+         * archive.
+         */
+        for (i = 0, nb_direct = 0; i < nb_points; i++) {
+            slot = timestamps[i] - timestamps[i] % step;
+            lower = whisper_import_slot(slot, arch, step);
+            if (slot > newest[0] || lower < oldest[id]
+                || (id && whisper_higher_archive_timestamp_start(lower, higher,
+                                                                 arch)
+                          >= oldest[id - 1]))
+                continue;
+            if (nb_direct && direct[nb_direct - 1].timestamp == slot)
+                nb_direct--;
+            direct[nb_direct].timestamp = slot;
+            direct[nb_direct].value = values[i];
+            nb_direct++;
+            if (lower < first)
+                first = lower;
+            if (lower > last)
+                last = lower;
+        }
+
+        /* slots the span of the archive above is propagated to */
+        nb_propagated = 0;
+        if (prev && arch->seconds_per_point % higher->seconds_per_point == 0) {
+            from = whisper_lower_archive_slot(prev_first, arch);
+            to = whisper_lower_archive_slot(prev_last, arch);
+            if (from < oldest[id])
+                from = oldest[id];
+            /* first slot entirely covered by the archive above */
+            lower = whisper_lower_archive_slot(oldest[id - 1]
+                                               + arch->seconds_per_point
+                                               - higher->seconds_per_point,
+                                               arch);
+            if (from < lower)
+                from = lower;
+            if (to > newest[id])
+                to = newest[id];
+            if (from < first && from <= to)
+                first = from;
+            if (to > last && from <= to)
+                last = to;
+
+            /* points of the archive above aggregated in these slots */
+            from = whisper_higher_archive_timestamp_start(from, higher, arch);
+            if (to > newest[id - 1])
+                to = newest[id - 1];
+            if (from <= to) {
+                nb_span = (to - from) / higher->seconds_per_point + 1;
+                rd_buf = realloc(rd_buf, nb_span * WHISPER_POINT_SIZE);
+                propagated = realloc(propagated,
+                                     nb_span * sizeof(archive_point_t));
+                if (whisper_read_span(whisper_fd, higher, cache->bases[id - 1],
+                                      from, nb_span, rd_buf))
+                    goto end;
+                nb_propagated = whisper_span_points(rd_buf, nb_span, from,
+                                                    higher->seconds_per_point,
+                                                    propagated);
+            }
+        }
+
+        prev = first <= last;
+        if (!prev)
+            continue;
+        prev_first = first;
+        prev_last = last;
+
+        nb_span = (last - first) / arch->seconds_per_point + 1;
+        rd_buf = realloc(rd_buf, nb_span * WHISPER_POINT_SIZE);
+        existing = realloc(existing, nb_span * sizeof(archive_point_t));
+        if (whisper_read_span(whisper_fd, arch, cache->bases[id], first,
+                              nb_span, rd_buf))
+            goto end;
+        nb_existing = whisper_span_points(rd_buf, nb_span, first,
+                                          arch->seconds_per_point, existing);
+
+        span.info = *arch;
+        span.info.points = nb_span;
+        span.start = first;
+        free(span.timestamps);
+        free(span.values);
+        span.timestamps = calloc(nb_span, sizeof(uint32_t));
+        span.values = calloc(nb_span, sizeof(double));
+
+        /*
+         * A slot is only filled once, by the first points given. Propagated
+         * slots are always recomputed, as the archive above is merged.
+         */
+        if (nb_propagated)
+            whisper_resize_fill(&span, propagated, nb_propagated,
+                                higher->seconds_per_point, agg, xff);
+        if (!overwrite)
+            whisper_resize_fill(&span, existing, nb_existing,
+                                arch->seconds_per_point, agg, xff);
+        whisper_resize_fill(&span, direct, nb_direct, step, agg, 0.0);
+        if (overwrite)
+            whisper_resize_fill(&span, existing, nb_existing,
+                                arch->seconds_per_point, agg, xff);
+
+        /* unknown slots are written back as they were read */
+        for (i = 0; i < nb_span; i++) {
+            if (span.timestamps[i] == 0)
+                continue;
+            rd_buf[i].timestamp = span.timestamps[i];
+            rd_buf[i].value = span.values[i];
+            hton_archive_point(&rd_buf[i]);
+        }
+
+        /* an empty archive starts with the first point written */
+        i = 0;
+        if (cache->bases[id] == 0) {
+            while (i < nb_span && span.timestamps[i] == 0)
+                i++;
+            if (i == nb_span) {
+                prev = false;
+                continue;
+            }
+            cache->bases[id] = span.timestamps[i];
+        }
+
+        if (whisper_write_span(whisper_fd, arch, cache->bases[id],
+                               first + i * arch->seconds_per_point,
+                               nb_span - i, rd_buf + i)) {
+            cache->has_layout = false;
+            goto end;
+        }
+    }
+
+    debug("whisper: imported %" PRIu32 " points of %s", nb_imported,
+          metric->name);
+    ret = (int) nb_imported;
+
+    end:
+        whisper_release_file(metric, whisper_fd);
+        free(oldest);
+        free(newest);
+        free(direct);
+        free(existing);
+        free(propagated);
+        free(rd_buf);
+        free(span.timestamps);
+        free(span.values);
+
+        return ret;
 
 }
 
 void whisper_print_file(const char * filename) {
 
     int whisper_fd = -1;
-    int sk_res = -1,
-        archive_id = 0,
+    int archive_id = 0,
         point_id = 0;
     uint32_t loop_offset = 0;
     whisper_metadata_t *wsp_md = NULL;
     archive_info_t *arch_info = NULL;
-    archive_point_t *arch_pt = NULL;
+    void *rd_buf = NULL;
+    uint32_t *timestamps = NULL;
+    double *values = NULL;
 
     whisper_fd = open(filename, O_RDONLY);
     wsp_md = whisper_read_metadata(whisper_fd);
 
+    if (wsp_md == NULL) {
+        close(whisper_fd);
+        return;
+    }
+
     printf("whisper file: %s\n", filename);
     printf("  aggregation_type: %" PRIu32 " max_retention: %" PRIu32 "  x_files_factor: %f archive_count: %" PRIu32 "\n",
            wsp_md->aggregation_type,
@@ -938,28 +3339,37 @@ void whisper_print_file(const char * filename) {
                archive_id, arch_info->offset, arch_info->seconds_per_point, arch_info->points);
 
         /*
-         * get all the data of the archive
+         * get all the data of the archive in one read
          */
+        rd_buf = malloc(archive_size(arch_info));
+        timestamps = malloc(arch_info->points * sizeof(uint32_t));
+        values = malloc(arch_info->points * sizeof(double));
 
-        loop_offset = arch_info->offset;
-
-        sk_res = lseek(whisper_fd, loop_offset , SEEK_SET);
-        if (sk_res < 0) {
-            error("error while seeking file: %s\n", strerror(errno));
-        }
+        if (pread(whisper_fd, rd_buf, archive_size(arch_info), arch_info->offset)
+            != archive_size(arch_info)) {
+            error("error while reading file: %s\n", strerror(errno));
+        } else {
+            decode_archive_points(rd_buf, arch_info->points, timestamps, values);
 
-        for(point_id=0; point_id<arch_info->points; point_id++) {
+            loop_offset = arch_info->offset;
 
-            arch_pt = whisper_read_archive_point(whisper_fd);
+            for(point_id=0; point_id<arch_info->points; point_id++) {
 
-            printf("  point %-5d: offset: %-5" PRIu32 " timestamp: %" PRIu32 " value: %f",
-                   point_id, loop_offset, arch_pt->timestamp, arch_pt->value);
+                printf("  point %-5d: offset: %-5" PRIu32 " timestamp: %" PRIu32 " value: %f\n",
+                       point_id, loop_offset, timestamps[point_id], values[point_id]);
 
-            loop_offset += WHISPER_POINT_SIZE;
+                loop_offset += WHISPER_POINT_SIZE;
 
+            }
         }
+
+        free(rd_buf);
+        free(timestamps);
+        free(values);
+        free(arch_info);
     }
 
+    free(wsp_md);
     close(whisper_fd);
 
 }
@@ -22,9 +22,22 @@
 #ifndef _WHISPER_H
 #define _WHISPER_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h> // ino_t
+
 #define WHISPER_HEADER_SIZE 16
 #define WHISPER_ARCHIVE_SIZE 12
 #define WHISPER_POINT_SIZE 12
+#define WHISPER_EXTENSION ".wsp"
+
+/* layout of a storage root, recorded in this file at its top */
+#define WHISPER_LAYOUT_FILE ".layout"
+#define WHISPER_FANOUT_MAX 4096
+#define WHISPER_FANOUT_NAME_LEN 5 /* dot and 3 hex digits */
+
+/* locked by the only process allowed to work on a storage root */
+#define WHISPER_LOCK_FILE ".lock"
 
 struct whisper_metadata_s {
     uint32_t aggregation_type;
@@ -50,7 +63,97 @@ struct archive_point_s {
 
 typedef struct archive_point_s archive_point_t;
 
-int whisper_write_value(const metric_t *, uint32_t, double);
+/*
+ * Aggregation state of the current slot of a lower precision archive, fed
+ * with the values written in the archive just above it. The slot is trusted
+ * once all of its values are known to have gone through the accumulator.
+ */
+struct archive_rollup_s {
+    uint32_t timestamp;      /* timestamp of the slot in lower archive */
+    uint32_t last_timestamp; /* timestamp of the last value accumulated */
+    uint32_t count;
+    double sum;
+    double min;
+    double max;
+    double last;
+    bool trusted;
+};
+
+typedef struct archive_rollup_s archive_rollup_t;
+
+/*
+ * Per metric in-memory state of its whisper file.
+ */
+struct whisper_cache_s {
+    /* header and archives of the file, read once per inode */
+    bool has_layout;
+    ino_t inode;
+    whisper_metadata_t metadata;
+    archive_info_t *archives;
+    /* timestamp of the first point of each archive, 0 if empty */
+    uint32_t *bases;
+    uint32_t nb_rollups; /* equals to the number of archives */
+    archive_rollup_t *rollups;
+    /* slots of archive 1 waiting for deferred propagation */
+    uint32_t nb_pending;
+    uint32_t size_pending;
+    uint32_t *pending;
+    uint32_t pending_since; /* time of the oldest pending slot */
+    /* file kept open in the open files cache, most recently used first */
+    bool has_fd;
+    int fd;
+    bool dirty; /* written since last sync, in batched durability mode */
+    pthread_mutex_t *metric_lock; /* held by the thread using the file */
+    struct whisper_cache_s *lru_prev;
+    struct whisper_cache_s *lru_next;
+};
+
+typedef struct whisper_cache_s whisper_cache_t;
+
+/*
+ * Dense series of values read from a whisper archive. Value i is at timestamp
+ * from + i * step, unknown values are NAN.
+ */
+struct whisper_series_s {
+    uint32_t from;
+    uint32_t until;
+    uint32_t step;
+    uint32_t nb_values;
+    double *values;
+};
+
+typedef struct whisper_series_s whisper_series_t;
+
+/* called with the path and the metric name of the files found in scan */
+typedef void (*whisper_scan_cb_t)(const char *, const char *, void *);
+
+uint32_t whisper_nb_roots();
+const char * whisper_root_dir(uint32_t);
+uint32_t whisper_metric_root(const char *);
+int whisper_syncfs_roots();
+bool whisper_is_fanout_dir(const char *);
+uint32_t whisper_scan_dir(char *, char *, const char *, whisper_scan_cb_t,
+                          void *);
+int whisper_layout_init();
+int whisper_lock_roots();
+char * whisper_metric_filename(const char *, const char *);
+void whisper_create_dirs(const metric_t *);
+retention_t * whisper_find_retention(const metric_t *);
+pattern_aggregation_t * whisper_find_aggregation(const metric_t *);
+int whisper_register_file(metric_t *, int);
+int whisper_write_value(metric_t *, uint32_t, double);
+int whisper_write_points(metric_t *, const uint32_t *, const double *, uint32_t);
+int whisper_propagate_pending(metric_t *);
+void whisper_cache_free(whisper_cache_t *);
+uint32_t whisper_sync_files();
+void whisper_close_files();
+void whisper_resolve_retention(metric_t *);
+bool whisper_in_retention(const metric_t *, uint32_t, uint32_t);
+whisper_series_t * whisper_fetch(const char *, uint32_t, uint32_t);
+uint32_t whisper_metric_step(const char *, uint32_t *);
+void whisper_series_free(whisper_series_t *);
+int whisper_resize_file(const char *, const char *, bool);
+int whisper_import_points(metric_t *, const uint32_t *, const double *, uint32_t, bool);
 void check_whisper_sizes();
 
 #endif
@@ -21,60 +21,304 @@
 
 #include "writer.h"
 #include "threads.h"
+#include "wal.h"
+#include "spill.h"
+#include "storage.h"
+
+/* seconds between two evictions of idle metrics */
+#define WRITER_EVICTION_PERIOD 10
 
 /*
- * Lock the metric, call whisper function to write all points in cache, and
- * finally empty and unlock the metric.
+ * Lock the metric, take all its points in cache, write them at once with the
+ * storage engine and finally unlock the metric. Points are taken at once so
+ * that receivers can keep on adding new points while they are written.
+ *
+ * If the points cannot be written, they are not released from the
+ * write-ahead log, so that they are replayed at next start. They are put back
+ * in cache only if keep_failed is true, else the metric would be picked again
+ * and again by the writer. Returns 1 if the points cannot be written.
  */
-void write_metric(struct metric * m) {
+int write_metric(struct metric * m, bool keep_failed) {
 
 
-    metric_point_t *mt_p = m->points,
-                   *mt_p_next = NULL;
+    metric_point_t *mt_p = NULL,
+                   *mt_p_next = NULL,
+                   *points = NULL;
+    uint32_t wal_segment = 0, nb_wal_points = 0, nb_points = 0;
+    uint32_t *timestamps = NULL;
+    double *values = NULL;
+    int rc = 0;
+    bool hold = false;
 
     // LOCK METRIC
     pthread_mutex_lock(&(m->lock));
 
-    while(mt_p) {
+    points = take_metric_points(m);
+
+    for (mt_p = points; mt_p; mt_p = mt_p->next)
+        nb_points++;
+
+    timestamps = malloc(sizeof(uint32_t) * (nb_points + 1));
+    values = malloc(sizeof(double) * (nb_points + 1));
+
+    for (mt_p = points, nb_points = 0; mt_p; mt_p = mt_p->next, nb_points++) {
+        timestamps[nb_points] = mt_p->timestamp;
+        values[nb_points] = mt_p->value;
+    }
+
+    if (nb_points)
+        rc = storage->write_points(m, timestamps, values, nb_points);
+
+    if (rc) {
+        error("%u points of metric %s not written", nb_points, m->name);
+        pthread_mutex_lock(&(monitoring->mutex_errors));
+        monitoring->write_errors++;
+        pthread_mutex_unlock(&(monitoring->mutex_errors));
+    }
+
+    /*
+     * With deferred propagation, the points are kept in log until the slots
+     * queued for the metric are propagated.
+     */
+    hold = rc == 0 && m->wsp_cache && m->wsp_cache->nb_pending;
+
+    if (rc && keep_failed) {
+        for (mt_p = points; mt_p && mt_p->next; mt_p = mt_p->next)
+            ;
+        prepend_metric_points(m, points, mt_p, nb_points);
+        points = NULL;
+    }
+
+    for (mt_p = points; mt_p; mt_p = mt_p_next) {
         mt_p_next = mt_p->next;
-        whisper_write_value(m, mt_p->timestamp, mt_p->value);
+        /* release points from write-ahead log by segment */
+        if (rc == 0 && mt_p->wal_segment != wal_segment) {
+            if (hold)
+                wal_hold(m, wal_segment, nb_wal_points);
+            else
+                wal_release(wal_segment, nb_wal_points);
+            wal_segment = mt_p->wal_segment;
+            nb_wal_points = 0;
+        }
+        nb_wal_points++;
         free(mt_p);
-        mt_p = mt_p_next; // jump to next metric_point_t
     }
 
-    /* empty metric_t */
-    m->nb_points = 0;
-    m->points = NULL;
-    m->last = NULL;
+    if (rc == 0 && hold)
+        wal_hold(m, wal_segment, nb_wal_points);
+    else if (rc == 0)
+        wal_release(wal_segment, nb_wal_points);
 
     // UNLOCK METRIC
     pthread_mutex_unlock(&(m->lock));
 
+    free(timestamps);
+    free(values);
+
+    return rc ? 1 : 0;
+
 }
 
 /*
- * Search the metric with the most points in cache among the DB
- * and return a pointer to it.
+ * Search the metric of storage root with the most points in cache among the
+ * DB and return a pointer to it. The DB is locked while walked since the
+ * metrics of other roots can be evicted by their writers.
  */
-metric_t * find_largest_metric() {
+metric_t * find_largest_metric(uint32_t root) {
 
-    metric_t *cur_m = db->first,
+    metric_t *cur_m = NULL,
              *max_m = NULL;
 
     uint32_t max_nb_points = 0;
 
-    while(cur_m) {
+    pthread_rwlock_rdlock(&(db->lock));
 
-        if (cur_m->nb_points > max_nb_points) {
+    for (cur_m = db->first; cur_m; cur_m = cur_m->next) {
+
+        if (cur_m->storage_root == root && cur_m->nb_points > max_nb_points) {
             max_m = cur_m;
             max_nb_points = cur_m->nb_points;
         }
-        cur_m = cur_m->next;
     }
 
+    pthread_rwlock_unlock(&(db->lock));
+
     return max_m;
 }
 
+/*
+ * Write all metrics of storage root with points in cache, in a single pass
+ * over the DB instead of searching the largest metric before each write. Then
+ * give back the freed memory to the system. Metrics are collected under the
+ * DB lock and written once it is released, as they are only evicted by this
+ * writer. Returns the number of metrics written.
+ */
+static uint32_t flush_all_metrics(struct writer_thread_args *w) {
+
+    metric_t *cur_m = NULL;
+    uint32_t nb_metrics = 0, i = 0;
+
+    pthread_rwlock_rdlock(&(db->lock));
+
+    for (cur_m = db->first; cur_m; cur_m = cur_m->next) {
+        if (cur_m->storage_root != w->root || cur_m->nb_points == 0)
+            continue;
+        if (nb_metrics == w->flush_size) {
+            w->flush_size = w->flush_size ? w->flush_size * 2 : 1024;
+            w->flush_list = realloc(w->flush_list,
+                                    w->flush_size * sizeof(metric_t *));
+        }
+        w->flush_list[nb_metrics++] = cur_m;
+    }
+
+    pthread_rwlock_unlock(&(db->lock));
+
+    for (i = 0; i < nb_metrics && conf->run; i++)
+        write_metric(w->flush_list[i], false);
+
+    malloc_trim(0);
+
+    return i;
+}
+
+/*
+ * Evict idle metrics of the writer root from database, at most once per
+ * period, and account them in monitoring metrics.
+ */
+static void writer_evict_idle_metrics(struct writer_thread_args *w) {
+
+    time_t now = time(NULL);
+    uint32_t nb_evicted = 0;
+
+    if (now - w->last_eviction < WRITER_EVICTION_PERIOD)
+        return;
+    w->last_eviction = now;
+
+    nb_evicted = evict_idle_metrics(db, conf->metric_idle_timeout, w->root);
+    if (nb_evicted == 0)
+        return;
+
+    /* it may point to an evicted metric */
+    w->locality_cursor = NULL;
+
+    debug("%u idle metrics evicted", nb_evicted);
+
+    pthread_mutex_lock(&(monitoring->mutex_eviction));
+    monitoring->evicted_metrics += nb_evicted;
+    pthread_mutex_unlock(&(monitoring->mutex_eviction));
+
+}
+
+/*
+ * Compare metrics by inode of their whisper file, which follows their
+ * location on disk for most filesystems. Metrics whose file is not known yet
+ * come last, sorted by name so that the files of the same directory are
+ * created together.
+ */
+static int compare_metrics_locality(const void *a, const void *b) {
+
+    const metric_t *ma = *(const metric_t **)a,
+                   *mb = *(const metric_t **)b;
+    ino_t ia = 0, ib = 0;
+
+    if (ma->wsp_cache && ma->wsp_cache->has_layout)
+        ia = ma->wsp_cache->inode;
+    if (mb->wsp_cache && mb->wsp_cache->has_layout)
+        ib = mb->wsp_cache->inode;
+
+    if (ia != ib) {
+        if (ia == 0 || ib == 0)
+            return ia == 0 ? 1 : -1;
+        return ia < ib ? -1 : 1;
+    }
+
+    return strcmp(ma->name, mb->name);
+}
+
+/*
+ * Collect a window of at most conf->write_window metrics of the writer root
+ * with points in cache, continuing the walk of the DB where the previous
+ * window stopped, and write them in locality order. Returns the number of
+ * metrics written.
+ */
+static uint32_t write_metrics_by_locality(struct writer_thread_args *w) {
+
+    metric_t *cur_m = NULL, *start = NULL;
+    uint32_t nb_metrics = 0, i = 0;
+
+    if (w->window_size != conf->write_window) {
+        w->window_size = conf->write_window;
+        w->window = realloc(w->window, w->window_size * sizeof(metric_t *));
+    }
+
+    pthread_rwlock_rdlock(&(db->lock));
+
+    start = w->locality_cursor ? w->locality_cursor : db->first;
+
+    for (cur_m = start; cur_m && nb_metrics < w->window_size; ) {
+        if (cur_m->storage_root == w->root && cur_m->nb_points)
+            w->window[nb_metrics++] = cur_m;
+        cur_m = cur_m->next ? cur_m->next : db->first;
+        if (cur_m == start)
+            break;
+    }
+
+    /* the cursor must not point to a metric evicted by another writer */
+    while (cur_m && cur_m->storage_root != w->root)
+        cur_m = cur_m->next;
+    w->locality_cursor = cur_m;
+
+    pthread_rwlock_unlock(&(db->lock));
+
+    qsort(w->window, nb_metrics, sizeof(metric_t *), compare_metrics_locality);
+
+    for (i = 0; i < nb_metrics; i++)
+        write_metric(w->window[i], false);
+
+    if (nb_metrics) {
+        debug("%u metrics written in locality order", nb_metrics);
+    }
+
+    return nb_metrics;
+}
+
+/*
+ * Syncs the files of metrics written according to the durability mode, every
+ * conf->durability_interval seconds or right now if force is true, and
+ * accounts the time spent in monitoring metrics.
+ */
+void writer_sync(bool force) {
+
+    static time_t last_sync = 0;
+    struct timespec start, end;
+    time_t now = time(NULL);
+    uint32_t nb_files = 0;
+
+    if (conf->durability == DURABILITY_NONE)
+        return;
+
+    if (!force && now - last_sync < conf->durability_interval)
+        return;
+    last_sync = now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (conf->durability == DURABILITY_PERIODIC)
+        whisper_syncfs_roots();
+    else
+        nb_files = storage->sync_files();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_mutex_lock(&(monitoring->mutex_sync));
+    monitoring->syncs++;
+    monitoring->synced_files += nb_files;
+    monitoring->sync_time += (end.tv_sec - start.tv_sec) * 1000.0
+                             + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+    pthread_mutex_unlock(&(monitoring->mutex_sync));
+
+}
+
 void * writer_thread(void * thread_args) {
 
     struct writer_thread_args * w_thd_args = (struct writer_thread_args *) thread_args;
@@ -86,7 +330,8 @@ void * writer_thread(void * thread_args) {
      */
     block_signals();
 
-    debug("thread %u is running", w_thd_args->id_thread);
+    debug("thread %u is running for storage root %s", w_thd_args->id_thread,
+          whisper_root_dir(w_thd_args->root));
 
     thread_run_lock(me);
 
@@ -96,12 +341,45 @@ void * writer_thread(void * thread_args) {
             thread_pause_and_wait_run_signal(me);
         }
 
-        max_m = find_largest_metric();
+        if (conf->metric_idle_timeout)
+            writer_evict_idle_metrics(w_thd_args);
+
+        /* tasks shared by all roots are done by the first writer */
+        if (w_thd_args->root == 0)
+            writer_sync(false);
+
+        /* reload spilled points once cache has room for them */
+        if (w_thd_args->root == 0
+            && conf->cache_spill && !monitoring->under_pressure
+            && db->nb_points < conf->cache_spill_threshold / 2
+            && spill_pending())
+            spill_reload(conf->cache_spill_threshold / 4);
+
+        /* under memory pressure, flush everything as fast as possible */
+        if (monitoring->under_pressure) {
+            if (flush_all_metrics(w_thd_args) == 0)
+                sleep(1);
+            if (conf->wal_enabled)
+                wal_truncate();
+            continue;
+        }
+
+        if (conf->write_order == WRITE_ORDER_LOCALITY) {
+            if (write_metrics_by_locality(w_thd_args) == 0)
+                sleep(1);
+            else if (conf->wal_enabled)
+                wal_truncate();
+            continue;
+        }
+
+        max_m = find_largest_metric(w_thd_args->root);
 
         if (max_m) {
             debug("largest metric: %s nb_points: %u", max_m->name, max_m->nb_points);
             /* write metric on disk */
-            write_metric(max_m);
+            write_metric(max_m, false);
+            if (conf->wal_enabled)
+                wal_truncate();
         } else {
             /* empty database */
             sleep(1);
@@ -111,23 +389,132 @@ void * writer_thread(void * thread_args) {
     return NULL;
 }
 
-carbon_thread_t *launch_writer_thread() {
+/*
+ * Launch one writer thread per storage root, so that the roots on different
+ * disks are written in parallel. Returns the array of threads and sets
+ * nb_threads.
+ */
+carbon_thread_t ** launch_writer_threads(int *nb_threads) {
 
-    carbon_thread_t *thread;
+    carbon_thread_t **writer_threads = NULL;
     struct writer_thread_args * w_thd_args = NULL;
+    uint32_t id_thread = 0, nb_roots = whisper_nb_roots();
+
+    writer_threads = calloc(nb_roots, sizeof(carbon_thread_t *));
+
+    for (id_thread = 0; id_thread < nb_roots; id_thread++) {
 
-    thread = calloc(1, sizeof(carbon_thread_t));
-    thread_init(thread, "writer");
+        writer_threads[id_thread] = calloc(1, sizeof(carbon_thread_t));
+        thread_init(writer_threads[id_thread], "writer");
 
-    w_thd_args = (struct writer_thread_args *) malloc(sizeof(struct writer_thread_args));
-    w_thd_args->id_thread = 0;
-    w_thd_args->thread = thread;
+        w_thd_args = (struct writer_thread_args *) calloc(1, sizeof(struct writer_thread_args));
+        w_thd_args->id_thread = id_thread;
+        w_thd_args->thread = writer_threads[id_thread];
+        w_thd_args->root = id_thread;
 
-    if (pthread_create(&(thread->pthread), NULL, writer_thread, (void*)w_thd_args) != 0) {
-        error("error on pthread_create: %s\n", strerror(errno));
-        exit(1);
+        if (pthread_create(&(writer_threads[id_thread]->pthread), NULL, writer_thread, (void*)w_thd_args) != 0) {
+            error("error on pthread_create: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    *nb_threads = nb_roots;
+
+    return writer_threads;
+
+}
+
+/* state shared by drain threads */
+struct writer_drain_s {
+    metric_t *next;     /* next metric to write */
+    time_t deadline;
+    uint32_t nb_written;
+    uint32_t nb_failed;  /* metrics whose points could not be written */
+    pthread_mutex_t lock;
+};
+
+static void * writer_drain_thread(void *arg) {
+
+    struct writer_drain_s *drain = (struct writer_drain_s *) arg;
+    metric_t *metric = NULL;
+    uint32_t nb_points = 0;
+
+    while (time(NULL) < drain->deadline) {
+
+        pthread_mutex_lock(&drain->lock);
+        metric = drain->next;
+        if (metric)
+            drain->next = metric->next;
+        pthread_mutex_unlock(&drain->lock);
+
+        if (metric == NULL)
+            break;
+
+        nb_points = metric->nb_points;
+        if (nb_points == 0)
+            continue;
+
+        /* failed points are left in cache, with the abandoned ones */
+        if (write_metric(metric, true))
+            __sync_add_and_fetch(&drain->nb_failed, 1);
+        else
+            __sync_add_and_fetch(&drain->nb_written, nb_points);
     }
 
-    return thread;
+    return NULL;
+
+}
+
+/*
+ * Write all the points in cache with conf->shutdown_drain_threads threads in
+ * parallel, until conf->shutdown_drain_timeout is reached. Must be called
+ * once receivers and writer are stopped. Points not written in time or which
+ * could not be written are left in cache. Returns the number of metrics whose
+ * points could not be written.
+ */
+uint32_t writer_drain() {
+
+    struct writer_drain_s drain;
+    pthread_t *drainers = NULL;
+    metric_t *metric = NULL;
+    uint32_t nb_abandoned = 0;
+    int id_thread = 0, nb_threads = conf->shutdown_drain_threads;
+    time_t start = time(NULL);
+
+    drain.next = db->first;
+    drain.deadline = start + conf->shutdown_drain_timeout;
+    drain.nb_written = 0;
+    drain.nb_failed = 0;
+    pthread_mutex_init(&drain.lock, NULL);
+
+    drainers = calloc(nb_threads, sizeof(pthread_t));
+
+    for (id_thread = 0; id_thread < nb_threads; id_thread++)
+        if (pthread_create(&drainers[id_thread], NULL, writer_drain_thread, &drain) != 0) {
+            error("error on pthread_create: %s\n", strerror(errno));
+            break;
+        }
+
+    nb_threads = id_thread;
+    for (id_thread = 0; id_thread < nb_threads; id_thread++)
+        pthread_join(drainers[id_thread], NULL);
+
+    if (conf->wal_enabled)
+        wal_truncate();
+
+    for (metric = db->first; metric; metric = metric->next)
+        nb_abandoned += metric->nb_points;
+
+    info("shutdown drain: %u points written, %u abandoned in %lds with %d "
+         "threads", drain.nb_written, nb_abandoned,
+         (long) (time(NULL) - start), nb_threads);
+    if (drain.nb_failed)
+        error("shutdown drain: points of %u metrics not written",
+              drain.nb_failed);
+
+    pthread_mutex_destroy(&drain.lock);
+    free(drainers);
+
+    return drain.nb_failed;
 
 }
@@ -29,6 +29,10 @@
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <time.h>
+#include <malloc.h> // malloc_trim()
+#include <fcntl.h>
+#include <sys/syscall.h>
 
 #include "common.h"
 #include "database.h"
@@ -38,9 +42,20 @@
 struct writer_thread_args {
     unsigned int id_thread;
     carbon_thread_t *thread;
+    uint32_t root; /* storage root whose metrics are written */
+    /* next metric of the DB to consider for the window of locality order */
+    metric_t *locality_cursor;
+    metric_t **window;
+    uint32_t window_size;
+    /* metrics collected for a flush of the whole cache */
+    metric_t **flush_list;
+    uint32_t flush_size;
+    time_t last_eviction;
 };
 
 void * writer_thread(void *);
-carbon_thread_t * launch_writer_thread();
+carbon_thread_t ** launch_writer_threads(int *);
+uint32_t writer_drain();
+void writer_sync(bool);
 
 #endif